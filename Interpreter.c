@@ -16,6 +16,8 @@ typedef struct _InterpreterPriv
   const StoryReader *story_reader;
   GString *transcript;
   char *temp_dir;
+  char *autosave_dir;
+  char *resume_file;
   InterpreterStateChangeCallback state_change_callback;
   void *state_change_callback_data;
   MainWindow *main_window;
@@ -54,6 +56,16 @@ static void interpreter_dispose (GObject *_self)
     free (self->priv->temp_dir);
     self->priv->temp_dir = NULL;
   }
+  if (self->priv->autosave_dir)
+  {
+    free (self->priv->autosave_dir);
+    self->priv->autosave_dir = NULL;
+  }
+  if (self->priv->resume_file)
+  {
+    free (self->priv->resume_file);
+    self->priv->resume_file = NULL;
+  }
   self->dispose_has_run = TRUE;
   if (self->priv->terminal)
   {
@@ -201,6 +213,57 @@ void interpreter_set_temp_dir (Interpreter *self,
   }
 
 
+/*======================================================================
+  interpreter_get_autosave_dir
+======================================================================*/
+const char *interpreter_get_autosave_dir (const Interpreter *self)
+  {
+  return self->priv->autosave_dir;
+  }
+
+
+/*======================================================================
+  interpreter_set_autosave_dir
+======================================================================*/
+void interpreter_set_autosave_dir (Interpreter *self, 
+     const char *autosave_dir)
+  {
+  self->priv->autosave_dir = strdup (autosave_dir);
+  }
+
+
+/*======================================================================
+  interpreter_find_checkpoint
+Only the particular kind of interpreter knows how its checkpoints are
+named; one that doesn't take any has none to find
+======================================================================*/
+char *interpreter_find_checkpoint (Interpreter *self)
+  {
+  if (!INTERPRETER_GET_CLASS (self)->interpreter_find_checkpoint)
+    return NULL;
+  return INTERPRETER_GET_CLASS (self)->interpreter_find_checkpoint (self);
+  }
+
+
+/*======================================================================
+  interpreter_get_resume_file
+======================================================================*/
+const char *interpreter_get_resume_file (const Interpreter *self)
+  {
+  return self->priv->resume_file;
+  }
+
+
+/*======================================================================
+  interpreter_set_resume_file
+======================================================================*/
+void interpreter_set_resume_file (Interpreter *self, 
+     const char *resume_file)
+  {
+  self->priv->resume_file = strdup (resume_file);
+  }
+
+
 /*======================================================================
   interpreter_set_state_chance_callback
 ======================================================================*/
@@ -18,7 +18,8 @@ typedef struct _InterpreterClass  InterpreterClass;
 typedef enum 
   {
   ISC_WAIT_FOR_INPUT = 0,
-  ISC_INPUT_COMPLETED = 1
+  ISC_INPUT_COMPLETED = 1,
+  ISC_FINISHED = 2 // The story has ended, and the interpreter can go
   } InterpreterStateChange;
 
 typedef void (*InterpreterStateChangeCallback) 
@@ -41,6 +42,7 @@ struct _InterpreterClass
     (struct _Interpreter *self);
   void (*interpreter_run)(struct _Interpreter *self);
   void (*interpreter_child_finished)(struct _Interpreter *self);
+  char *(*interpreter_find_checkpoint)(struct _Interpreter *self);
   };
 
 GType interpreter_get_type (void);
@@ -49,6 +51,8 @@ Interpreter *interpreter_new (void);
 
 struct _StoryTerminal *interpreter_get_terminal (Interpreter *self);
 
+// Starts the story, and returns at once. The interpreter reports
+//  ISC_FINISHED when the story ends
 void interpreter_run (Interpreter *self);
 
 void interpreter_child_finished (Interpreter * self);
@@ -62,6 +66,21 @@ const struct _StoryReader *interpreter_get_story_reader
 const char *interpreter_get_temp_dir (const Interpreter *self);
 void interpreter_set_temp_dir (Interpreter *self, const char *temp_dir);
 
+// Checkpoints of the story are saved every so often under this
+//  directory, if it is set
+const char *interpreter_get_autosave_dir (const Interpreter *self);
+void interpreter_set_autosave_dir (Interpreter *self, 
+  const char *autosave_dir);
+
+// The latest checkpoint of this story, from an earlier session, or
+//  NULL if there is none. The caller must free it
+char *interpreter_find_checkpoint (Interpreter *self);
+
+// Start the story from this checkpoint, rather than the beginning
+const char *interpreter_get_resume_file (const Interpreter *self);
+void interpreter_set_resume_file (Interpreter *self, 
+  const char *resume_file);
+
 void interpreter_append_to_transcript (Interpreter *self, const char *s);
 
 void interpreter_append_utf16_to_transcript (Interpreter *self, 
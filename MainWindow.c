@@ -30,12 +30,13 @@ static char *mainwindow_about_message = "\n" APPNAME
 
 void mainwindow_setup_ui (MainWindow *self);
 void mainwindow_set_size_according_to_terminal (MainWindow *self);
+static void mainwindow_interpreter_finished (MainWindow *self);
 
 // Ugly frig -- this int only makes sense to frotz, which this class is
 // not supposed to know about. But the thought of implementing a half-dozen
 // new virtual methods just to set this trivial variable was more than
-// I could face
-extern int err_report_mode;
+// I could face. The interpreter picks it up at its next input
+extern int zmachine_err_report_mode;
 
 /*======================================================================
   mainwindow_request_quit
@@ -45,9 +46,9 @@ static gboolean mainwindow_request_quit (MainWindow *self)
 
   if (self->story_reader)
     {
-    // We _can't_ shut down elegantly -- this method is probably
-    //  being called from deep within the interpreter somewhere,
-    //  and cleaning up the UI would just cause it to crash
+    // We _can't_ shut down elegantly -- the interpreter thread is
+    //  somewhere in the middle of the story, and there's no way
+    //  to stop it cleanly
     // TODO -- prompt
     exit (0);
     }
@@ -122,6 +123,21 @@ static gboolean mainwindow_prev_word_event_callback (GtkMenuItem *w,
 }
 
 
+/*======================================================================
+  mainwindow_rewind_event_callback
+======================================================================*/
+static gboolean mainwindow_rewind_event_callback (GtkMenuItem *w, 
+  gpointer user_data)
+{
+  MainWindow *self = (MainWindow *)user_data;
+  if (self->terminal)
+  {
+    storyterminal_rewind (self->terminal);
+  }
+  return FALSE;
+}
+
+
 /*======================================================================
   mainwindow_kill_line_from_cursor_event_callback
 ======================================================================*/
@@ -214,7 +230,7 @@ static gboolean mainwindow_prefs_event_callback (GtkMenuItem *w,
   {
     const Settings *new_settings = settingsdialog_get_new_settings (d);
 
-    err_report_mode = new_settings->error_level;
+    zmachine_err_report_mode = new_settings->error_level;
 
     if (self->settings->user_screen_width != 
             new_settings->user_screen_width
@@ -399,8 +415,13 @@ void mainwindow_transcript_event_callback (GtkMenuItem *mi,
   MainWindow *self = (MainWindow *)user_data;
   if (self->interpreter)
   {
+  // Each character of the transcript is one the interpreter counted
+  //  into its scrollback, so the cursor's place picks out a turn
   const GString *s = interpreter_get_transcript (self->interpreter);
-  dialogs_show_text (GTK_WINDOW (self), s->str);
+  long position = dialogs_choose_in_text (GTK_WINDOW (self), s->str, 
+    "_Go back to here");
+  if (position >= 0 && self->terminal)
+    storyterminal_rewind_to (self->terminal, position);
   }
 }
 
@@ -493,6 +514,12 @@ static GtkMenuBar* mainwindow_create_menu (MainWindow *self,
        self);       
   gtk_menu_shell_append (GTK_MENU_SHELL (editMenuMenu), 
     GTK_WIDGET (pasteQuitMenuItem));
+  GtkMenuItem *rewindMenuItem = GTK_MENU_ITEM 
+    (gtk_menu_item_new_with_mnemonic ("_Go back to turn..."));
+  g_signal_connect (G_OBJECT(rewindMenuItem), "activate",
+     G_CALLBACK (mainwindow_rewind_event_callback), self);       
+  gtk_menu_shell_append (GTK_MENU_SHELL (editMenuMenu), 
+    GTK_WIDGET (rewindMenuItem));
   gtk_menu_item_set_submenu (self->edit_menu, GTK_WIDGET (editMenuMenu));
   gtk_menu_shell_append (GTK_MENU_SHELL (menuBar), 
     GTK_WIDGET (self->edit_menu));
@@ -509,6 +536,8 @@ static GtkMenuBar* mainwindow_create_menu (MainWindow *self,
       "activate", accel_group, GDK_Right, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE); 
   gtk_widget_add_accelerator(GTK_WIDGET(prevWordMenuItem), 
       "activate", accel_group, GDK_Left, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE); 
+  gtk_widget_add_accelerator(GTK_WIDGET(rewindMenuItem), 
+      "activate", accel_group, GDK_t, GDK_MOD1_MASK, GTK_ACCEL_VISIBLE); 
 
 
   // View menu
@@ -612,6 +641,9 @@ void mainwindow_interpeter_state_change_callback
     case ISC_INPUT_COMPLETED:
       gtk_widget_set_sensitive (GTK_WIDGET (self->edit_menu), FALSE);
       break;
+    case ISC_FINISHED:
+      mainwindow_interpreter_finished (self);
+      break;
     }
 
   }
@@ -676,10 +708,10 @@ void mainwindow_set_gdk_background_colour (MainWindow *self, RGB8COLOUR bg)
 
 /*======================================================================
   mainwindow_open_file
-  Note that this method opens the file and runs the interpreter
-  It does not return until interpretation is complete. All
-  UI operations are carried out by peeking the GTK event loop from
-  within the interpreter
+  Note that this method opens the file and starts the interpreter,
+  which runs on its own thread. It returns at once; the interpreter
+  sends its output back to this thread, and when the story ends we
+  tidy up in mainwindow_interpreter_finished
 ======================================================================*/
 void mainwindow_open_file (MainWindow *self, const char *filename)
 {
@@ -733,15 +765,26 @@ void mainwindow_open_file (MainWindow *self, const char *filename)
 
     mainwindow_setup_ui (self);
 
+    // A story that quits clears its checkpoints, so if an earlier
+    //  session left one, it ended some other way -- offer to carry on
+    //  from it
+    char *checkpoint = interpreter_find_checkpoint (self->interpreter);
+    if (checkpoint)
+    {
+      GtkDialog *d = GTK_DIALOG (gtk_message_dialog_new (GTK_WINDOW(self),
+        GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION, 
+        GTK_BUTTONS_YES_NO,
+        "This story was saved automatically when it was last played. "
+        "Carry on from where it left off?"));
+      if (gtk_dialog_run (d) == GTK_RESPONSE_YES)
+        interpreter_set_resume_file (self->interpreter, checkpoint);
+      gtk_widget_destroy (GTK_WIDGET (d));
+      free (checkpoint);
+    }
+
     interpreter_set_state_change_callback 
       (self->interpreter, mainwindow_interpeter_state_change_callback, self);
     interpreter_run (self->interpreter);
-
-    g_object_unref (self->interpreter);
-    storyreader_close (self->story_reader);
-    gtk_container_add (GTK_CONTAINER (self->terminal_container), 
-      GTK_WIDGET (gtk_label_new(mainwindow_about_message)));
-    gtk_widget_show_all (GTK_WIDGET (self->terminal_container));
   }
   else
   {
@@ -752,8 +795,27 @@ void mainwindow_open_file (MainWindow *self, const char *filename)
       gtk_dialog_run (d);
       gtk_widget_destroy (GTK_WIDGET (d));
       g_error_free (error);
-      return;
+      // Tidy up as if the story had run
+      g_object_unref (self->story_reader);
+      self->story_reader = NULL;
+      self->interpreter = NULL;
+      self->terminal = NULL;
+      mainwindow_setup_ui (self);
   }
+}
+
+
+/*======================================================================
+  mainwindow_interpreter_finished
+  The story started by mainwindow_open_file has ended
+======================================================================*/
+static void mainwindow_interpreter_finished (MainWindow *self)
+{
+  g_object_unref (self->interpreter);
+  storyreader_close (self->story_reader);
+  gtk_container_add (GTK_CONTAINER (self->terminal_container), 
+    GTK_WIDGET (gtk_label_new(mainwindow_about_message)));
+  gtk_widget_show_all (GTK_WIDGET (self->terminal_container));
 
   g_object_unref (self->story_reader);
   self->story_reader = NULL;
@@ -878,7 +940,7 @@ MainWindow *mainwindow_new (Settings *settings, const char *temp_dir)
   self->settings = g_object_ref (settings);
   self->temp_dir = strdup (temp_dir);
   mainwindow_setup_layout (self);
-  err_report_mode = settings->error_level;
+  zmachine_err_report_mode = settings->error_level;
   return self;
 }
 
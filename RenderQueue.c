@@ -0,0 +1,286 @@
+#include <string.h>
+#include <stdlib.h>
+#include "RenderQueue.h"
+
+// Must be a power of two
+#define RQ_SIZE 1024
+
+// How often the GTK thread drains the queue
+#define RQ_FRAME_MSEC 20
+
+struct _RenderQueue
+  {
+  RenderCommand ring[RQ_SIZE];
+  // The indices run freely, and are masked to index the ring. head
+  //  is written only by the worker, tail only by the GTK thread
+  volatile gint head;
+  volatile gint tail;
+  // Worker only: the slot at head holds a text run not yet posted
+  gboolean run_open;
+  // The worker is a coroutine on the GTK thread, and drains the
+  //  queue itself rather than waiting for it to be drained
+  gboolean inline_drain;
+  int calls_posted;
+  // GTK thread only
+  RenderQueueHandler handler;
+  void *user_data;
+  guint timer;
+  gboolean draining;
+  // Set while a wake-up is queued on the GTK main loop
+  volatile gint wake_pending;
+  // renderqueue_call waits on these for its command to be handled
+  GMutex *mutex;
+  GCond *cond;
+  int calls_done;
+  };
+
+
+/*======================================================================
+  renderqueue_timer
+======================================================================*/
+static gboolean renderqueue_timer (gpointer user_data)
+  {
+  renderqueue_drain ((RenderQueue *) user_data);
+  return TRUE;
+  }
+
+
+/*======================================================================
+  renderqueue_wake_idle
+======================================================================*/
+static gboolean renderqueue_wake_idle (gpointer user_data)
+  {
+  RenderQueue *self = (RenderQueue *) user_data;
+  g_atomic_int_set (&self->wake_pending, 0);
+  renderqueue_drain (self);
+  return FALSE;
+  }
+
+
+/*======================================================================
+  renderqueue_wake
+Get the GTK thread to drain the queue now, rather than at the next
+frame. Safe to call from any thread
+======================================================================*/
+static void renderqueue_wake (RenderQueue *self)
+  {
+  if (g_atomic_int_compare_and_exchange (&self->wake_pending, 0, 1))
+    g_idle_add (renderqueue_wake_idle, self);
+  }
+
+
+/*======================================================================
+  renderqueue_new
+Must be called on the GTK thread, which will call the handler for
+each command
+======================================================================*/
+RenderQueue *renderqueue_new (RenderQueueHandler handler, void *user_data)
+  {
+  RenderQueue *self = (RenderQueue *) malloc (sizeof (RenderQueue));
+  memset (self, 0, sizeof (RenderQueue));
+  self->handler = handler;
+  self->user_data = user_data;
+  self->mutex = g_mutex_new ();
+  self->cond = g_cond_new ();
+  self->timer = g_timeout_add (RQ_FRAME_MSEC, renderqueue_timer, self);
+  return self;
+  }
+
+
+/*======================================================================
+  renderqueue_set_inline
+For a worker that runs on the GTK thread itself, as a coroutine: 
+instead of waiting for the GTK thread to drain the queue, the worker
+drains it
+======================================================================*/
+void renderqueue_set_inline (RenderQueue *self, gboolean inline_drain)
+  {
+  self->inline_drain = inline_drain;
+  }
+
+
+/*======================================================================
+  renderqueue_free
+The worker must have finished with the queue
+======================================================================*/
+void renderqueue_free (RenderQueue *self)
+  {
+  g_source_remove (self->timer);
+  while (g_source_remove_by_user_data (self));
+  g_mutex_free (self->mutex);
+  g_cond_free (self->cond);
+  free (self);
+  }
+
+
+/*======================================================================
+  renderqueue_publish
+Hand the slot at head over to the GTK thread
+======================================================================*/
+static void renderqueue_publish (RenderQueue *self)
+  {
+  g_atomic_int_set (&self->head, self->head + 1);
+  self->run_open = FALSE;
+  }
+
+
+/*======================================================================
+  renderqueue_wait_for_space
+Returns the free slot at head, waiting for the GTK thread to catch up
+if the ring is full
+======================================================================*/
+static RenderCommand *renderqueue_wait_for_space (RenderQueue *self)
+  {
+  while (self->head - g_atomic_int_get (&self->tail) >= RQ_SIZE)
+    {
+    if (self->inline_drain)
+      {
+      renderqueue_drain (self);
+      continue;
+      }
+    renderqueue_wake (self);
+    g_usleep (1000);
+    }
+  return &self->ring[self->head & (RQ_SIZE - 1)];
+  }
+
+
+/*======================================================================
+  renderqueue_flush
+Make any open run of text visible to the GTK thread
+======================================================================*/
+void renderqueue_flush (RenderQueue *self)
+  {
+  if (self->run_open)
+    renderqueue_publish (self);
+  }
+
+
+/*======================================================================
+  renderqueue_post
+Copy the command into the queue
+======================================================================*/
+void renderqueue_post (RenderQueue *self, const RenderCommand *command)
+  {
+  renderqueue_flush (self);
+  RenderCommand *slot = renderqueue_wait_for_space (self);
+  memcpy (slot, command, sizeof (RenderCommand));
+  renderqueue_publish (self);
+  }
+
+
+/*======================================================================
+  renderqueue_post_op
+Post a command that needs nothing but integer arguments
+======================================================================*/
+void renderqueue_post_op (RenderQueue *self, int op, int a, int b, int c,
+    int d, int e)
+  {
+  renderqueue_flush (self);
+  RenderCommand *slot = renderqueue_wait_for_space (self);
+  slot->op = op;
+  slot->args[0] = a;
+  slot->args[1] = b;
+  slot->args[2] = c;
+  slot->args[3] = d;
+  slot->args[4] = e;
+  slot->ptr = NULL;
+  slot->result = NULL;
+  slot->len = 0;
+  slot->serial = 0;
+  renderqueue_publish (self);
+  }
+
+
+/*======================================================================
+  renderqueue_post_char
+Add a character to the open run of text for this op, starting a new
+run if there isn't one
+======================================================================*/
+void renderqueue_post_char (RenderQueue *self, int op, gunichar2 c)
+  {
+  RenderCommand *slot;
+  if (self->run_open)
+    {
+    slot = &self->ring[self->head & (RQ_SIZE - 1)];
+    if (slot->op != op)
+      {
+      renderqueue_publish (self);
+      slot = NULL;
+      }
+    }
+  else
+    slot = NULL;
+
+  if (!slot)
+    {
+    slot = renderqueue_wait_for_space (self);
+    slot->op = op;
+    slot->ptr = NULL;
+    slot->result = NULL;
+    slot->len = 0;
+    slot->serial = 0;
+    self->run_open = TRUE;
+    }
+
+  slot->text[slot->len++] = c;
+  if (slot->len == RQ_TEXT_RUN)
+    renderqueue_publish (self);
+  }
+
+
+/*======================================================================
+  renderqueue_call
+Post the command and wait until the GTK thread has handled it. The
+handler can pass results back through command->result and
+command->ptr, which belong to the caller
+======================================================================*/
+void renderqueue_call (RenderQueue *self, RenderCommand *command)
+  {
+  command->serial = ++self->calls_posted;
+  renderqueue_post (self, command);
+  if (self->inline_drain)
+    {
+    renderqueue_drain (self);
+    return;
+    }
+  renderqueue_wake (self);
+
+  g_mutex_lock (self->mutex);
+  while (self->calls_done < command->serial)
+    g_cond_wait (self->cond, self->mutex);
+  g_mutex_unlock (self->mutex);
+  }
+
+
+/*======================================================================
+  renderqueue_drain
+Handle the commands posted so far. Anything posted meanwhile waits
+for the next frame. A handler that runs a nested main loop -- to wait
+for input, say -- won't be re-entered
+======================================================================*/
+void renderqueue_drain (RenderQueue *self)
+  {
+  if (self->draining) return;
+  self->draining = TRUE;
+
+  int head = g_atomic_int_get (&self->head);
+  int tail = self->tail;
+  while (tail != head)
+    {
+    const RenderCommand *command = &self->ring[tail & (RQ_SIZE - 1)];
+    self->handler (command, self->user_data);
+    if (command->serial)
+      {
+      g_mutex_lock (self->mutex);
+      self->calls_done = command->serial;
+      g_cond_broadcast (self->cond);
+      g_mutex_unlock (self->mutex);
+      }
+    tail++;
+    g_atomic_int_set (&self->tail, tail);
+    }
+
+  self->draining = FALSE;
+  }
+
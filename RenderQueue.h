@@ -0,0 +1,62 @@
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*======================================================================
+RenderQueue carries display commands from a worker thread to the
+GTK thread. The worker posts commands, which are copied into a fixed
+ring; the GTK thread drains the ring from a timer, once per frame,
+passing each command to a handler. There is one producer and one
+consumer, so the ring needs no lock: each side owns one index.
+
+Runs of text are batched into a single command. A run stays open,
+and so invisible to the GTK thread, until something else is posted,
+it fills, or the worker calls renderqueue_flush.
+
+A command posted with renderqueue_call is handled as soon as the
+GTK thread can get to it, and the worker waits until it has been.
+That's the way for the worker to ask for anything that needs an
+answer from the GTK side, input included.
+
+The worker can also be a coroutine on the GTK thread. Then it mustn't
+wait for the GTK thread, which it's running on: after
+renderqueue_set_inline, it drains the queue itself when it needs to.
+======================================================================*/
+
+#define RQ_TEXT_RUN 48
+
+typedef struct _RenderCommand
+  {
+  int op;
+  int args[5];
+  void *ptr;
+  int *result; // For renderqueue_call; owned by the caller
+  int len;
+  gunichar2 text[RQ_TEXT_RUN];
+  int serial;
+  } RenderCommand;
+
+typedef struct _RenderQueue RenderQueue;
+
+typedef void (*RenderQueueHandler) (const RenderCommand *command,
+    void *user_data);
+
+RenderQueue *renderqueue_new (RenderQueueHandler handler, void *user_data);
+void renderqueue_free (RenderQueue *self);
+void renderqueue_set_inline (RenderQueue *self, gboolean inline_drain);
+
+// Worker thread
+void renderqueue_post (RenderQueue *self, const RenderCommand *command);
+void renderqueue_post_op (RenderQueue *self, int op, int a, int b, int c,
+    int d, int e);
+void renderqueue_post_char (RenderQueue *self, int op, gunichar2 c);
+void renderqueue_flush (RenderQueue *self);
+void renderqueue_call (RenderQueue *self, RenderCommand *command);
+
+// GTK thread
+void renderqueue_drain (RenderQueue *self);
+
+G_END_DECLS
+
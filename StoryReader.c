@@ -315,6 +315,13 @@ Interpreter *storyreader_open (StoryReader *self,
   zmachine_set_story_file (zm, story_filename->str);
   interpreter_set_story_reader (INTERPRETER (zm), self);
   interpreter_set_temp_dir (INTERPRETER (zm), temp_dir);
+  // Checkpoints are kept alongside the settings
+  GString *config_dir = fileutils_get_dirname (settings->filename);
+  GString *autosave_dir = fileutils_concat_path (config_dir->str, 
+    "autosave");
+  interpreter_set_autosave_dir (INTERPRETER (zm), autosave_dir->str);
+  g_string_free (autosave_dir, TRUE);
+  g_string_free (config_dir, TRUE);
   zmachine_set_user_interpreter_number 
     (zm, settings->user_interpreter_number);
   if (settings->user_tandy_bit)
@@ -45,6 +45,9 @@ typedef struct _StoryTerminalPriv
   int font_size;
   // Input buffer is an array of STInput objects. NOT POINTERS!
   GArray *input_event_array; 
+  // Running while we wait for input; quit when some arrives
+  GMainLoop *input_loop;
+  gboolean input_timed_out;
   GdkPixmap *graphics_buffer;
   GdkGC *gc;
   gboolean dirty;
@@ -248,6 +251,8 @@ void storyterminal_add_to_input_buffer (StoryTerminal *self,
   STInput input;
   memcpy (&input, _input, sizeof (STInput));
   g_array_append_val (self->priv->input_event_array, input);
+  if (self->priv->input_loop)
+    g_main_loop_quit (self->priv->input_loop);
   }
 
 /*======================================================================
@@ -637,6 +642,18 @@ void storyterminal_set_font_size
   }
 
 
+/*======================================================================
+  storyterminal_input_timeout
+======================================================================*/
+static gboolean storyterminal_input_timeout (gpointer user_data)
+  {
+  StoryTerminal *self = STORYTERMINAL (user_data);
+  self->priv->input_timed_out = TRUE;
+  g_main_loop_quit (self->priv->input_loop);
+  return FALSE;
+  }
+
+
 /*======================================================================
   storyterminal_wait_for_input
   TODO: show cursor
@@ -664,20 +681,26 @@ void storyterminal_wait_for_input (StoryTerminal *self, STInput *input,
     }
 
   memset (input, 0, sizeof (STInput));
-  long elapsed = 0; // msec
 
-  while (self->priv->input_event_array->len == 0)
+  if (self->priv->input_event_array->len == 0)
     {
     // TODO check if mouse input is OK
-    usleep (50000); // 50 msec idle
-    elapsed += 50; 
-    while (gtk_events_pending()) gtk_main_iteration();
-    if (timeout > 0 && elapsed > timeout)
+    // Run the main loop until some input arrives, or we time out
+    guint timer = 0;
+    self->priv->input_timed_out = FALSE;
+    self->priv->input_loop = g_main_loop_new (NULL, FALSE);
+    if (timeout > 0)
+      timer = g_timeout_add (timeout, storyterminal_input_timeout, self);
+    g_main_loop_run (self->priv->input_loop);
+    g_main_loop_unref (self->priv->input_loop);
+    self->priv->input_loop = NULL;
+
+    if (self->priv->input_timed_out)
       {
-      memset (input, 0, sizeof (STInput));
       input->type = ST_INPUT_TIMEOUT;
       return;
       }
+    if (timer) g_source_remove (timer);
     }
 
   if (show_cursor)
@@ -1708,6 +1731,31 @@ void storyterminal_go_to_prev_word (StoryTerminal *self)
   }
 
 
+/*======================================================================
+  storyterminal_rewind
+  Asks the interpreter to go back to an earlier turn, which it does
+  when it next reads a line
+=====================================================================*/
+void storyterminal_rewind (StoryTerminal *self)
+  {
+  storyterminal_rewind_to (self, -1);
+  }
+
+
+/*======================================================================
+  storyterminal_rewind_to
+  As storyterminal_rewind, but to the turn that a place in the
+  transcript, in characters from its start, belongs to
+=====================================================================*/
+void storyterminal_rewind_to (StoryTerminal *self, long position)
+  {
+  STInput input;
+  input.type = ST_INPUT_REWIND;
+  input.position = position;
+  storyterminal_add_to_input_buffer (self, &input);
+  }
+
+
 /*======================================================================
   storyterminal_set_main_window
 =====================================================================*/
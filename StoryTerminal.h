@@ -29,7 +29,8 @@ typedef enum
   ST_INPUT_KILL_LINE_FROM_CURSOR = 5, 
   ST_INPUT_KILL_LINE = 6, 
   ST_INPUT_NEXT_WORD = 7, 
-  ST_INPUT_PREV_WORD = 8 
+  ST_INPUT_PREV_WORD = 8,
+  ST_INPUT_REWIND = 9
   } STInputType;
 
 #define STSTYLE_NORMAL   0x0000
@@ -54,6 +55,7 @@ typedef struct _STInput
   int key; // GDK keycode
   int mouse_x;
   int mouse_y;
+  long position; // For ST_INPUT_REWIND: place in the transcript, or -1
   } STInput;
 
 
@@ -195,6 +197,10 @@ void storyterminal_go_to_next_word (StoryTerminal *self);
 
 void storyterminal_go_to_prev_word (StoryTerminal *self);
 
+void storyterminal_rewind (StoryTerminal *self);
+
+void storyterminal_rewind_to (StoryTerminal *self, long position);
+
 void storyterminal_get_unit_size (const StoryTerminal *self, int *r, 
     int *c);
 
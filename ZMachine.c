@@ -6,20 +6,110 @@
 #include "ZTerminal.h"
 #include "ZMachine.h"
 #include "StoryTerminal.h"
-#include "frotz.h"
 #include "charutils.h"
 #include "StoryReader.h"
 #include "Picture.h"
 #include "Sound.h"
 #include "fileutils.h"
 #include "MediaPlayer.h"
+#include "RenderQueue.h"
+#define ZBACKEND_IMPLEMENTATION
+#include "frotz.h"
+#ifdef ZMACHINE_SLICED
+#ifdef WIN32
+#error "The sliced interpreter needs ucontext, which Windows doesn't have"
+#endif
+#include <ucontext.h>
+#endif
 
 G_DEFINE_TYPE (ZMachine, zmachine, INTERPRETER_TYPE);
 
 #define ZM_MAX_COLOURS 512
 #define ZM_FIRST_CUSTOM_COLOUR 20 
 
-extern void end_of_sound (zword routine);
+// How many instructions the interpreter thread runs between looking
+//  for work from the GTK thread. Must be a power of two
+#define ZM_TICK_INTERVAL 4096
+
+#ifdef ZMACHINE_SLICED
+// A slice of interpretation ends after this many instructions, or
+//  this many microseconds, whichever comes first. Both are checked
+//  only every ZM_TICK_INTERVAL instructions
+#define ZM_SLICE_INSTRUCTIONS 262144 
+#define ZM_SLICE_USEC 10000 
+
+// The interpreter's own stack. It's as big as a thread's would be,
+//  because dialogs like the file chooser run on it
+#define ZM_SLICE_STACK (8 * 1024 * 1024)
+#endif
+
+// Work the GTK thread leaves for the interpreter thread
+#define ZM_PENDING_RESIZE 0x0001
+#define ZM_PENDING_SOUND  0x0002
+
+// Commands sent by the interpreter thread to the GTK thread. Those
+//  from ZQ_INIT_SCREEN on need an answer, and are sent with
+//  renderqueue_call
+typedef enum
+  {
+  ZQ_TEXT = 0,
+  ZQ_SCROLLBACK,
+  ZQ_SET_TEXT_STYLE,
+  ZQ_SET_FONT,
+  ZQ_SET_COLOUR,
+  ZQ_SET_CURSOR,
+  ZQ_ERASE_AREA,
+  ZQ_SCROLL_AREA,
+  ZQ_DRAW_PICTURE,
+  ZQ_RESET_SCREEN,
+  ZQ_START_SAMPLE,
+  ZQ_STOP_SAMPLE,
+  ZQ_FINISHED,
+  ZQ_INIT_SCREEN,
+  ZQ_CHAR_WIDTHS,
+  ZQ_FONT_DATA,
+  ZQ_TO_TRUE_COLOUR,
+  ZQ_FROM_TRUE_COLOUR,
+  ZQ_PEEK_COLOUR,
+  ZQ_PICTURE_DATA,
+  ZQ_READ_KEY,
+  ZQ_READ_LINE,
+  ZQ_READ_FILE_NAME,
+  ZQ_MORE_PROMPT,
+  ZQ_FATAL
+  } ZMachineQueueOp;
+
+// What the GTK thread sends back from ZQ_INIT_SCREEN, for the
+//  interpreter thread to put in the header
+typedef struct _ZMachineScreenInfo
+  {
+  int font_width;
+  int font_height;
+  int width;
+  int height;
+  RGB8COLOUR fg;
+  RGB8COLOUR bg;
+  int fg_index;
+  int bg_index;
+  } ZMachineScreenInfo;
+
+// Passed with ZQ_READ_LINE, ZQ_READ_KEY and ZQ_MORE_PROMPT. The GTK
+//  thread fills in where the mouse was clicked, if it was, and where
+//  in the transcript to go back to, if the player picked a place
+typedef struct _ZMachineInput
+  {
+  zword *line;
+  int click_x;
+  int click_y;
+  long rewind_to;
+  } ZMachineInput;
+
+extern void end_of_sound (void);
+
+// Ugly frig, the other half of the one in MainWindow.c. The settings
+//  can change this at any time; the interpreter thread copies it into
+//  the Z-machine context when it starts, and after each input
+int zmachine_err_report_mode = ERR_DEFAULT_REPORT_MODE;
 
 typedef struct _ZMachinePriv
 {
@@ -32,9 +122,38 @@ typedef struct _ZMachinePriv
   char *current_save_dir;
   int graphics_width;
   int graphics_height;
+  ZContext *context;
+  // The interpreter runs on its own thread, and sends everything for
+  //  the display through the queue
+  GThread *thread;
+  RenderQueue *queue;
+  volatile gint pending;
+  GMutex *resize_mutex;
+  int resize_font_width;
+  int resize_font_height;
+  int resize_width;
+  int resize_height;
+  // Interpreter thread only: what it has told the terminal, so that
+  //  it can work out character widths without asking
+  unsigned int ticks;
+  gboolean screen_ready;
+  STStyle text_style;
+  STFontCode font_code;
+  gint16 *char_widths[2]; // Proportional and fixed; -1 for unknown
+#ifdef ZMACHINE_SLICED
+  // Instead of a thread, the interpreter can be a coroutine on the
+  //  GTK thread, resumed by an idle source for a slice at a time
+  ucontext_t slice_context;
+  ucontext_t main_context;
+  char *slice_stack;
+  GTimer *slice_timer;
+  unsigned int slice_start;
+  gboolean slice_done;
+#endif
 } ZMachinePriv;
 
-ZMachine *global_zmachine = NULL;
+// The ZMachine that owns the Z-machine context bound to this thread
+#define global_zmachine ((ZMachine *) zctx->os_data)
 
 extern int frotz_main (void);
 extern void resize_screen (void); // from frotz_screen.c
@@ -43,9 +162,44 @@ extern void restart_header (void); // from frotz_screen.c
 StoryTerminal *zmachine_create_terminal (Interpreter *self);
 void zmachine_run (Interpreter *_self);
 void zmachine_child_finished (Interpreter *_self);
+char *zmachine_find_checkpoint (Interpreter *_self);
 static void zmachine_terminal_size_allocate_event (GtkWidget *w, 
     GdkRectangle *a, gpointer data);
 
+static void zmachine_render (const RenderCommand *c, void *user_data);
+
+// The backend functions that run on the interpreter thread
+static int vm_char_width (zword c);
+static void vm_display_char (zword c);
+static void vm_display_string (const zword *s);
+static void vm_draw_picture (int num, int row, int col);
+static void vm_erase_area (int top, int left, int bottom, int right, int win);
+static void vm_fatal (const char *s);
+static int vm_font_data (int font, int *height, int *width);
+static int vm_from_true_colour (zword colour);
+static void vm_init_screen (void);
+static void vm_more_prompt (void);
+static int vm_peek_colour (void);
+static bool vm_picture_data (int num, int *height, int *width);
+static int vm_read_file_name (char *file_name, const char *default_name, 
+    int flag);
+static zword vm_read_key (int timeout, bool show_cursor);
+static zword vm_read_line (int max, zword *line, int timeout, int width, 
+    int continued);
+static void vm_reset_screen (void);
+static void vm_scroll_area (int top, int left, int bottom, int right, 
+    int units);
+static void vm_scrollback_char (zword c);
+static void vm_set_colour (int fg_index, int bg_index);
+static void vm_set_cursor (int row, int col);
+static void vm_set_font (int f);
+static void vm_set_text_style (int x);
+static void vm_start_sample (int n, int volume, int repeats, zword eos);
+static void vm_stop_sample (int n);
+static int vm_string_width (const zword *s);
+static void vm_tick (void);
+static zword vm_to_true_colour (int colour);
+
 
 /*======================================================================
 zmachine_rgb8_to_rgb5
@@ -185,6 +339,7 @@ static void zmachine_init (ZMachine *this)
   this->dispose_has_run = FALSE;
   this->priv = (ZMachinePriv *) malloc (sizeof (ZMachinePriv));
   memset (this->priv, 0, sizeof (ZMachinePriv));
+  this->priv->resize_mutex = g_mutex_new ();
 }
 
 
@@ -208,8 +363,25 @@ static void zmachine_dispose (GObject *_this)
     free (this->priv->current_save_dir);
     this->priv->current_save_dir = NULL;
   }
+  if (this->priv->queue)
+  {
+    renderqueue_free (this->priv->queue);
+    this->priv->queue = NULL;
+  }
+  if (this->priv->context)
+  {
+    zcontext_free (this->priv->context);
+    this->priv->context = NULL;
+  }
   if (this->priv)
   {
+#ifdef ZMACHINE_SLICED
+    if (this->priv->slice_stack) free (this->priv->slice_stack);
+    if (this->priv->slice_timer) g_timer_destroy (this->priv->slice_timer);
+#endif
+    if (this->priv->char_widths[0]) free (this->priv->char_widths[0]);
+    if (this->priv->char_widths[1]) free (this->priv->char_widths[1]);
+    g_mutex_free (this->priv->resize_mutex);
     free (this->priv);
     this->priv = NULL;
   }
@@ -232,10 +404,65 @@ static void zmachine_class_init
     = zmachine_run;
   ((InterpreterClass*)klass)->interpreter_child_finished
     = zmachine_child_finished;
+  ((InterpreterClass*)klass)->interpreter_find_checkpoint
+    = zmachine_find_checkpoint;
   
 }
 
 
+/*======================================================================
+  zmachine_backend
+The backend of our Z-machine contexts. The interpreter runs on its
+own thread, and must not touch GTK: the vm_* functions pass the work
+to the GTK thread, which does it with the os_* functions further down.
+The os_* functions listed here don't need GTK, and are called directly
+======================================================================*/
+
+static const ZBackend zmachine_backend =
+{
+  "gtk",
+  os_beep,
+  os_buffer_screen,
+  vm_char_width,
+  os_check_unicode,
+  vm_display_char,
+  vm_display_string,
+  vm_draw_picture,
+  vm_erase_area,
+  vm_fatal,
+  os_finish_with_sample,
+  vm_font_data,
+  vm_from_true_colour,
+  vm_init_screen,
+  os_menu,
+  vm_more_prompt,
+  os_path_open,
+  vm_peek_colour,
+  vm_picture_data,
+  os_prepare_sample,
+  os_random_seed,
+  vm_read_file_name,
+  vm_read_key,
+  vm_read_line,
+  os_read_mouse,
+  vm_reset_screen,
+  os_restart_game,
+  vm_scroll_area,
+  vm_scrollback_char,
+  os_scrollback_erase,
+  vm_set_colour,
+  vm_set_cursor,
+  vm_set_font,
+  vm_set_text_style,
+  vm_start_sample,
+  vm_stop_sample,
+  vm_string_width,
+  vm_tick,
+  vm_to_true_colour,
+  os_wrap_window,
+  os_window_height
+};
+
 /*======================================================================
   zmachine_new
 ======================================================================*/
@@ -244,7 +471,12 @@ ZMachine *zmachine_new (void)
 {
   ZMachine *self = g_object_new 
    (ZMACHINE_TYPE, NULL);
-  global_zmachine = self;
+  self->priv->context = zcontext_new ();
+  if (!self->priv->context)
+    g_error ("Out of memory creating Z-machine context");
+  self->priv->context->os = &zmachine_backend;
+  self->priv->context->os_data = self;
+  zcontext_bind (self->priv->context);
   return self;
 }
 
@@ -273,8 +505,82 @@ StoryTerminal *zmachine_create_terminal (Interpreter *self)
 }
 
 
+/*======================================================================
+  zmachine_set_pending
+Leave work for the interpreter thread, which picks it up at its next
+tick or input. Safe to call from any thread
+=====================================================================*/
+static void zmachine_set_pending (ZMachine *self, int flags)
+{
+  int old;
+  do
+    old = g_atomic_int_get (&self->priv->pending);
+  while (!g_atomic_int_compare_and_exchange 
+     (&self->priv->pending, old, old | flags));
+}
+
+
+/*======================================================================
+  zmachine_apply_pending
+Interpreter thread: do whatever work the GTK thread has left for us
+=====================================================================*/
+static void zmachine_apply_pending (ZMachine *self)
+{
+  int flags;
+  do
+    flags = g_atomic_int_get (&self->priv->pending);
+  while (!g_atomic_int_compare_and_exchange 
+     (&self->priv->pending, flags, 0));
+
+  if ((flags & ZM_PENDING_RESIZE) && self->priv->screen_ready)
+    {
+    int fx, fy, cx, cy;
+    g_mutex_lock (self->priv->resize_mutex);
+    fx = self->priv->resize_font_width; 
+    fy = self->priv->resize_font_height; 
+    cx = self->priv->resize_width; 
+    cy = self->priv->resize_height; 
+    g_mutex_unlock (self->priv->resize_mutex);
+
+    // The font may have changed as well as the size
+    int i;
+    for (i = 0; i < 2; i++)
+      if (self->priv->char_widths[i])
+        memset (self->priv->char_widths[i], 0xFF, 0x10000 * sizeof (gint16));
+
+    if (h_font_width != fx || h_font_height != fy 
+       || h_screen_rows != (char) (cy / fy)
+       || h_screen_cols != (char) (cx / fx)
+       || h_screen_width != cx
+       || h_screen_height != cy)
+      {
+      h_font_width = fx; 
+      h_font_height = fy;
+      h_screen_rows = (char) (cy / fy); 
+      h_screen_height = cy; 
+      h_screen_cols = (char) (cx / fx);
+      h_screen_width = cx; 
+      if (h_version == V6)
+        h_flags |= REFRESH_FLAG;
+      resize_screen();
+      restart_header();
+      }
+    else
+      {
+      g_debug 
+        ("ZMachine size change ignored, because no parameters have changed");
+      }
+    }
+
+  if (flags & ZM_PENDING_SOUND)
+    end_of_sound ();
+}
+
+
 /*======================================================================
   interpreter_terminal_size_allocate_event
+The header belongs to the interpreter thread, so just note the new
+size, and let that thread apply it
 =====================================================================*/
 static void zmachine_terminal_size_allocate_event (GtkWidget *w, 
     GdkRectangle *a, gpointer user_data)
@@ -282,42 +588,33 @@ static void zmachine_terminal_size_allocate_event (GtkWidget *w,
   g_debug 
       ("ZMachine terminal size change notification");
 
+  ZMachine *self = ZMACHINE (user_data);
   int fx, fy, cx, cy;
-  StoryTerminal *terminal = zmachine_global_terminal (); 
+  StoryTerminal *terminal = interpreter_get_terminal (INTERPRETER (self)); 
   storyterminal_get_char_cell_size_in_pixels (terminal, &fx, &fy);
   storyterminal_get_widget_size (terminal, &cx, &cy);
 
   fx = storyterminal_get_char_width (terminal, '0');
 
-  if (h_font_width != fx || h_font_height != fy 
-     || h_screen_rows != (char) (cy / fy)
-     || h_screen_cols != (char) (cx / fx)
-     || h_screen_width != cx
-     || h_screen_height != cy)
-    {
-    h_font_width = fx; 
-    h_font_height = fy;
-    h_screen_rows = (char) (cy / fy); 
-    h_screen_height = cy; 
-    h_screen_cols = (char ) (cx / fx);
-    h_screen_width = cx; 
-    if (h_version == V6)
-      h_flags |= REFRESH_FLAG;
-    resize_screen();
-    restart_header();
-    }
-  else
-    {
-    g_debug 
-      ("ZMachine size change ignored, because no parameters have changed");
-    }
+  g_mutex_lock (self->priv->resize_mutex);
+  self->priv->resize_font_width = fx; 
+  self->priv->resize_font_height = fy; 
+  self->priv->resize_width = cx; 
+  self->priv->resize_height = cy; 
+  g_mutex_unlock (self->priv->resize_mutex);
+
+  zmachine_set_pending (self, ZM_PENDING_RESIZE);
 }
 
 
 /*======================================================================
-  os_read_line
+  zmachine_read_line
+GTK thread: read a line into the interpreter thread's buffer, which
+it leaves alone while it waits. Where the mouse was clicked goes
+back in the request, for the interpreter thread to note
 ======================================================================*/
-zword os_read_line (int max, zword *line, int timeout, int width, int continued)
+static zword zmachine_read_line (int max, ZMachineInput *input, 
+    int timeout, int width, int continued)
   {
   interpreter_call_state_change (INTERPRETER (global_zmachine),
     ISC_WAIT_FOR_INPUT);
@@ -327,20 +624,21 @@ zword os_read_line (int max, zword *line, int timeout, int width, int continued)
   ZTerminal *terminal = ZTERMINAL (_terminal);
   int gfx_x, gfx_y;
   storyterminal_get_gfx_cursor_pos (STORYTERMINAL(terminal), &gfx_x, &gfx_y);
-  g_debug ("os_read_line -- gfx cursor is at x=%d, y=%d. width=%d, max=%d", 
+  g_debug ("zmachine_read_line -- gfx cursor is at x=%d, y=%d. width=%d, max=%d", 
     gfx_x, gfx_y, width, max);
 
   int mx, my;
   int terminator = zterminal_read_line (terminal, max, 
-     line, timeout, width, continued, &mx, &my);
+     input->line, timeout, width, continued, &mx, &my, 
+     &input->rewind_to);
   // TODO terminator;
 
   if (terminator == ZC_DOUBLE_CLICK || terminator == ZC_SINGLE_CLICK)
     {
     g_debug ("Input terminated by mouse click at %d %d\n", 
        my, my);
-    mouse_x = mx;
-    mouse_y = my;
+    input->click_x = mx;
+    input->click_y = my;
     }
 
   interpreter_call_state_change (INTERPRETER (global_zmachine),
@@ -351,9 +649,11 @@ zword os_read_line (int max, zword *line, int timeout, int width, int continued)
 
 
 /*======================================================================
-  os_read_key
+  zmachine_read_key
+GTK thread: as zmachine_read_line, for a single key
 ======================================================================*/
-zword os_read_key (int timeout, bool show_cursor)
+static zword zmachine_read_key (int timeout, bool show_cursor, 
+    ZMachineInput *input)
   {
   StoryTerminal *_terminal = interpreter_get_terminal 
     (INTERPRETER (global_zmachine)); 
@@ -368,8 +668,8 @@ zword os_read_key (int timeout, bool show_cursor)
     {
     g_debug ("Input terminated by mouse click at %d %d\n", 
        my, my);
-    mouse_x = mx;
-    mouse_y = my;
+    input->click_x = mx;
+    input->click_y = my;
     }
   return c;
   }
@@ -407,16 +707,157 @@ void os_display_char (zword c)
 }
 
 
+/*======================================================================
+  zmachine_interpret
+Run the story to the end. The Z-machine context must be bound
+======================================================================*/
+static void zmachine_interpret (ZMachine *self)
+  {
+  err_report_mode = zmachine_err_report_mode;
+  frotz_main ();
+  g_debug ("frotz interpreter finished");
+  renderqueue_post_op (self->priv->queue, ZQ_FINISHED, 0, 0, 0, 0, 0);
+  }
+
+
+#ifdef ZMACHINE_SLICED
+/*======================================================================
+  zmachine_slice_main
+The body of the interpreter coroutine. When it returns, uc_link takes
+us back to zmachine_slice_idle
+======================================================================*/
+static void zmachine_slice_main (void)
+  {
+  ZMachine *self = global_zmachine;
+  zmachine_interpret (self);
+  self->priv->slice_done = TRUE;
+  }
+
+
+/*======================================================================
+  zmachine_slice_idle
+Run the interpreter for a slice, from wherever it left off -- which
+may be deep in a nested direct_call, or in a dialog. The interpreter
+comes back here from vm_tick when its budget is spent
+======================================================================*/
+static gboolean zmachine_slice_idle (gpointer user_data)
+  {
+  ZMachine *self = ZMACHINE (user_data);
+  ZMachinePriv *priv = self->priv;
+  zcontext_bind (priv->context);
+  priv->slice_start = priv->ticks;
+  g_timer_start (priv->slice_timer);
+  swapcontext (&priv->main_context, &priv->slice_context);
+  if (!priv->slice_done) return TRUE;
+  free (priv->slice_stack);
+  priv->slice_stack = NULL;
+  return FALSE;
+  }
+
+
+/*======================================================================
+  zmachine_yield
+Interpreter coroutine: if this slice is spent, go back to the main
+loop until the next one
+======================================================================*/
+static void zmachine_yield (ZMachine *self)
+  {
+  ZMachinePriv *priv = self->priv;
+  if (priv->ticks - priv->slice_start >= ZM_SLICE_INSTRUCTIONS
+      || g_timer_elapsed (priv->slice_timer, NULL) * 1000000 
+         >= ZM_SLICE_USEC)
+    swapcontext (&priv->slice_context, &priv->main_context);
+  }
+
+#else
+
+/*======================================================================
+  zmachine_thread
+The body of the interpreter thread
+======================================================================*/
+static gpointer zmachine_thread (gpointer user_data)
+  {
+  ZMachine *self = ZMACHINE (user_data);
+  zcontext_bind (self->priv->context);
+  zmachine_interpret (self);
+  return NULL;
+  }
+#endif
+
+
+/*======================================================================
+  zmachine_finished_idle
+The interpreter thread has finished, and everything it sent has been
+displayed
+======================================================================*/
+static gboolean zmachine_finished_idle (gpointer user_data)
+  {
+  ZMachine *self = ZMACHINE (user_data);
+  if (self->priv->thread)
+    {
+    g_thread_join (self->priv->thread);
+    self->priv->thread = NULL;
+    }
+  interpreter_call_state_change (INTERPRETER (self), ISC_FINISHED);
+  return FALSE;
+  }
+
+
 /*======================================================================
   zmachine_run
+Start the interpreter on its own thread -- or as a coroutine, run by
+an idle source -- and return at once
 ======================================================================*/
 void zmachine_run (Interpreter *_self)
   {
   ZMachine *self = ZMACHINE (_self);
+  zcontext_bind (self->priv->context);
   story_name = self->priv->story_file;
+  // Games opened here are played, not developed, so the story file
+  //  can be mapped; if it can't, it is read as usual
+  option_map_story = TRUE;
+  // Undo states that won't fit in memory go to a journal in the
+  //  temporary directory
+  option_undo_journal = interpreter_get_temp_dir (_self);
+  // Checkpoints, and maybe one to start from
+  option_autosave = interpreter_get_autosave_dir (_self);
+  option_resume = interpreter_get_resume_file (_self);
   g_debug ("Starting frotz interpreter, file is %s", story_name);
-  frotz_main ();
-  g_debug ("frotz interpreter finished");
+  self->priv->queue = renderqueue_new (zmachine_render, self);
+#ifdef ZMACHINE_SLICED
+  ZMachinePriv *priv = self->priv;
+  renderqueue_set_inline (priv->queue, TRUE);
+  priv->slice_timer = g_timer_new ();
+  priv->slice_stack = malloc (ZM_SLICE_STACK);
+  getcontext (&priv->slice_context);
+  priv->slice_context.uc_stack.ss_sp = priv->slice_stack;
+  priv->slice_context.uc_stack.ss_size = ZM_SLICE_STACK;
+  priv->slice_context.uc_link = &priv->main_context;
+  makecontext (&priv->slice_context, zmachine_slice_main, 0);
+  g_idle_add (zmachine_slice_idle, self);
+#else
+  GError *error = NULL;
+  self->priv->thread = g_thread_create (zmachine_thread, self, TRUE, &error);
+  if (!self->priv->thread)
+    g_error ("Can't start interpreter thread: %s", error->message);
+#endif
+  }
+
+
+/*======================================================================
+  zmachine_find_checkpoint
+The checkpoints are looked for by the story's release, serial number
+and checksum, so any copy of the same story finds them
+======================================================================*/
+char *zmachine_find_checkpoint (Interpreter *_self)
+  {
+  ZMachine *self = ZMACHINE (_self);
+  const char *autosave_dir = interpreter_get_autosave_dir (_self);
+  char name[MAX_FILE_NAME + 1];
+  if (autosave_dir 
+      && autosave_find (autosave_dir, self->priv->story_file, name))
+    return strdup (name);
+  return NULL;
   }
 
 
@@ -471,103 +912,32 @@ int zmachine_lookup_colour (ZMachine *self, RGB8COLOUR rgb8)
 
 
 /*======================================================================
-os_init_screen
+zmachine_init_screen
+GTK thread: measure the terminal and set up the colours for a game
+of the given version. The header belongs to the interpreter thread,
+so what it needs goes back in info for vm_init_screen to apply
 ======================================================================*/
-void os_init_screen(void)
+static void zmachine_init_screen (int version, ZMachineScreenInfo *info)
 {
-  if (h_version == V3 && global_zmachine->priv->user_tandy_bit)
-      h_config |= CONFIG_TANDY;
-
-  if (global_zmachine->priv->user_interpreter_number > 0)
-    h_interpreter_number = global_zmachine->priv->user_interpreter_number;
-  else 
-  {
-    h_interpreter_number = h_version == 6 ? INTERP_MSDOS : INTERP_AMIGA;
-  }
-  h_interpreter_version = 'F';
-
-  g_debug ("ZMachine using interpreter number %d", h_interpreter_number);
-
- if ((h_version >= V4) && (global_zmachine->priv->speed != 0))
-    h_config |= CONFIG_TIMEDINPUT;
-
-  if (h_version == V3) 
-  {
-    h_config |= CONFIG_SPLITSCREEN;
-    h_config |= CONFIG_PROPORTIONAL;
-    h_flags &= ~OLD_SOUND_FLAG;
-  }
-
-  if (h_version >= V4) 
-  {
-    h_config |= CONFIG_BOLDFACE;
-    h_config |= CONFIG_EMPHASIS;
-    h_config |= CONFIG_FIXED;
-    h_config |= CONFIG_TIMEDINPUT;
-  }
-
-  if (h_version >= V5) 
-  {
-    h_config |= CONFIG_COLOUR;
-    //h_flags &= ~SOUND_FLAG;
-  }
-
-  h_screen_height = h_screen_rows;
-  h_screen_width = h_screen_cols;
-  //int screen_cells = h_screen_rows * h_screen_cols;
-
-  int fx, fy, cx, cy;
   StoryTerminal *terminal = zmachine_global_terminal (); 
-  storyterminal_get_char_cell_size_in_pixels (terminal, &fx, &fy);
-  storyterminal_get_widget_size (terminal, &cx, &cy);
-
-  fx = storyterminal_get_char_width (terminal, '0');
-
-  h_font_width = fx; 
-  h_font_height = fy;
-  h_screen_rows = (char) (cy / fy); 
-  h_screen_height = cy; 
-  h_screen_cols = (char ) (cx / fx);
-  h_screen_width = cx; 
+  storyterminal_get_char_cell_size_in_pixels (terminal, 
+    &info->font_width, &info->font_height);
+  storyterminal_get_widget_size (terminal, &info->width, &info->height);
 
-g_debug ("h_screen_width=%d", h_screen_width);
-g_debug ("h_screen_height=%d", h_screen_height);
-g_debug ("h_screen_rows=%d", h_screen_rows);
-g_debug ("h_screen_cols=%d", h_screen_cols);
-g_debug ("h_font_width=%d", h_font_width);
-g_debug ("h_font_height=%d", h_font_height);
-
-  h_default_foreground = 1;
-  h_default_background = 1;
+  info->font_width = storyterminal_get_char_width (terminal, '0');
 
   zmachine_init_colour_table (global_zmachine);
 
-  if (h_version >= V5)
+  info->fg = storyterminal_get_default_fg_colour (terminal);
+  info->bg = storyterminal_get_default_bg_colour (terminal);
+  info->fg_index = 1;
+  info->bg_index = 1;
+  if (version == V6)
     {
-    zword mask = 0;
-    if (h_version == V6)
-      mask |= TRANSPARENT_FLAG;
-
-    hx_flags &= mask;
-
-    StoryTerminal *terminal = zmachine_global_terminal();
-    RGB8COLOUR fg = storyterminal_get_default_fg_colour (terminal);
-    RGB8COLOUR bg = storyterminal_get_default_bg_colour (terminal);
-
-    hx_fore_colour = zmachine_rgb8_to_rgb5 (fg); 
-    hx_back_colour = zmachine_rgb8_to_rgb5 (bg); 
-   
-    if (h_version == V6)
-      {
-      int index_fg = zmachine_lookup_colour (global_zmachine, fg);
-      int index_bg = zmachine_lookup_colour (global_zmachine, bg);
-      h_default_foreground = index_fg;
-      h_default_background = index_bg;
-      }
+    info->fg_index = zmachine_lookup_colour (global_zmachine, info->fg);
+    info->bg_index = zmachine_lookup_colour (global_zmachine, info->bg);
     }
 
-  h_config |= CONFIG_SOUND;
-
   // Start off in fixed width mode. With luck, modern games
   //  with do a set_font to select style 1, which can be
   //  variable width
@@ -679,18 +1049,6 @@ void  os_window_height (int win, int height)
   }
 
 
-/*======================================================================
-os_tick
-======================================================================*/
-void  os_tick (void)
-  {
-  //g_debug ("os_tick");
-  // Perhaps we should invoke the event loop here rather than
-  //  in individual routines?
-
-  }
-
-
 /*======================================================================
 os_menu
 ======================================================================*/
@@ -711,16 +1069,6 @@ int os_wrap_window (int win)
   }
 
 
-/*======================================================================
-os_char_width
-======================================================================*/
-int os_char_width (zword z)
-{
-  StoryTerminal *terminal = zmachine_global_terminal (); 
-  return storyterminal_get_char_width (terminal, (gunichar2)z); 
-}
-
-
 /*======================================================================
 os_set_colour
 ======================================================================*/
@@ -1006,43 +1354,6 @@ int os_random_seed (void)
 }
 
 
-/*======================================================================
-os_string_width
-======================================================================*/
-int os_string_width (const zword *s)
-{
-  // Ideally we ought to account for style changes, etc., in 
-  //  calculating the width
-  int width = 0;
-  zword c;
-
-  StoryTerminal *terminal = zmachine_global_terminal();
-  STStyle old_style = storyterminal_get_text_style (terminal);
-  STFontCode old_font_code = storyterminal_get_font_code (terminal);
-
-  while ((c = *s++) != 0)
-  {
-    if (c == ZC_NEW_FONT)
-    {
-      os_set_font(*s++);
-    }
-    else if (c == ZC_NEW_STYLE)
-    {
-      os_set_text_style(*s++);
-    }
-    else 
-    {
-      width += os_char_width(c);
-    }
-  }
-
-  storyterminal_set_text_style (terminal, old_style);
-  storyterminal_set_font_code (terminal, old_font_code);
-
-  return width;
-}
-
-
 /*======================================================================
 os_set_cursor
 ======================================================================*/
@@ -1083,18 +1394,16 @@ void os_display_string (const zword *s)
      os_display_char (c);
      }
   }
-  // Not sure about this
-  static int tick = 0;
-  if (tick++ % 200 == 0)
-    while (gtk_events_pending()) gtk_main_iteration();
 }
 
 /*======================================================================
-os_more_prompt
+zmachine_more_prompt
+GTK thread: show the prompt and wait for a key, which is reported as
+zmachine_read_key does
 ======================================================================*/
-void os_more_prompt (void)
+static void zmachine_more_prompt (ZMachineInput *input)
   {
-  g_debug ("os_more_prompt");
+  g_debug ("zmachine_more_prompt");
 
   int x, y, new_x, new_y;
   StoryTerminal *terminal = zmachine_global_terminal();
@@ -1105,7 +1414,7 @@ void os_more_prompt (void)
   free (s);
   storyterminal_get_gfx_cursor_pos (terminal, &new_x, &new_y);
 
-  os_read_key (-1, FALSE); // Don't show a caret -- it's ugly
+  zmachine_read_key (-1, FALSE, input); // Don't show a caret -- it's ugly
 
   /*
   s = g_utf8_to_utf16 ("\x08\x08\x08\x08\x08\x08\x08\x08\x08", 
@@ -1235,13 +1544,13 @@ int os_read_file_name (char *file_name, const char *default_name, int flag)
  os_path_open
 We only need to support absolute paths
 ======================================================================*/
-FILE *os_path_open(const char *name, const char *mode)
+FILE *os_path_open(const char *name, const char *mode, long *size)
 {
-  FILE *fp;
+  FILE *f;
 
-  if ((fp = fopen(name, mode))) 
+  if ((f = fopen(name, mode))) 
     {
-    return fp;
+    return f;
     }
   return NULL;
 }
@@ -1283,8 +1592,7 @@ void zmachine_media_notification (MediaPlayerNotificationType type,
   if (type == MEDIAPLAYER_NOTIFICATION_FINISHED)
     {
     g_debug ("MediaPlayer notified EOS");
-    int eos = (int) user_data1;
-    end_of_sound ((zword) eos);
+    zmachine_set_pending ((ZMachine *) user_data1, ZM_PENDING_SOUND);
     }
   }
 
@@ -1373,6 +1681,641 @@ void os_reset_screen (void)
   }
 
 
+/*======================================================================
+  ZMachineFileNameRequest
+What the interpreter thread passes with ZQ_READ_FILE_NAME
+======================================================================*/
+typedef struct _ZMachineFileNameRequest
+  {
+  char *file_name;
+  const char *default_name;
+  } ZMachineFileNameRequest;
+
+
+/*======================================================================
+  zmachine_render
+GTK thread: carry out a command from the interpreter thread. The
+context is bound only so that global_zmachine finds us: its state
+belongs to the interpreter thread, and anything that thread needs to
+change goes back in the reply for it to apply. Tab completion reads
+the dictionary, which nothing changes while the thread waits
+======================================================================*/
+static void zmachine_render (const RenderCommand *c, void *user_data)
+  {
+  ZMachine *self = ZMACHINE (user_data);
+  zcontext_bind (self->priv->context);
+  StoryTerminal *terminal = interpreter_get_terminal (INTERPRETER (self));
+  const int *a = c->args;
+  int *dims = (int *) c->ptr;
+  int i;
+
+  switch (c->op)
+    {
+    case ZQ_TEXT:
+      for (i = 0; i < c->len; i++)
+        storyterminal_write_char (terminal, c->text[i], FALSE);
+      break;
+
+    case ZQ_SCROLLBACK:
+      for (i = 0; i < c->len; i++)
+        os_scrollback_char (c->text[i]);
+      break;
+
+    case ZQ_SET_TEXT_STYLE:
+      os_set_text_style (a[0]);
+      break;
+
+    case ZQ_SET_FONT:
+      os_set_font (a[0]);
+      break;
+
+    case ZQ_SET_COLOUR:
+      os_set_colour (a[0], a[1]);
+      break;
+
+    case ZQ_SET_CURSOR:
+      os_set_cursor (a[0], a[1]);
+      break;
+
+    case ZQ_ERASE_AREA:
+      os_erase_area (a[0], a[1], a[2], a[3], a[4]);
+      break;
+
+    case ZQ_SCROLL_AREA:
+      os_scroll_area (a[0], a[1], a[2], a[3], a[4]);
+      break;
+
+    case ZQ_DRAW_PICTURE:
+      os_draw_picture (a[0], a[1], a[2]);
+      break;
+
+    case ZQ_RESET_SCREEN:
+      os_reset_screen ();
+      break;
+
+    case ZQ_START_SAMPLE:
+      os_start_sample (a[0], a[1], a[2], (zword) a[3]);
+      break;
+
+    case ZQ_STOP_SAMPLE:
+      os_stop_sample (a[0]);
+      break;
+
+    case ZQ_FINISHED:
+      // Not from here: we're in the middle of draining the queue
+      g_idle_add (zmachine_finished_idle, self);
+      break;
+
+    case ZQ_INIT_SCREEN:
+      zmachine_init_screen (a[0], (ZMachineScreenInfo *) c->ptr);
+      break;
+
+    case ZQ_CHAR_WIDTHS:
+      {
+      // Widths of the 256 characters from a[0], in the proportional
+      //  or fixed font, with no bold or italic
+      gint16 *widths = (gint16 *) c->ptr;
+      STStyle old_style = storyterminal_get_text_style (terminal);
+      STFontCode old_font_code = storyterminal_get_font_code (terminal);
+      storyterminal_set_text_style (terminal, 
+        a[1] ? STSTYLE_FIXED : STSTYLE_NORMAL);
+      storyterminal_set_font_code (terminal, STFONT_NORMAL);
+      for (i = 0; i < 256; i++)
+        widths[i] = storyterminal_get_char_width (terminal, 
+          (gunichar2) (a[0] + i));
+      storyterminal_set_text_style (terminal, old_style);
+      storyterminal_set_font_code (terminal, old_font_code);
+      }
+      break;
+
+    case ZQ_FONT_DATA:
+      *c->result = os_font_data (a[0], &dims[0], &dims[1]);
+      break;
 
+    case ZQ_TO_TRUE_COLOUR:
+      *c->result = os_to_true_colour (a[0]);
+      break;
 
+    case ZQ_FROM_TRUE_COLOUR:
+      *c->result = os_from_true_colour ((zword) a[0]);
+      break;
+
+    case ZQ_PEEK_COLOUR:
+      *c->result = os_peek_colour ();
+      break;
+
+    case ZQ_PICTURE_DATA:
+      *c->result = os_picture_data (a[0], &dims[0], &dims[1]);
+      break;
+
+    case ZQ_READ_KEY:
+      *c->result = zmachine_read_key (a[0], a[1], (ZMachineInput *) c->ptr);
+      break;
+
+    case ZQ_READ_LINE:
+      *c->result = zmachine_read_line (a[0], (ZMachineInput *) c->ptr, 
+        a[1], a[2], a[3]);
+      break;
+
+    case ZQ_READ_FILE_NAME:
+      {
+      ZMachineFileNameRequest *r = (ZMachineFileNameRequest *) c->ptr;
+      *c->result = os_read_file_name (r->file_name, r->default_name, a[0]);
+      }
+      break;
+
+    case ZQ_MORE_PROMPT:
+      zmachine_more_prompt ((ZMachineInput *) c->ptr);
+      break;
+
+    case ZQ_FATAL:
+      os_fatal ((const char *) c->ptr);
+      break;
+    }
+  }
+
+
+/*======================================================================
+  zmachine_call
+Interpreter thread: send a command to the GTK thread, and wait for
+its result
+======================================================================*/
+static int zmachine_call (int op, int a, int b, int c, int d, void *ptr)
+  {
+  RenderCommand command;
+  int result = 0;
+  command.op = op;
+  command.args[0] = a;
+  command.args[1] = b;
+  command.args[2] = c;
+  command.args[3] = d;
+  command.args[4] = 0;
+  command.ptr = ptr;
+  command.result = &result;
+  command.len = 0;
+  renderqueue_call (global_zmachine->priv->queue, &command);
+  return result;
+  }
+
+
+/*======================================================================
+  zmachine_post
+Interpreter thread: send a command to the GTK thread, without waiting
+======================================================================*/
+static void zmachine_post (int op, int a, int b, int c, int d, int e)
+  {
+  renderqueue_post_op (global_zmachine->priv->queue, op, a, b, c, d, e);
+  }
+
+
+/*======================================================================
+  zmachine_font_code
+The terminal font code for a Z-machine font number
+======================================================================*/
+static STFontCode zmachine_font_code (int f)
+  {
+  if (f == 4)
+    return STFONT_FIXED;
+  else if (f == 3)
+    return STFONT_CUSTOM;
+  return STFONT_NORMAL;
+  }
+
+
+/*======================================================================
+  vm_tick
+Every so many instructions, let the GTK thread see any text we have
+been holding back, and pick up any work it has left for us. A sliced
+interpreter also checks here whether its slice is up
+======================================================================*/
+static void vm_tick (void)
+  {
+  ZMachinePriv *priv = global_zmachine->priv;
+  if (++priv->ticks & (ZM_TICK_INTERVAL - 1)) return;
+  renderqueue_flush (priv->queue);
+  if (g_atomic_int_get (&priv->pending))
+    zmachine_apply_pending (global_zmachine);
+#ifdef ZMACHINE_SLICED
+  zmachine_yield (global_zmachine);
+#endif
+  }
+
+
+/*======================================================================
+  vm_after_input
+Anything might have happened while we were waiting for the player,
+including a click of the mouse
+======================================================================*/
+static void vm_after_input (const ZMachineInput *input)
+  {
+  if (input->click_x)
+    {
+    mouse_x = input->click_x;
+    mouse_y = input->click_y;
+    }
+  rewind_position = input->rewind_to;
+  err_report_mode = zmachine_err_report_mode;
+  if (g_atomic_int_get (&global_zmachine->priv->pending))
+    zmachine_apply_pending (global_zmachine);
+  }
+
+
+/*======================================================================
+  vm_display_char
+======================================================================*/
+static void vm_display_char (zword c)
+  {
+  RenderQueue *queue = global_zmachine->priv->queue;
+  if (c == ZC_GAP) 
+    {
+    renderqueue_post_char (queue, ZQ_TEXT, ' '); 
+    renderqueue_post_char (queue, ZQ_TEXT, ' ');
+    } 
+  else if (c == ZC_INDENT) 
+    {
+    renderqueue_post_char (queue, ZQ_TEXT, ' '); 
+    renderqueue_post_char (queue, ZQ_TEXT, ' '); 
+    renderqueue_post_char (queue, ZQ_TEXT, ' ');
+    }
+  else
+    renderqueue_post_char (queue, ZQ_TEXT, (gunichar2) c);
+  }
+
+
+/*======================================================================
+  vm_display_string
+======================================================================*/
+static void vm_display_string (const zword *s)
+  {
+  zword c;
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT)
+      vm_set_font (*s++);
+    else if (c == ZC_NEW_STYLE)
+      vm_set_text_style (*s++);
+    else 
+      vm_display_char (c);
+    }
+  }
+
+
+/*======================================================================
+  vm_scrollback_char
+======================================================================*/
+static void vm_scrollback_char (zword c)
+  {
+  renderqueue_post_char (global_zmachine->priv->queue, ZQ_SCROLLBACK, 
+    (gunichar2) c);
+  }
+
+
+/*======================================================================
+  vm_set_text_style
+======================================================================*/
+static void vm_set_text_style (int x)
+  {
+  global_zmachine->priv->text_style = x;
+  zmachine_post (ZQ_SET_TEXT_STYLE, x, 0, 0, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_set_font
+======================================================================*/
+static void vm_set_font (int f)
+  {
+  global_zmachine->priv->font_code = zmachine_font_code (f);
+  zmachine_post (ZQ_SET_FONT, f, 0, 0, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_char_width
+Character widths depend only on the font and the style, so we ask the
+GTK thread for them a block at a time, and remember them
+======================================================================*/
+static int vm_char_width (zword c)
+  {
+  ZMachinePriv *priv = global_zmachine->priv;
+  int fixed = priv->font_code == STFONT_FIXED 
+    || (priv->text_style & STSTYLE_FIXED);
+  gint16 *widths = priv->char_widths[fixed];
+  if (!widths)
+    {
+    widths = (gint16 *) malloc (0x10000 * sizeof (gint16));
+    memset (widths, 0xFF, 0x10000 * sizeof (gint16));
+    priv->char_widths[fixed] = widths;
+    }
+
+  if (widths[c] < 0)
+    zmachine_call (ZQ_CHAR_WIDTHS, c & 0xFF00, fixed, 0, 0, 
+      widths + (c & 0xFF00));
+
+  int width = widths[c];
+  if (priv->text_style & STSTYLE_BOLD) width += 1;
+  if (priv->text_style & STSTYLE_ITALIC) width += 1;
+  return width;
+  }
+
+
+/*======================================================================
+  vm_string_width
+======================================================================*/
+static int vm_string_width (const zword *s)
+  {
+  // Ideally we ought to account for style changes, etc., in 
+  //  calculating the width
+  ZMachinePriv *priv = global_zmachine->priv;
+  STStyle old_style = priv->text_style;
+  STFontCode old_font_code = priv->font_code;
+  int width = 0;
+  zword c;
+
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT)
+      priv->font_code = zmachine_font_code (*s++);
+    else if (c == ZC_NEW_STYLE)
+      priv->text_style = *s++;
+    else 
+      width += vm_char_width (c);
+    }
+
+  priv->text_style = old_style;
+  priv->font_code = old_font_code;
+  return width;
+  }
+
+
+/*======================================================================
+  vm_init_screen
+The GTK thread measures the terminal; we set the header up from what
+it finds
+======================================================================*/
+static void vm_init_screen (void)
+  {
+  ZMachinePriv *priv = global_zmachine->priv;
+  ZMachineScreenInfo info;
+  zmachine_call (ZQ_INIT_SCREEN, h_version, 0, 0, 0, &info);
+
+  if (h_version == V3 && priv->user_tandy_bit)
+    h_config |= CONFIG_TANDY;
+
+  if (priv->user_interpreter_number > 0)
+    h_interpreter_number = priv->user_interpreter_number;
+  else 
+    h_interpreter_number = h_version == 6 ? INTERP_MSDOS : INTERP_AMIGA;
+  h_interpreter_version = 'F';
+
+  g_debug ("ZMachine using interpreter number %d", h_interpreter_number);
+
+  if ((h_version >= V4) && (priv->speed != 0))
+    h_config |= CONFIG_TIMEDINPUT;
+
+  if (h_version == V3) 
+    {
+    h_config |= CONFIG_SPLITSCREEN;
+    h_config |= CONFIG_PROPORTIONAL;
+    h_flags &= ~OLD_SOUND_FLAG;
+    }
+
+  if (h_version >= V4) 
+    {
+    h_config |= CONFIG_BOLDFACE;
+    h_config |= CONFIG_EMPHASIS;
+    h_config |= CONFIG_FIXED;
+    h_config |= CONFIG_TIMEDINPUT;
+    }
+
+  if (h_version >= V5) 
+    {
+    h_config |= CONFIG_COLOUR;
+    //h_flags &= ~SOUND_FLAG;
+    }
+
+  h_font_width = info.font_width; 
+  h_font_height = info.font_height;
+  h_screen_rows = (char) (info.height / info.font_height); 
+  h_screen_height = info.height; 
+  h_screen_cols = (char) (info.width / info.font_width);
+  h_screen_width = info.width; 
+
+  g_debug ("h_screen_width=%d", h_screen_width);
+  g_debug ("h_screen_height=%d", h_screen_height);
+  g_debug ("h_screen_rows=%d", h_screen_rows);
+  g_debug ("h_screen_cols=%d", h_screen_cols);
+  g_debug ("h_font_width=%d", h_font_width);
+  g_debug ("h_font_height=%d", h_font_height);
+
+  h_default_foreground = info.fg_index;
+  h_default_background = info.bg_index;
+
+  if (h_version >= V5)
+    {
+    zword mask = 0;
+    if (h_version == V6)
+      mask |= TRANSPARENT_FLAG;
+
+    hx_flags &= mask;
+
+    hx_fore_colour = zmachine_rgb8_to_rgb5 (info.fg); 
+    hx_back_colour = zmachine_rgb8_to_rgb5 (info.bg); 
+    }
+
+  h_config |= CONFIG_SOUND;
+
+  // The GTK thread starts off in fixed width mode
+  priv->text_style = FIXED_WIDTH_STYLE;
+  priv->screen_ready = TRUE;
+  }
+
+
+/*======================================================================
+  vm_reset_screen
+======================================================================*/
+static void vm_reset_screen (void)
+  {
+  ZMachinePriv *priv = global_zmachine->priv;
+  zmachine_post (ZQ_RESET_SCREEN, 0, 0, 0, 0, 0);
+  priv->text_style = STSTYLE_NORMAL;
+  priv->font_code = STFONT_NORMAL;
+  }
+
+
+/*======================================================================
+  vm_set_colour
+======================================================================*/
+static void vm_set_colour (int fg_index, int bg_index)
+  {
+  zmachine_post (ZQ_SET_COLOUR, fg_index, bg_index, 0, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_set_cursor
+======================================================================*/
+static void vm_set_cursor (int row, int col)
+  {
+  zmachine_post (ZQ_SET_CURSOR, row, col, 0, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_erase_area
+======================================================================*/
+static void vm_erase_area (int top, int left, int bottom, int right, int win)
+  {
+  zmachine_post (ZQ_ERASE_AREA, top, left, bottom, right, win);
+  }
+
+
+/*======================================================================
+  vm_scroll_area
+======================================================================*/
+static void vm_scroll_area (int top, int left, int bottom, int right, 
+    int units)
+  {
+  zmachine_post (ZQ_SCROLL_AREA, top, left, bottom, right, units);
+  }
+
+
+/*======================================================================
+  vm_draw_picture
+======================================================================*/
+static void vm_draw_picture (int num, int row, int col)
+  {
+  zmachine_post (ZQ_DRAW_PICTURE, num, row, col, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_start_sample
+======================================================================*/
+static void vm_start_sample (int n, int volume, int repeats, zword eos)
+  {
+  zmachine_post (ZQ_START_SAMPLE, n, volume, repeats, eos, 0);
+  }
+
+
+/*======================================================================
+  vm_stop_sample
+======================================================================*/
+static void vm_stop_sample (int n)
+  {
+  zmachine_post (ZQ_STOP_SAMPLE, n, 0, 0, 0, 0);
+  }
+
+
+/*======================================================================
+  vm_font_data
+======================================================================*/
+static int vm_font_data (int font, int *height, int *width)
+  {
+  int dims[2];
+  int result = zmachine_call (ZQ_FONT_DATA, font, 0, 0, 0, dims);
+  *height = dims[0];
+  *width = dims[1];
+  return result;
+  }
+
+
+/*======================================================================
+  vm_picture_data
+======================================================================*/
+static bool vm_picture_data (int num, int *height, int *width)
+  {
+  int dims[2];
+  int result = zmachine_call (ZQ_PICTURE_DATA, num, 0, 0, 0, dims);
+  *height = dims[0];
+  *width = dims[1];
+  return result;
+  }
+
+
+/*======================================================================
+  vm_to_true_colour
+======================================================================*/
+static zword vm_to_true_colour (int colour)
+  {
+  return zmachine_call (ZQ_TO_TRUE_COLOUR, colour, 0, 0, 0, NULL);
+  }
+
+
+/*======================================================================
+  vm_from_true_colour
+======================================================================*/
+static int vm_from_true_colour (zword colour)
+  {
+  return zmachine_call (ZQ_FROM_TRUE_COLOUR, colour, 0, 0, 0, NULL);
+  }
+
+
+/*======================================================================
+  vm_peek_colour
+======================================================================*/
+static int vm_peek_colour (void)
+  {
+  return zmachine_call (ZQ_PEEK_COLOUR, 0, 0, 0, 0, NULL);
+  }
+
+
+/*======================================================================
+  vm_read_key
+======================================================================*/
+static zword vm_read_key (int timeout, bool show_cursor)
+  {
+  ZMachineInput input = { NULL, 0, 0, -1 };
+  zword c = zmachine_call (ZQ_READ_KEY, timeout, show_cursor, 0, 0, &input);
+  vm_after_input (&input);
+  return c;
+  }
+
+
+/*======================================================================
+  vm_read_line
+======================================================================*/
+static zword vm_read_line (int max, zword *line, int timeout, int width, 
+    int continued)
+  {
+  ZMachineInput input = { line, 0, 0, -1 };
+  zword terminator = zmachine_call (ZQ_READ_LINE, max, timeout, width, 
+    continued, &input);
+  vm_after_input (&input);
+  return terminator;
+  }
+
+
+/*======================================================================
+  vm_read_file_name
+======================================================================*/
+static int vm_read_file_name (char *file_name, const char *default_name, 
+    int flag)
+  {
+  ZMachineFileNameRequest r;
+  r.file_name = file_name;
+  r.default_name = default_name;
+  return zmachine_call (ZQ_READ_FILE_NAME, flag, 0, 0, 0, &r);
+  }
+
+
+/*======================================================================
+  vm_more_prompt
+======================================================================*/
+static void vm_more_prompt (void)
+  {
+  ZMachineInput input = { NULL, 0, 0, -1 };
+  zmachine_call (ZQ_MORE_PROMPT, 0, 0, 0, 0, &input);
+  vm_after_input (&input);
+  }
+
+
+/*======================================================================
+  vm_fatal
+os_fatal doesn't return, so neither will this
+======================================================================*/
+static void vm_fatal (const char *s)
+  {
+  zmachine_call (ZQ_FATAL, 0, 0, 0, 0, (void *) s);
+  }
 
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <gdk/gdkkeysyms.h>
 #include "ZTerminal.h"
+#define ZCONTEXT_NO_ALIASES
 #include "frotz.h"
 #include "charutils.h"
 #include "MainWindow.h"
@@ -20,7 +21,15 @@ void zterminal_get_custom_glyph (StoryTerminal *self,
 
 #include "gfx_font_data.c"
 
-int completion (const gunichar2 *buffer, gunichar2 *result);
+// Tab completion in zterminal_read_line. After a Tab that can't
+//  extend the word any further, more Tabs cycle through the words
+//  that could complete it
+typedef struct _ZTerminalCompletion
+  {
+  int start; // Of the word being cycled through, or -1
+  int next;  // The candidate the next Tab puts in its place
+  gunichar2 prefix[10];
+  } ZTerminalCompletion;
 
 /*======================================================================
   zterminal_init
@@ -140,6 +149,64 @@ int zterminal_find_prev_word (ZTerminal *self, GArray *input_buffer,
 }
 
 
+/*======================================================================
+  zterminal_complete_word
+Complete the word before the cursor from the game's dictionary, as
+far as the possible completions agree or, if they don't, by cycling
+through them. Returns TRUE if the input changed. This runs while the
+interpreter thread waits for the line, so its Z-machine context is
+the current one, and the dictionary can be used
+======================================================================*/
+static gboolean zterminal_complete_word (ZTerminal *self, 
+     GArray *input_buffer, int *input_pos, int max, 
+     ZTerminalCompletion *comp)
+  {
+  gunichar2 *p = (gunichar2 *) input_buffer->data;
+  gunichar2 word[10];
+  int n;
+
+  if (comp->start < 0)
+    {
+    int start = *input_pos;
+    while (start > 0 && p[start - 1] != ' ') start--;
+    n = MIN (*input_pos - start, 9);
+    memcpy (word, p + start, n * sizeof (gunichar2));
+    word[n] = 0;
+
+    gunichar2 extension[10];
+    int result = completion (word, extension, G_N_ELEMENTS (extension));
+    if (result == 2) return FALSE;
+    n = 0;
+    while (extension[n]) n++;
+    if (n > 0 || result == 0)
+      {
+      if (input_buffer->len + n >= max) return FALSE;
+      g_array_insert_vals (input_buffer, *input_pos, extension, n);
+      *input_pos += n;
+      return n > 0;
+      }
+
+    comp->start = start;
+    comp->next = 0;
+    memcpy (comp->prefix, word, sizeof (word));
+    }
+
+  if (!nth_completion (comp->prefix, comp->next, word))
+    return FALSE;
+  comp->next = (comp->next + 1) % completions (comp->prefix);
+
+  n = 0;
+  while (word[n]) n++;
+  if (input_buffer->len - (*input_pos - comp->start) + n >= max) 
+    return FALSE;
+  g_array_remove_range (input_buffer, comp->start, 
+    *input_pos - comp->start);
+  g_array_insert_vals (input_buffer, comp->start, word, n);
+  *input_pos = comp->start + n;
+  return TRUE;
+  }
+
+
 
 
 /*======================================================================
@@ -199,6 +266,7 @@ gboolean zterminal_is_terminator (zword zkey)
   if (zkey == ZC_SINGLE_CLICK) return TRUE;
   if (zkey == ZC_DOUBLE_CLICK) return TRUE;
   if (zkey >= ZC_FKEY_MIN && zkey <= ZC_FKEY_MAX) return TRUE;
+  if (zkey >= ZC_HKEY_MIN && zkey <= ZC_HKEY_MAX) return TRUE;
   return FALSE; //TODO
   }
 
@@ -324,12 +392,13 @@ zword zterminal_read_key (ZTerminal *self, int timeout, gboolean show_cursor,
 ======================================================================*/
 gunichar2 zterminal_read_line (ZTerminal *self, int max, 
      gunichar2 *line, int timeout, 
-     int width, gboolean continued, int *mouse_x, int *mouse_y)
+     int width, gboolean continued, int *mouse_x, int *mouse_y, 
+     long *rewind_position)
   {
   //storyterminal_set_gfx_from_cursor (STORYTERMINAL(self));
 
   STInput input;
-  gunichar2 zc;
+  gunichar2 zc = 0;
   int input_pos = 0;
 
   // history_pos is the index of the string that will be inserted
@@ -401,19 +470,18 @@ gunichar2 zterminal_read_line (ZTerminal *self, int max,
   storyterminal_get_gfx_pos (STORYTERMINAL(self), &gfx_x, &gfx_y); 
   storyterminal_set_gfx_cursor (STORYTERMINAL(self), gfx_x - piwidth, gfx_y); 
 
+  ZTerminalCompletion comp;
+  comp.start = -1;
+
   do 
     {
-/*
-gunichar2 comp_out[200];
-int comp_result = completion ((gunichar2*)input_buffer->data, comp_out);
-printf ("c=%d\n", comp_result);
-*/
-
     //Note show_cusor param FALSE here because we are doing our
     // own caret drawing
     storyterminal_wait_for_input (STORYTERMINAL(self), &input, TRUE, 
       FALSE, timeout * 100); // Z-code timeouts are in tenths
     gboolean redraw = FALSE;
+    if (input.type != ST_INPUT_KEY || input.key != GDK_Tab)
+      comp.start = -1;
     if (input.type == ST_INPUT_TIMEOUT)
       {
       return ZC_TIME_OUT;
@@ -552,6 +620,11 @@ printf ("c=%d\n", comp_result);
             }
           break;
 
+        case GDK_Tab:
+          redraw = zterminal_complete_word (self, input_buffer, 
+            &input_pos, max, &comp);
+          break;
+
         default:
           zc = zterminal_gdk_key_to_zkey (input.key);
           if (!zterminal_is_terminator (zc) && zc != 0 && zc != 27)
@@ -565,6 +638,13 @@ printf ("c=%d\n", comp_result);
             } 
         }
       }
+    else if (input.type == ST_INPUT_REWIND)
+      {
+      // The interpreter asks for the turn, unless we have a place in
+      //  the transcript, and then carries on with this line
+      *rewind_position = input.position;
+      zc = ZC_HKEY_REWIND;
+      }
     else if (input.type == ST_INPUT_SINGLE_CLICK)
       {
         *mouse_x = input.mouse_x + 1;
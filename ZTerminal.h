@@ -34,7 +34,8 @@ ZTerminal *zterminal_new (void);
 
 gunichar2 zterminal_read_line (ZTerminal *self, int max, 
      gunichar2 *line, int timeout, 
-     int width, gboolean continued, int *mouse_x, int *mouse_y);
+     int width, gboolean continued, int *mouse_x, int *mouse_y, 
+     long *rewind_position);
 gunichar2 zterminal_read_key (ZTerminal *self, int timeout, 
      gboolean show_cursor, int *mouse_x, int *mouse_y);
 void zterminal_margins_to_bg (ZTerminal *self);
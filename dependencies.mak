@@ -7,7 +7,8 @@ kbcomboboxtext.o: kbcomboboxtext.c kbcomboboxtext.h
 StoryReader.o: StoryReader.c StoryReader.h ZMachine.h Picture.h blorbreader.h Sound.h
 StoryTerminal.o: StoryTerminal.c StoryTerminal.h blorbreader.h colourutils.h charutils.h
 Interpreter.o: Interpreter.c Interpreter.h
-ZMachine.o: ZMachine.c ZMachine.h frotz.h Picture.h Sound.h MediaPlayer.h StoryReader.h Interpreter.h
+ZMachine.o: ZMachine.c ZMachine.h frotz.h Picture.h Sound.h MediaPlayer.h StoryReader.h Interpreter.h RenderQueue.h
+RenderQueue.o: RenderQueue.c RenderQueue.h
 blorbreader.o: blorbreader.c blorbreader.h Picture.h MetaData.h ZTerminal.h
 Picture.o: Picture.c Picture.h
 MetaData.o: MetaData.h MetaData.c
@@ -19,6 +20,7 @@ frotz_buffer.o: frotz_buffer.c frotz.h
 frotz_err.o: frotz_err.c frotz.h
 frotz_process.o: frotz_process.c frotz.h
 frotz_fastmem.o: frotz_fastmem.c frotz.h
+frotz_memdiff.o: frotz_memdiff.c frotz.h
 frotz_files.o: frotz_files.c frotz.h
 frotz_hotkey.o: frotz_hotkey.c frotz.h
 frotz_input.o: frotz_math.c frotz.h
@@ -37,3 +39,6 @@ frotz_variable.o: frotz_variable.c frotz.h
 dialogs.o: dialogs.c dialogs.h
 Sound.o: Sound.c Sound.h
 MediaPlayer.o: MediaPlayer.h MediaPlayer.c
+grotzcli.o: grotzcli.c frotz.h headless.h
+memdiffbench.o: memdiffbench.c frotz.h
+headless.o: headless.c frotz.h headless.h
@@ -67,4 +67,51 @@ void dialogs_show_text (GtkWindow *parent, const char *text)
 }
 
 
+/*======================================================================
+  dialogs_choose_in_text
+Show the text, with a button for the action as well as OK. Returns
+where the cursor was, in characters from the start, if the action
+was chosen, or -1
+======================================================================*/
+long dialogs_choose_in_text (GtkWindow *parent, const char *text, 
+    const char *action)
+{
+   long position = -1;
+   GtkDialog *dialog = GTK_DIALOG (gtk_dialog_new_with_buttons (APPNAME,
+        parent,
+        GTK_DIALOG_DESTROY_WITH_PARENT,
+        action,
+        GTK_RESPONSE_APPLY,
+        GTK_STOCK_OK,
+        GTK_RESPONSE_NONE,
+        NULL));
+
+   GtkTextView *tv = GTK_TEXT_VIEW (gtk_text_view_new());
+   gtk_text_view_set_wrap_mode (tv, GTK_WRAP_WORD);
+   gtk_text_view_set_editable (tv, FALSE);
+   GtkScrolledWindow *scroller = GTK_SCROLLED_WINDOW 
+     (gtk_scrolled_window_new (NULL, NULL));
+   gtk_widget_set_size_request (GTK_WIDGET (scroller), 400, 400);
+   gtk_widget_set_size_request (GTK_WIDGET (dialog), 400, 400);
+   GtkTextBuffer *buffer = gtk_text_view_get_buffer (tv); 
+   GtkTextIter start;
+   gtk_text_buffer_get_start_iter (buffer, &start);
+   gtk_text_buffer_insert (buffer, &start, text, -1);
+   gtk_scrolled_window_add_with_viewport (scroller, GTK_WIDGET (tv));   
+
+   gtk_container_add (GTK_CONTAINER (GTK_DIALOG(dialog)->vbox),
+        GTK_WIDGET (scroller));
+   gtk_widget_show_all (GTK_WIDGET(dialog));
+   if (gtk_dialog_run (dialog) == GTK_RESPONSE_APPLY)
+   {
+     GtkTextIter cursor;
+     gtk_text_buffer_get_iter_at_mark (buffer, &cursor, 
+       gtk_text_buffer_get_insert (buffer));
+     position = gtk_text_iter_get_offset (&cursor);
+   }
+   gtk_widget_destroy (GTK_WIDGET (dialog));
+   return position;
+}
+
+
 
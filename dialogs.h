@@ -2,4 +2,6 @@
 
 void dialogs_show_pixbuf (GtkWindow *parent, GdkPixbuf *pixbuf); 
 void dialogs_show_text (GtkWindow *parent, const char *text);
+long dialogs_choose_in_text (GtkWindow *parent, const char *text, 
+    const char *action);
 
@@ -46,6 +46,27 @@ enum story {
 #ifndef MAX_UNDO_SLOTS
 #define MAX_UNDO_SLOTS 500
 #endif
+#ifndef UNDO_ARENA_SIZE	/* bytes kept for undo states, by default */
+#define UNDO_ARENA_SIZE 0x100000L
+#endif
+#ifndef TIMELINE_INTERVAL	/* turns between keyframes of the timeline */
+#define TIMELINE_INTERVAL 32
+#endif
+#ifndef TIMELINE_MEMORY		/* bytes kept for the timeline, by default */
+#define TIMELINE_MEMORY 0x800000L
+#endif
+#ifndef AUTOSAVE_TURNS		/* checkpoint at least this often... */
+#define AUTOSAVE_TURNS 10
+#endif
+#ifndef AUTOSAVE_SECONDS	/* ...and this often */
+#define AUTOSAVE_SECONDS 60
+#endif
+#ifndef AUTOSAVE_FILES		/* checkpoints kept for each story */
+#define AUTOSAVE_FILES 3
+#endif
+#ifndef TEXT_CACHE_SIZE		/* bytes kept for decoded strings */
+#define TEXT_CACHE_SIZE 0x40000L
+#endif
 #ifndef MAX_FILE_NAME
 #define MAX_FILE_NAME 256
 #endif
@@ -58,6 +79,15 @@ enum story {
 #ifndef STACK_SIZE
 #define STACK_SIZE 32768
 #endif
+#ifndef ICACHE_SIZE	/* decoded instruction cache, must be a power of 2 */
+#define ICACHE_SIZE 4096
+#endif
+#ifndef UNICODE_HASH_SIZE	/* Unicode to ZSCII table, must be a power of 2 */
+#define UNICODE_HASH_SIZE 512
+#endif
+#ifndef ROUTINE_CACHE_SIZE	/* routine header cache, must be a power of 2 */
+#define ROUTINE_CACHE_SIZE 1024
+#endif
 
 #ifndef DEFAULT_SAVE_NAME
 #define DEFAULT_SAVE_NAME "story.sav"
@@ -225,7 +255,8 @@ enum story {
 #define ZC_HKEY_QUIT 0x13
 #define ZC_HKEY_DEBUG 0x14
 #define ZC_HKEY_HELP 0x15
-#define ZC_HKEY_MAX 0x15
+#define ZC_HKEY_REWIND 0x16
+#define ZC_HKEY_MAX 0x16
 #define ZC_ESCAPE 0x1b
 #define ZC_ASCII_MIN 0x20
 #define ZC_ASCII_MAX 0x7e
@@ -258,19 +289,31 @@ enum story {
 
 /*** Data access macros ***/
 
-#define SET_BYTE(addr,v)  { zmp[addr] = v; }
+/* Writes to memory are tracked in blocks of 1 << DIRTY_SHIFT bytes,
+   so that an undo snapshot need only look at the blocks written since
+   the last one */
+
+#define DIRTY_SHIFT 6
+#define DIRTY_MAP_SIZE ((0x10000 >> (DIRTY_SHIFT + 3)) + 1)
+#define MARK_DIRTY(addr)  { dirty_map[(addr) >> (DIRTY_SHIFT + 3)] |= 1 << (((addr) >> DIRTY_SHIFT) & 7); }
+
+/* The bytes that give the layout of indexed property lists, and the
+   abbreviation table while the cached text depends on it, are guarded;
+   writing one drops what depends on it (frotz_object.c) */
+
+#define WRITE_GUARD_SIZE ((0x10000 >> 3) + 1)
+#define GUARD_WRITE(addr) { if (write_guard[(addr) >> 3] & (1 << ((addr) & 7))) guarded_write (addr); }
+
+#define SET_BYTE(addr,v)  { MARK_DIRTY(addr) GUARD_WRITE(addr) zmp[addr] = v; }
 #define LOW_BYTE(addr,v)  { v = zmp[addr]; }
 #define CODE_BYTE(v)	  { v = *pcp++;    }
 
 #if defined (AMIGA)
 
-extern zbyte *pcp;
-extern zbyte *zmp;
-
 #define lo(v)		((zbyte *)&v)[1]
 #define hi(v)		((zbyte *)&v)[0]
 
-#define SET_WORD(addr,v)  { zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
+#define SET_WORD(addr,v)  { MARK_DIRTY(addr) MARK_DIRTY(addr+1) GUARD_WRITE(addr) GUARD_WRITE(addr+1) zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
 #define LOW_WORD(addr,v)  { hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
 #define HIGH_WORD(addr,v) { hi(v) = zmp[addr]; lo(v) = zmp[addr+1]; }
 #define CODE_WORD(v)      { hi(v) = *pcp++; lo(v) = *pcp++; }
@@ -283,13 +326,10 @@ extern zbyte *zmp;
 
 #if !defined (AMIGA) && !defined (MSDOS_16BIT)
 
-extern zbyte *pcp;
-extern zbyte *zmp;
-
 #define lo(v)	(v & 0xff)
 #define hi(v)	(v >> 8)
 
-#define SET_WORD(addr,v)  { zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
+#define SET_WORD(addr,v)  { MARK_DIRTY(addr) MARK_DIRTY(addr+1) GUARD_WRITE(addr) GUARD_WRITE(addr+1) zmp[addr] = hi(v); zmp[addr+1] = lo(v); }
 #define LOW_WORD(addr,v)  { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
 #define HIGH_WORD(addr,v) { v = ((zword) zmp[addr] << 8) | zmp[addr+1]; }
 #define CODE_WORD(v)      { v = ((zword) pcp[0] << 8) | pcp[1]; pcp += 2; }
@@ -299,102 +339,6 @@ extern zbyte *zmp;
 #endif
 
 
-/*** Story file header data ***/
-
-extern zbyte h_version;
-extern zbyte h_config;
-extern zword h_release;
-extern zword h_resident_size;
-extern zword h_start_pc;
-extern zword h_dictionary;
-extern zword h_objects;
-extern zword h_globals;
-extern zword h_dynamic_size;
-extern zword h_flags;
-extern zbyte h_serial[6];
-extern zword h_abbreviations;
-extern zword h_file_size;
-extern zword h_checksum;
-extern zbyte h_interpreter_number;
-extern zbyte h_interpreter_version;
-extern zbyte h_screen_rows;
-extern zbyte h_screen_cols;
-extern zword h_screen_width;
-extern zword h_screen_height;
-extern zbyte h_font_height;
-extern zbyte h_font_width;
-extern zword h_functions_offset;
-extern zword h_strings_offset;
-extern zbyte h_default_background;
-extern zbyte h_default_foreground;
-extern zword h_terminating_keys;
-extern zword h_line_width;
-extern zbyte h_standard_high;
-extern zbyte h_standard_low;
-extern zword h_alphabet;
-extern zword h_extension_table;
-extern zbyte h_user_name[8];
-
-extern zword hx_table_size;
-extern zword hx_mouse_x;
-extern zword hx_mouse_y;
-extern zword hx_unicode_table;
-extern zword hx_flags;
-extern zword hx_fore_colour;
-extern zword hx_back_colour;
-
-/*** Various data ***/
-
-extern char *story_name;
-
-extern enum story story_id;
-extern long story_size;
-
-extern zword stack[STACK_SIZE];
-extern zword *sp;
-extern zword *fp;
-extern zword frame_count;
-
-extern zword zargs[8];
-extern int zargc;
-
-extern bool ostream_screen;
-extern bool ostream_script;
-extern bool ostream_memory;
-extern bool ostream_record;
-extern bool istream_replay;
-extern bool message;
-
-extern int cwin;
-extern int mwin;
-
-extern int mouse_x;
-extern int mouse_y;
-extern int menu_selected;
-
-extern bool enable_wrapping;
-extern bool enable_scripting;
-extern bool enable_scrolling;
-extern bool enable_buffering;
-
-extern int option_attribute_assignment;
-extern int option_attribute_testing;
-extern int option_object_locating;
-extern int option_object_movement;
-extern int option_context_lines;
-extern int option_left_margin;
-extern int option_right_margin;
-extern int option_ignore_errors;
-extern int option_piracy;
-extern int option_undo_slots;
-extern int option_expand_abbreviations;
-extern int option_script_cols;
-extern int option_save_quetzal;
-extern int option_sound;	/* dg */
-extern char *option_zcode_path;	/* dg */
-
-extern long reserve_mem;
-
 /*** Z-machine opcodes ***/
 
 void 	z_add (void);
@@ -512,8 +456,6 @@ void 	z_window_style (void);
 
 /* Definitions for error handling functions and error codes. */
 
-extern int err_report_mode;
-
 void	init_err (void);
 void	runtime_error (int);
  
@@ -573,11 +515,520 @@ void	runtime_error (int);
 #define ERR_DEFAULT_REPORT_MODE ERR_REPORT_ONCE
 
 
+/*** Z-machine context ***/
+
+/* All the state of one Z-machine lives in a ZContext, so that several
+   independent machines can run in one process. The frotz core works on
+   the context bound to the calling thread by zcontext_bind (); the
+   names below that used to be globals refer to its fields. */
+
+#define MAX_NESTING 16		/* depth of output stream 3 redirection */
+
+typedef struct zwindow_struct Zwindow;
+struct zwindow_struct {
+    zword y_pos;
+    zword x_pos;
+    zword y_size;
+    zword x_size;
+    zword y_cursor;
+    zword x_cursor;
+    zword left;
+    zword right;
+    zword nl_routine;
+    zword nl_countdown;
+    zword style;
+    zword colour;
+    zword font;
+    zword font_size;
+    zword attribute;
+    zword line_count;
+    zword true_fore;
+    zword true_back;
+};
+
+/* Kinds of superinstruction (frotz_process.c) */
+
+enum fused_kind {
+    FUSED_NONE,
+    FUSED_JE_BRANCH,
+    FUSED_JZ_BRANCH,
+    FUSED_INC_CHK_BRANCH,
+    FUSED_DEC_CHK_BRANCH,
+    FUSED_INC_CHK_JUMP,
+    FUSED_DEC_CHK_JUMP,
+    FUSED_LOADW_STORE,
+    FUSED_KINDS
+};
+
+typedef struct zbackend_struct ZBackend;
+
+typedef struct zcontext_struct ZContext;
+struct zcontext_struct {
+
+    /* Story file and header data (frotz_main.c, frotz_fastmem.c) */
+
+    char *story_name;
+    enum story story_id;
+    long story_size;
+
+    int packed_shift;
+    long routine_offset;
+    long string_offset;
+
+    zbyte h_version;
+    zbyte h_config;
+    zword h_release;
+    zword h_resident_size;
+    zword h_start_pc;
+    zword h_dictionary;
+    zword h_objects;
+    zword h_globals;
+    zword h_dynamic_size;
+    zword h_flags;
+    zbyte h_serial[6];
+    zword h_abbreviations;
+    zword h_file_size;
+    zword h_checksum;
+    zbyte h_interpreter_number;
+    zbyte h_interpreter_version;
+    zbyte h_screen_rows;
+    zbyte h_screen_cols;
+    zword h_screen_width;
+    zword h_screen_height;
+    zbyte h_font_height;
+    zbyte h_font_width;
+    zword h_functions_offset;
+    zword h_strings_offset;
+    zbyte h_default_background;
+    zbyte h_default_foreground;
+    zword h_terminating_keys;
+    zword h_line_width;
+    zbyte h_standard_high;
+    zbyte h_standard_low;
+    zword h_alphabet;
+    zword h_extension_table;
+    zbyte h_user_name[8];
+
+    zword hx_table_size;
+    zword hx_mouse_x;
+    zword hx_mouse_y;
+    zword hx_unicode_table;
+    zword hx_flags;
+    zword hx_fore_colour;
+    zword hx_back_colour;
+
+    /* Memory and stack */
+
+    zbyte *zmp;
+    zbyte *pcp;
+
+    zword stack[STACK_SIZE];
+    zword *sp;
+    zword *fp;
+    zword frame_count;
+
+    zword zargs[8];
+    int zargc;
+
+    /* Streams, windows and input */
+
+    bool ostream_screen;
+    bool ostream_script;
+    bool ostream_memory;
+    bool ostream_record;
+    bool istream_replay;
+    bool message;
+
+    int cwin;
+    int mwin;
+
+    int mouse_y;
+    int mouse_x;
+    int menu_selected;
+
+    long scrollback_size;	/* characters sent to the scrollback */
+    long rewind_position;	/* the place in it to go back to, or -1 */
+
+    bool enable_wrapping;
+    bool enable_scripting;
+    bool enable_scrolling;
+    bool enable_buffering;
+
+    /* Options */
+
+    int option_attribute_assignment;
+    int option_attribute_testing;
+    int option_context_lines;
+    int option_object_locating;
+    int option_object_movement;
+    int option_left_margin;
+    int option_right_margin;
+    int option_ignore_errors;
+    int option_piracy;
+    int option_map_story;		/* map the story file, if possible */
+    int option_undo_slots;
+    long option_undo_bytes;
+    const char *option_undo_journal;	/* directory for the undo journal */
+    int option_timeline_interval;
+    long option_timeline_bytes;
+    const char *option_autosave;	/* directory for checkpoints, or NULL */
+    int option_autosave_turns;
+    int option_autosave_seconds;
+    int option_autosave_files;
+    const char *option_resume;		/* checkpoint to start from, or NULL */
+    int option_expand_abbreviations;
+    long option_text_cache;		/* bytes for decoded strings, or 0 */
+    int option_script_cols;
+    int option_save_quetzal;
+    int option_sound;
+    char *option_zcode_path;
+
+    long reserve_mem;
+
+    int err_report_mode;
+    int error_count[ERR_NUM_ERRORS];
+
+    /* File names and files (frotz_fastmem.c, frotz_files.c) */
+
+    char save_name[MAX_FILE_NAME + 1];
+    char auxilary_name[MAX_FILE_NAME + 1];
+    char script_name[MAX_FILE_NAME + 1];
+    char command_name[MAX_FILE_NAME + 1];
+
+    FILE *story_fp;
+    bool first_restart;
+    long init_fp_pos;
+    zbyte *story_map;		/* mapping of the story file, or NULL */
+    size_t story_map_size;
+    zbyte *story_dynamic;	/* dynamic memory as it was loaded */
+    zword story_checksum;	/* of the story file, once it is known */
+    bool story_checksum_known;
+
+    int script_width;
+    bool script_valid;
+    FILE *sfp;
+    FILE *rfp;
+    FILE *pfp;
+
+    /* Undo (frotz_fastmem.c) */
+
+    struct undo_struct *first_undo;
+    struct undo_struct *last_undo;
+    struct undo_struct *curr_undo;
+    zbyte *undo_mem;
+    zbyte *prev_zmp;
+    zbyte *undo_diff;
+    int undo_count;
+    zbyte *undo_arena;		/* ring of undo states */
+    long undo_arena_size;
+    long undo_used;		/* bytes of the ring in use, now and at most */
+    long undo_peak;
+    int journal_fd;		/* undo states dropped from the ring */
+    zbyte *journal_map;
+    long journal_map_size;
+    long journal_used;
+    long journal_peak;
+    long journal_spills;
+    long journal_reloads;
+
+    /* Timeline of turns (frotz_fastmem.c) */
+
+    struct turn_struct *turns;
+    long turn_count;
+    long turn_alloc;
+    long turns_dropped;		/* the oldest, to stay within the budget */
+    long timeline_start;	/* the oldest turn's place in the scrollback */
+    zbyte *timeline;		/* the turns' deltas, keyframes and stacks */
+    long timeline_size;
+    long timeline_alloc;
+    zbyte *timeline_prev;	/* dynamic memory as of the last turn */
+    bool timeline_rewound;
+    zbyte dirty_map[DIRTY_MAP_SIZE];	/* blocks written since prev_zmp */
+
+    /* Checkpoints (frotz_fastmem.c, frotz_quetzal.c) */
+
+    char autosave_dir[MAX_FILE_NAME + 1];	/* this story's, or empty */
+    int autosave_turns;		/* since the last one */
+    long autosave_time;
+    bool checkpoint_read;	/* a checkpoint has just been restored */
+    zword checkpoint_args[5];	/* zargc and zargs of its read */
+
+    /* Interpreter loop (frotz_process.c) */
+
+    void (*op0_opcodes[0x10]) (void);
+    void (*op1_opcodes[0x10]) (void);
+    void (*var_opcodes[0x40]) (void);
+
+    int finished;
+    struct icache_struct *icache;
+    struct icache_struct *curr_insn;
+    struct routine_struct *routine_cache;
+    long routine_hits;		/* calls that found their header there */
+    long routine_misses;
+    long fused_count[FUSED_KINDS];	/* superinstructions run, by kind */
+
+    /* Text output (frotz_buffer.c, frotz_redirect.c, frotz_text.c) */
+
+    zword text_buffer[TEXT_BUFFER_SIZE];
+    int bufpos;
+    bool buffer_locked;
+    bool print_char_flag;
+    zword prev_c;
+
+    int redirect_depth;
+    struct {
+	zword xsize;
+	zword table;
+	zword width;
+	zword total;
+    } redirect[MAX_NESTING];
+
+    zword decoded[10];
+    zword encoded[3];
+
+    zword alphabet_table[3][26];	/* character sets, as Unicode */
+    zbyte alphabet_index[128];		/* set and index of each ASCII one */
+    zword zscii_unicode[256];		/* ZSCII to Unicode */
+    zword unicode_key[UNICODE_HASH_SIZE];	/* and back again, hashed */
+    zbyte unicode_zscii[UNICODE_HASH_SIZE];
+
+    struct text_entry **text_hash;	/* decoded strings, by address */
+    struct text_entry *text_newest;	/* and from most to least recent */
+    struct text_entry *text_oldest;
+    long text_used;			/* bytes the entries take */
+    long text_hits;
+    long text_misses;
+    zword *text_run;		/* string being decoded for the cache */
+    long text_run_len;
+    long text_run_size;
+    bool text_capture;
+    bool text_volatile;		/* it uses text the game can change */
+    bool abbreviations_written;	/* the game has changed the table */
+
+    struct dict_index *dict_indexes;	/* most recently used first */
+
+    struct trie_node *word_trie;	/* the dictionary, for completion */
+    int word_nodes;
+    int word_size;
+
+    /* Objects (frotz_object.c) */
+
+    struct prop_slot **prop_index;	/* each object's, or NULL */
+    zbyte write_guard[WRITE_GUARD_SIZE];	/* bytes things depend on */
+
+    /* Screen (frotz_screen.c, frotz_input.c) */
+
+    int font_height;
+    int font_width;
+
+    bool input_redraw;
+    bool more_prompts;
+    bool discarding;
+    bool cursor;
+
+    int input_window;
+
+    Zwindow wp[8];
+    Zwindow *cwp;
+
+    zword menu_text[32];
+
+    /* Sound (frotz_sound.c) */
+
+    zword sound_routine;
+    int next_sample;
+    int next_volume;
+    bool sound_locked;
+    bool playing;
+
+    /* Random numbers (frotz_random.c) */
+
+    long random_a;
+    int random_interval;
+    int random_counter;
+
+    /* Saving (frotz_quetzal.c) */
+
+    zword quetzal_frames[STACK_SIZE/4+1];
+    struct save_job *save_job;	/* being written in the background */
+
+    /* The os_* interface, and data belonging to it */
+
+    const ZBackend *os;
+    void *os_data;
+
+};
+
+#if defined (__GNUC__)
+#define ZTHREAD __thread
+#else
+#define ZTHREAD			/* only one machine at a time */
+#endif
+
+extern ZTHREAD ZContext *zctx;
+
+ZContext *zcontext_new (void);
+void	zcontext_free (ZContext *);
+void	zcontext_bind (ZContext *);
+
+void	undo_memory (long *, long *);
+void	undo_journal (long *, long *, long *, long *);
+void	text_cache (long *, long *, long *);
+const char *superinstruction (int, long *);
+void	routine_headers (long *, long *);
+long	timeline_turns (void);
+long	timeline_oldest (void);
+long	timeline_find (long);
+bool	autosave_find (const char *, const char *, char *);
+int	finish_save (bool);
+
+/* Front-end modules that only need the constants and types, and whose
+   own identifiers would clash with the names below, may define
+   ZCONTEXT_NO_ALIASES before including this file. The stack's names
+   are too short to give every file that includes it, so the modules
+   that work on the stack define ZCONTEXT_STACK_ALIASES to get them. */
+
+#ifndef ZCONTEXT_NO_ALIASES
+
+#define story_name (zctx->story_name)
+#define story_id (zctx->story_id)
+#define story_size (zctx->story_size)
+
+#define packed_shift (zctx->packed_shift)
+#define routine_offset (zctx->routine_offset)
+#define string_offset (zctx->string_offset)
+
+#define h_version (zctx->h_version)
+#define h_config (zctx->h_config)
+#define h_release (zctx->h_release)
+#define h_resident_size (zctx->h_resident_size)
+#define h_start_pc (zctx->h_start_pc)
+#define h_dictionary (zctx->h_dictionary)
+#define h_objects (zctx->h_objects)
+#define h_globals (zctx->h_globals)
+#define h_dynamic_size (zctx->h_dynamic_size)
+#define h_flags (zctx->h_flags)
+#define h_serial (zctx->h_serial)
+#define h_abbreviations (zctx->h_abbreviations)
+#define h_file_size (zctx->h_file_size)
+#define h_checksum (zctx->h_checksum)
+#define h_interpreter_number (zctx->h_interpreter_number)
+#define h_interpreter_version (zctx->h_interpreter_version)
+#define h_screen_rows (zctx->h_screen_rows)
+#define h_screen_cols (zctx->h_screen_cols)
+#define h_screen_width (zctx->h_screen_width)
+#define h_screen_height (zctx->h_screen_height)
+#define h_font_height (zctx->h_font_height)
+#define h_font_width (zctx->h_font_width)
+#define h_functions_offset (zctx->h_functions_offset)
+#define h_strings_offset (zctx->h_strings_offset)
+#define h_default_background (zctx->h_default_background)
+#define h_default_foreground (zctx->h_default_foreground)
+#define h_terminating_keys (zctx->h_terminating_keys)
+#define h_line_width (zctx->h_line_width)
+#define h_standard_high (zctx->h_standard_high)
+#define h_standard_low (zctx->h_standard_low)
+#define h_alphabet (zctx->h_alphabet)
+#define h_extension_table (zctx->h_extension_table)
+#define h_user_name (zctx->h_user_name)
+
+#define hx_table_size (zctx->hx_table_size)
+#define hx_mouse_x (zctx->hx_mouse_x)
+#define hx_mouse_y (zctx->hx_mouse_y)
+#define hx_unicode_table (zctx->hx_unicode_table)
+#define hx_flags (zctx->hx_flags)
+#define hx_fore_colour (zctx->hx_fore_colour)
+#define hx_back_colour (zctx->hx_back_colour)
+
+#define zmp (zctx->zmp)
+#define pcp (zctx->pcp)
+#define dirty_map (zctx->dirty_map)
+#define write_guard (zctx->write_guard)
+
+#define op0_opcodes (zctx->op0_opcodes)
+#define op1_opcodes (zctx->op1_opcodes)
+#define var_opcodes (zctx->var_opcodes)
+
+#define frame_count (zctx->frame_count)
+
+#define zargs (zctx->zargs)
+#define zargc (zctx->zargc)
+
+#define ostream_screen (zctx->ostream_screen)
+#define ostream_script (zctx->ostream_script)
+#define ostream_memory (zctx->ostream_memory)
+#define ostream_record (zctx->ostream_record)
+#define istream_replay (zctx->istream_replay)
+
+#define cwin (zctx->cwin)
+#define mwin (zctx->mwin)
+
+#define mouse_x (zctx->mouse_x)
+#define mouse_y (zctx->mouse_y)
+#define menu_selected (zctx->menu_selected)
+
+#define scrollback_size (zctx->scrollback_size)
+#define rewind_position (zctx->rewind_position)
+
+#define enable_wrapping (zctx->enable_wrapping)
+#define enable_scripting (zctx->enable_scripting)
+#define enable_scrolling (zctx->enable_scrolling)
+#define enable_buffering (zctx->enable_buffering)
+
+#define option_attribute_assignment (zctx->option_attribute_assignment)
+#define option_attribute_testing (zctx->option_attribute_testing)
+#define option_object_locating (zctx->option_object_locating)
+#define option_object_movement (zctx->option_object_movement)
+#define option_context_lines (zctx->option_context_lines)
+#define option_left_margin (zctx->option_left_margin)
+#define option_right_margin (zctx->option_right_margin)
+#define option_ignore_errors (zctx->option_ignore_errors)
+#define option_piracy (zctx->option_piracy)
+#define option_map_story (zctx->option_map_story)
+#define option_undo_slots (zctx->option_undo_slots)
+#define option_undo_bytes (zctx->option_undo_bytes)
+#define option_undo_journal (zctx->option_undo_journal)
+#define option_timeline_interval (zctx->option_timeline_interval)
+#define option_timeline_bytes (zctx->option_timeline_bytes)
+#define option_autosave (zctx->option_autosave)
+#define option_autosave_turns (zctx->option_autosave_turns)
+#define option_autosave_seconds (zctx->option_autosave_seconds)
+#define option_autosave_files (zctx->option_autosave_files)
+#define option_resume (zctx->option_resume)
+#define option_expand_abbreviations (zctx->option_expand_abbreviations)
+#define option_text_cache (zctx->option_text_cache)
+#define option_script_cols (zctx->option_script_cols)
+#define option_save_quetzal (zctx->option_save_quetzal)
+#define option_sound (zctx->option_sound)
+#define option_zcode_path (zctx->option_zcode_path)
+
+#define reserve_mem (zctx->reserve_mem)
+
+#define err_report_mode (zctx->err_report_mode)
+
+#define save_name (zctx->save_name)
+#define auxilary_name (zctx->auxilary_name)
+#define script_name (zctx->script_name)
+#define command_name (zctx->command_name)
+
+#endif /* ZCONTEXT_NO_ALIASES */
+
+#ifdef ZCONTEXT_STACK_ALIASES
+#define stack (zctx->stack)
+#define sp (zctx->sp)
+#define fp (zctx->fp)
+#endif /* ZCONTEXT_STACK_ALIASES */
+
+
 /*** Various global functions ***/
 
 zword	translate_from_zscii (zbyte);
 zbyte	translate_to_zscii (zword);
 
+int	completion (const zword *, zword *, int);
+int	completions (const zword *);
+bool	nth_completion (const zword *, int, zword *);
+
 void 	flush_buffer (void);
 void	new_line (void);
 void	print_char (zword);
@@ -595,8 +1046,111 @@ void 	branch (bool);
 void	storeb (zword, zbyte);
 void	storew (zword, zword);
 
+void	drop_props (void);
+void	guarded_write (zword);
+
 /*** Interface functions ***/
 
+/* The os_* interface is a table of functions supplied by a backend,
+   chosen by the front end when it sets up the context. The core
+   calls through the os_* names below; a file that implements a
+   backend defines ZBACKEND_IMPLEMENTATION before including this file
+   so that it can use the same names for its own functions. Only
+   tick may be NULL, for a backend with nothing to do between
+   instructions. */
+
+struct zbackend_struct {
+    const char *name;
+    void	(*beep) (int);
+    int		(*buffer_screen) (int);
+    int		(*char_width) (zword);
+    int		(*check_unicode) (int, zword);
+    void	(*display_char) (zword);
+    void	(*display_string) (const zword *);
+    void	(*draw_picture) (int, int, int);
+    void	(*erase_area) (int, int, int, int, int);
+    void	(*fatal) (const char *);
+    void	(*finish_with_sample) (int);
+    int		(*font_data) (int, int *, int *);
+    int		(*from_true_colour) (zword);
+    void	(*init_screen) (void);
+    void	(*menu) (int, int, const zword *);
+    void	(*more_prompt) (void);
+    FILE *	(*path_open) (const char *, const char *, long *);
+    int		(*peek_colour) (void);
+    int		(*picture_data) (int, int *, int *);
+    void	(*prepare_sample) (int);
+    int		(*random_seed) (void);
+    int		(*read_file_name) (char *, const char *, int);
+    zword	(*read_key) (int, int);
+    zword	(*read_line) (int, zword *, int, int, int);
+    zword	(*read_mouse) (void);
+    void	(*reset_screen) (void);
+    void	(*restart_game) (int);
+    void	(*scroll_area) (int, int, int, int, int);
+    void	(*scrollback_char) (zword);
+    void	(*scrollback_erase) (int);
+    void	(*set_colour) (int, int);
+    void	(*set_cursor) (int, int);
+    void	(*set_font) (int);
+    void	(*set_text_style) (int);
+    void	(*start_sample) (int, int, int, zword);
+    void	(*stop_sample) (int);
+    int		(*string_width) (const zword *);
+    void	(*tick) (void);
+    zword	(*to_true_colour) (int);
+    int		(*wrap_window) (int);
+    void	(*window_height) (int, int);
+};
+
+#ifndef ZBACKEND_IMPLEMENTATION
+
+#define os_beep(a) (zctx->os->beep (a))
+#define os_buffer_screen(a) (zctx->os->buffer_screen (a))
+#define os_char_width(a) (zctx->os->char_width (a))
+#define os_check_unicode(a,b) (zctx->os->check_unicode (a, b))
+#define os_display_char(a) (zctx->os->display_char (a))
+#define os_display_string(a) (zctx->os->display_string (a))
+#define os_draw_picture(a,b,c) (zctx->os->draw_picture (a, b, c))
+#define os_erase_area(a,b,c,d,e) (zctx->os->erase_area (a, b, c, d, e))
+#define os_fatal(a) (zctx->os->fatal (a))
+#define os_finish_with_sample(a) (zctx->os->finish_with_sample (a))
+#define os_font_data(a,b,c) (zctx->os->font_data (a, b, c))
+#define os_from_true_colour(a) (zctx->os->from_true_colour (a))
+#define os_init_screen() (zctx->os->init_screen ())
+#define os_menu(a,b,c) (zctx->os->menu (a, b, c))
+#define os_more_prompt() (zctx->os->more_prompt ())
+#define os_path_open(a,b,c) (zctx->os->path_open (a, b, c))
+#define os_peek_colour() (zctx->os->peek_colour ())
+#define os_picture_data(a,b,c) (zctx->os->picture_data (a, b, c))
+#define os_prepare_sample(a) (zctx->os->prepare_sample (a))
+#define os_random_seed() (zctx->os->random_seed ())
+#define os_read_file_name(a,b,c) (zctx->os->read_file_name (a, b, c))
+#define os_read_key(a,b) (zctx->os->read_key (a, b))
+#define os_read_line(a,b,c,d,e) (zctx->os->read_line (a, b, c, d, e))
+#define os_read_mouse() (zctx->os->read_mouse ())
+#define os_reset_screen() (zctx->os->reset_screen ())
+#define os_restart_game(a) (zctx->os->restart_game (a))
+#define os_scroll_area(a,b,c,d,e) (zctx->os->scroll_area (a, b, c, d, e))
+#define os_scrollback_char(a) (zctx->os->scrollback_char (a))
+#define os_scrollback_erase(a) (zctx->os->scrollback_erase (a))
+#define os_set_colour(a,b) (zctx->os->set_colour (a, b))
+#define os_set_cursor(a,b) (zctx->os->set_cursor (a, b))
+#define os_set_font(a) (zctx->os->set_font (a))
+#define os_set_text_style(a) (zctx->os->set_text_style (a))
+#define os_start_sample(a,b,c,d) (zctx->os->start_sample (a, b, c, d))
+#define os_stop_sample(a) (zctx->os->stop_sample (a))
+#define os_string_width(a) (zctx->os->string_width (a))
+#define os_tick() (zctx->os->tick ? zctx->os->tick () : (void) 0)
+#define os_to_true_colour(a) (zctx->os->to_true_colour (a))
+#define os_wrap_window(a) (zctx->os->wrap_window (a))
+#define os_window_height(a,b) (zctx->os->window_height (a, b))
+
+#else
+
+/* A backend written as one set of os_* functions gets the
+   prototypes, and supplies a ZBackend listing them. */
+
 void 	os_beep (int);
 int 	os_buffer_screen (int);
 int  	os_char_width (zword);
@@ -612,10 +1166,10 @@ int 	os_from_true_colour (zword);
 void 	os_init_screen (void);
 void 	os_menu(int, int, const zword *);
 void 	os_more_prompt (void);
+FILE *	os_path_open (const char *, const char *, long *);
 int  	os_peek_colour (void);
 int  	os_picture_data (int, int *, int *);
 void 	os_prepare_sample (int);
-void 	os_process_arguments (int, char *[]);
 int	os_random_seed (void);
 int  	os_read_file_name (char *, const char *, int);
 zword	os_read_key (int, int);
@@ -638,3 +1192,5 @@ zword 	os_to_true_colour (int);
 int	os_wrap_window (int);
 void	os_window_height (int, int);
 
+#endif /* ZBACKEND_IMPLEMENTATION */
+
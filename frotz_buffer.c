@@ -25,11 +25,13 @@ extern void stream_char (zword);
 extern void stream_word (const zword *);
 extern void stream_new_line (void);
 
-static zword buffer[TEXT_BUFFER_SIZE];
-static int bufpos = 0;
-static bool locked = FALSE;
+#define text_buffer (zctx->text_buffer)
+#define bufpos (zctx->bufpos)
+#define buffer_locked (zctx->buffer_locked)
+#define print_char_flag (zctx->print_char_flag)
+#define message (zctx->message)
 
-static zword prev_c = 0;
+#define prev_c (zctx->prev_c)
 
 /*
  * init_buffer
@@ -40,10 +42,10 @@ static zword prev_c = 0;
 
 void init_buffer(void)
 {
-    memset(buffer, 0, sizeof (zword) * TEXT_BUFFER_SIZE);
+    memset(text_buffer, 0, sizeof (zword) * TEXT_BUFFER_SIZE);
     bufpos = 0;
     prev_c = 0;
-    locked = FALSE;
+    buffer_locked = FALSE;
 }
 
 /*
@@ -60,14 +62,14 @@ void flush_buffer (void)
        during flush_buffer, which might cause a newline interrupt, that
        might execute any arbitrary opcode, which might flush the buffer. */
 
-    if (locked || bufpos == 0)
+    if (buffer_locked || bufpos == 0)
 	return;
 
     /* Send the buffer to the output streams */
 
-    buffer[bufpos] = 0;
+    text_buffer[bufpos] = 0;
 
-    locked = TRUE; stream_word (buffer); locked = FALSE;
+    buffer_locked = TRUE; stream_word (text_buffer); buffer_locked = FALSE;
 
     /* Reset the buffer */
 
@@ -85,11 +87,9 @@ void flush_buffer (void)
 
 void print_char (zword c)
 {
-    static bool flag = FALSE;
-
     if (message || ostream_memory || enable_buffering) {
 
-	if (!flag) {
+	if (!print_char_flag) {
 
 	    /* Characters 0 and ZC_RETURN are special cases */
 
@@ -108,17 +108,17 @@ void print_char (zword c)
 	    /* Set the flag if this is part one of a style or font change */
 
 	    if (c == ZC_NEW_FONT || c == ZC_NEW_STYLE)
-		flag = TRUE;
+		print_char_flag = TRUE;
 
 	    /* Remember the current character code */
 
 	    prev_c = c;
 
-	} else flag = FALSE;
+	} else print_char_flag = FALSE;
 
 	/* Insert the character into the buffer */
 
-	buffer[bufpos++] = c;
+	text_buffer[bufpos++] = c;
 
 	if (bufpos == TEXT_BUFFER_SIZE)
 	    runtime_error (ERR_TEXT_BUF_OVF);
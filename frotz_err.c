@@ -25,8 +25,7 @@
    player prefs are specified, or replace report_zstrict_error() 
    completely if you want to change the way errors are reported. */
 
-int err_report_mode = ERR_DEFAULT_REPORT_MODE;
-static int error_count[ERR_NUM_ERRORS];
+#define error_count (zctx->error_count)
 
 static char *err_messages[] = {
     "Text buffer overflow",
@@ -24,6 +24,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#define ZCONTEXT_STACK_ALIASES
 #include "frotz.h"
 
 #ifdef MSDOS_16BIT
@@ -49,6 +50,37 @@
 
 #endif
 
+/* Where we can, the story file is mapped rather than read */
+
+#if !defined(MSDOS_16BIT) && !defined(WIN32)
+#define MAP_STORY
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/* and undo states that drop out of memory can go to a mapped file */
+
+#ifdef MAP_STORY
+#define UNDO_JOURNAL
+#include <fcntl.h>
+#endif
+
+/* Checkpoints go in a directory for each story */
+
+#ifndef MSDOS_16BIT
+#define AUTOSAVE
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#define make_dir(d) mkdir (d)
+#else
+#define make_dir(d) mkdir (d, 0777)
+#endif
+#endif
+
 extern void seed_random (int);
 extern void restart_screen (void);
 extern void refresh_text_style (void);
@@ -57,52 +89,137 @@ extern void split_window (zword);
 extern void script_open (void);
 extern void script_close (void);
 
-extern FILE *os_path_open (const char *, const char *, long *);
-
-extern zword save_quetzal (FILE *, FILE *, long);
-extern zword restore_quetzal (FILE *, FILE *, long);
+extern zword save_quetzal (FILE *);
+extern zword save_checkpoint (FILE *, const char *, const char *,
+			      const char *);
+extern zword restore_quetzal (FILE *);
 
 extern void erase_window (zword);
+extern void init_alphabet (void);
 
-extern void (*op0_opcodes[]) (void);
-extern void (*op1_opcodes[]) (void);
-extern void (*op2_opcodes[]) (void);
-extern void (*var_opcodes[]) (void);
+extern long mem_diff (zbyte *, zbyte *, zword, zbyte *, const zbyte *);
+extern void mem_undiff (zbyte *, long, zbyte *);
 
-char save_name[MAX_FILE_NAME + 1] = DEFAULT_SAVE_NAME;
-char auxilary_name[MAX_FILE_NAME + 1] = DEFAULT_AUXILARY_NAME;
+extern void (*op2_opcodes[]) (void);
 
-zbyte far *zmp = NULL;
-zbyte far *pcp = NULL;
+#define story_fp (zctx->story_fp)
 
-static FILE *story_fp = NULL;
+#define first_restart (zctx->first_restart)
+#define init_fp_pos (zctx->init_fp_pos)
+#define story_map (zctx->story_map)
+#define story_map_size (zctx->story_map_size)
+#define story_dynamic (zctx->story_dynamic)
+#define story_checksum (zctx->story_checksum)
+#define story_checksum_known (zctx->story_checksum_known)
 
-static bool first_restart = TRUE;
-static long init_fp_pos = 0;
+#define autosave_dir (zctx->autosave_dir)
+#define autosave_turns (zctx->autosave_turns)
+#define autosave_time (zctx->autosave_time)
+#define checkpoint_read (zctx->checkpoint_read)
+#define checkpoint_args (zctx->checkpoint_args)
 
 /*
  * Data for the undo mechanism.
  * This undo mechanism is based on the scheme used in Evin Robertson's
  * Nitfol interpreter.
  * Undo blocks are stored as differences between states.
+ * The blocks live one after another in a ring of option_undo_bytes,
+ * and the oldest are dropped to make room for new ones. Given
+ * option_undo_journal, the dropped blocks are appended to a journal
+ * file there instead, each followed by its size, and are read back
+ * from the end once the ring has been used up.
  */
 
 typedef struct undo_struct undo_t;
 struct undo_struct {
     undo_t *next;
     undo_t *prev;
+    long size;
     long pc;
     long diff_size;
-    zword frame_count;
+    zword frames;
     zword stack_size;
     zword frame_offset;
     /* undo diff and stack data follow */
 };
 
-static undo_t *first_undo = NULL, *last_undo = NULL, *curr_undo = NULL;
-static zbyte *undo_mem = NULL, *prev_zmp, *undo_diff;
+#define first_undo (zctx->first_undo)
+#define last_undo (zctx->last_undo)
+#define curr_undo (zctx->curr_undo)
+#define undo_mem (zctx->undo_mem)
+#define prev_zmp (zctx->prev_zmp)
+#define undo_diff (zctx->undo_diff)
+
+#define undo_count (zctx->undo_count)
+#define undo_arena (zctx->undo_arena)
+#define undo_arena_size (zctx->undo_arena_size)
+#define undo_used (zctx->undo_used)
+#define undo_peak (zctx->undo_peak)
+
+#define journal_fd (zctx->journal_fd)
+#define journal_map (zctx->journal_map)
+#define journal_map_size (zctx->journal_map_size)
+#define journal_used (zctx->journal_used)
+#define journal_peak (zctx->journal_peak)
+#define journal_spills (zctx->journal_spills)
+#define journal_reloads (zctx->journal_reloads)
+
+/*
+ * Data for the timeline.
+ * Each line of input read starts a turn, for which the difference
+ * from the last turn's dynamic memory is kept, with a full copy of
+ * it -- a keyframe -- every option_timeline_interval turns. Any turn
+ * can then be rebuilt from the nearest keyframe before it, or from
+ * the last turn, whichever is fewer turns away. When the timeline
+ * would outgrow option_timeline_bytes, the oldest turns up to the
+ * next keyframe are dropped.
+ */
+
+typedef struct turn_struct turn_t;
+struct turn_struct {
+    long pc;
+    long data;			/* offset of the delta in the timeline */
+    long diff_size;
+    bool keyframe;		/* if so, it follows the delta */
+    zword frames;
+    zword stack_size;		/* the stack follows that */
+    zword frame_offset;
+    zword text;			/* the arguments of the read */
+    zword parse;
+    long scrollback;		/* where its input ends in the scrollback */
+};
+
+#define turns (zctx->turns)
+#define turn_count (zctx->turn_count)
+#define turn_alloc (zctx->turn_alloc)
+#define turns_dropped (zctx->turns_dropped)
+#define timeline_start (zctx->timeline_start)
+#define timeline (zctx->timeline)
+#define timeline_size (zctx->timeline_size)
+#define timeline_alloc (zctx->timeline_alloc)
+#define timeline_prev (zctx->timeline_prev)
+#define timeline_rewound (zctx->timeline_rewound)
+
+#define UNDO_ALIGN(n) (((n) + 7) & ~7L)
+#define JOURNAL_CHUNK 0x100000L
+#define JOURNAL_TRAILER UNDO_ALIGN (sizeof (long))
+
+/*
+ * mark_all_dirty
+ *
+ * Note that all of dynamic memory may have changed, after it has been
+ * written by anything other than SET_BYTE and SET_WORD. Property lists
+ * and the abbreviation table may have changed with it.
+ *
+ */
+
+static void mark_all_dirty (void)
+{
+
+    memset (dirty_map, 0xff, sizeof (dirty_map));
+    drop_props ();
 
-static int undo_count = 0;
+}/* mark_all_dirty */
 
 /*
  * get_header_extension
@@ -141,6 +258,12 @@ void set_header_extension (int entry, zword val)
 	return;
 
     addr = h_extension_table + 2 * entry;
+
+    /* Static memory may be read-only */
+
+    if (addr + 1 >= h_dynamic_size)
+	return;
+
     SET_WORD (addr, val)
 
 }/* set_header_extension */
@@ -210,6 +333,57 @@ void restart_header (void)
 
 }/* restart_header */
 
+#ifdef MAP_STORY
+
+/*
+ * map_story
+ *
+ * Map the story file into memory instead of reading it, if
+ * option_map_story asks for it. The mapping is private, so any page
+ * the game writes to gets its own copy, and the rest shares the page
+ * cache with anything else using the same story. Static and high
+ * memory are only read from disk when they are touched. That makes it
+ * an option: if the file is rewritten while the story runs --
+ * recompiled, say -- a page not yet touched shows the new file, or
+ * raises SIGBUS if it is now past the end. Returns FALSE if the story
+ * can't be mapped -- if the file is shorter than the header says, for
+ * example -- in which case it must be read as usual.
+ *
+ */
+
+static bool map_story (void)
+{
+    struct stat st;
+    long page;
+    long offset;
+    zbyte *map;
+
+    if (fstat (fileno (story_fp), &st) != 0
+	|| st.st_size < init_fp_pos + story_size)
+	return FALSE;
+
+    /* Mappings must start on a page boundary */
+
+    page = sysconf (_SC_PAGESIZE);
+    offset = init_fp_pos % page;
+
+    map = (zbyte *) mmap (NULL, offset + story_size, PROT_READ | PROT_WRITE,
+	MAP_PRIVATE, fileno (story_fp), init_fp_pos - offset);
+    if (map == (zbyte *) MAP_FAILED)
+	return FALSE;
+
+    story_map = map;
+    story_map_size = offset + story_size;
+
+    free (zmp);
+    zmp = map + offset;
+
+    return TRUE;
+
+}/* map_story */
+
+#endif
+
 /*
  * init_memory
  *
@@ -225,7 +399,7 @@ void init_memory (void)
     int i, j;
 
     static struct {
-	enum story story_id;
+	enum story story;
 	zword release;
 	zbyte serial[6];
     } records[] = {
@@ -323,7 +497,7 @@ void init_memory (void)
 
     story_id = UNKNOWN;
 
-    for (i = 0; records[i].story_id != UNKNOWN; i++) {
+    for (i = 0; records[i].story != UNKNOWN; i++) {
 
 	if (h_release == records[i].release) {
 
@@ -331,7 +505,7 @@ void init_memory (void)
 		if (h_serial[j] != records[i].serial[j])
 		    goto no_match;
 
-	    story_id = records[i].story_id;
+	    story_id = records[i].story;
 
 	}
 
@@ -392,6 +566,27 @@ void init_memory (void)
 	op1_opcodes[0x0f] = z_call_n;
     }
 
+    /* Packed addresses are scaled by 2, 4 or 8 depending on the version,
+       with V6 and V7 adding the routine and string offsets */
+
+    routine_offset = 0;
+    string_offset = 0;
+
+    if (h_version <= V3)
+	packed_shift = 1;
+    else if (h_version <= V5)
+	packed_shift = 2;
+    else if (h_version <= V7) {
+	packed_shift = 2;
+	routine_offset = (long) h_functions_offset << 3;
+	string_offset = (long) h_strings_offset << 3;
+    } else /* (h_version == V8) */
+	packed_shift = 3;
+
+#ifdef MAP_STORY
+    if (!option_map_story || !map_story ()) {
+#endif
+
     /* Allocate memory for story data */
 
     if ((zmp = (zbyte far *) realloc (zmp, story_size)) == NULL)
@@ -413,6 +608,19 @@ void init_memory (void)
 
     }
 
+#ifdef MAP_STORY
+    }
+#endif
+
+    /* Keep dynamic memory as loaded, for restarting, saving and
+       restoring without going back to the file */
+
+    if ((story_dynamic = (zbyte far *) malloc (h_dynamic_size)) == NULL)
+	os_fatal ("Out of memory");
+
+    memcpy (story_dynamic, zmp, h_dynamic_size);
+    story_checksum_known = FALSE;
+
     first_restart = TRUE;
 
     /* Read header extension table */
@@ -421,6 +629,8 @@ void init_memory (void)
     hx_unicode_table = get_header_extension (HX_UNICODE_TABLE);
     hx_flags = get_header_extension (HX_FLAGS);
 
+    init_alphabet ();
+
 }/* init_memory */
 
 /*
@@ -446,12 +656,21 @@ void init_undo (void)
     /* Allocate h_dynamic_size bytes for previous dynamic zmp state
        + 1.5 h_dynamic_size for Quetzal diff + 2. */
     undo_mem = malloc ((h_dynamic_size * 5) / 2 + 2);
-    if (undo_mem != NULL) {
+    if (option_undo_bytes > 0)
+	undo_arena = malloc (option_undo_bytes);
+    if (undo_mem != NULL && undo_arena != NULL) {
 	prev_zmp = undo_mem;
 	undo_diff = undo_mem + h_dynamic_size;
 	memcpy (prev_zmp, zmp, h_dynamic_size);
-    } else
+	memset (dirty_map, 0, sizeof (dirty_map));
+	undo_arena_size = option_undo_bytes;
+    } else {
+	free (undo_mem);
+	free (undo_arena);
+	undo_mem = NULL;
+	undo_arena = NULL;
 	option_undo_slots = 0;
+    }
 
     if (reserve_mem != 0)
 	free (reserved);
@@ -476,7 +695,7 @@ static void free_undo (int count)
 	if (curr_undo == first_undo)
 	    curr_undo = curr_undo->next;
 	first_undo = first_undo->next;
-	free (p);
+	undo_used -= p->size;
 	undo_count--;
     }
     if (first_undo)
@@ -485,6 +704,232 @@ static void free_undo (int count)
 	last_undo = NULL;
 }/* free_undo */
 
+#ifdef UNDO_JOURNAL
+
+/*
+ * close_journal
+ *
+ * Let go of the undo journal, and whatever is in it.
+ *
+ */
+
+static void close_journal (void)
+{
+
+    if (journal_map) {
+	munmap (journal_map, journal_map_size);
+	close (journal_fd);
+    }
+    journal_map = NULL;
+    journal_map_size = 0;
+    journal_used = 0;
+
+}/* close_journal */
+
+/*
+ * grow_journal
+ *
+ * Make the journal at least size bytes long, creating it if need be.
+ * The file is unlinked at once, so that it goes when we do.
+ *
+ */
+
+static bool grow_journal (long size)
+{
+    char name[MAX_FILE_NAME + 1];
+    long new_size;
+    zbyte *map;
+
+    new_size = journal_map_size ? journal_map_size : JOURNAL_CHUNK;
+    while (new_size < size)
+	new_size *= 2;
+
+    if (journal_map == NULL) {
+	if (strlen (option_undo_journal) + 14 > MAX_FILE_NAME)
+	    return FALSE;
+	sprintf (name, "%s/undo-XXXXXX", option_undo_journal);
+	if ((journal_fd = mkstemp (name)) < 0)
+	    return FALSE;
+	unlink (name);
+    } else
+	munmap (journal_map, journal_map_size);
+
+    map = MAP_FAILED;
+    if (ftruncate (journal_fd, new_size) == 0)
+	map = mmap (NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    journal_fd, 0);
+    if (map == MAP_FAILED) {
+	close (journal_fd);
+	journal_map = NULL;
+	journal_map_size = 0;
+	return FALSE;
+    }
+    journal_map = map;
+    journal_map_size = new_size;
+    return TRUE;
+
+}/* grow_journal */
+
+/*
+ * spill_undo
+ *
+ * Append an undo block to the journal. If that can't be done, the
+ * blocks already there are no use either.
+ *
+ */
+
+static void spill_undo (undo_t *p)
+{
+    long size = journal_used + p->size + JOURNAL_TRAILER;
+
+    if (size > journal_map_size && !grow_journal (size)) {
+	close_journal ();
+	return;
+    }
+    memcpy (journal_map + journal_used, p, p->size);
+    memcpy (journal_map + journal_used + p->size, &p->size, sizeof (long));
+    journal_used = size;
+    if (journal_used > journal_peak)
+	journal_peak = journal_used;
+    journal_spills++;
+
+}/* spill_undo */
+
+/*
+ * journal_top
+ *
+ * Return the newest block in the journal, or NULL if it is empty.
+ *
+ */
+
+static undo_t *journal_top (void)
+{
+    long size;
+
+    if (journal_used == 0)
+	return NULL;
+    memcpy (&size, journal_map + journal_used - JOURNAL_TRAILER,
+	    sizeof (long));
+    return (undo_t *) (journal_map + journal_used - JOURNAL_TRAILER - size);
+
+}/* journal_top */
+
+#endif
+
+/*
+ * drop_undo
+ *
+ * Drop the oldest undo block to make room for a new one, keeping it
+ * in the journal if there is one.
+ *
+ */
+
+static void drop_undo (void)
+{
+
+#ifdef UNDO_JOURNAL
+    if (option_undo_journal)
+	spill_undo (first_undo);
+#endif
+    free_undo (1);
+
+}/* drop_undo */
+
+/*
+ * alloc_undo
+ *
+ * Find room in the ring for an undo block of size bytes, following
+ * the last block, dropping the oldest blocks that are in the way.
+ * Return NULL if the block could never fit.
+ *
+ */
+
+static undo_t *alloc_undo (long size)
+{
+    long pos;
+
+    if (size > undo_arena_size)
+	return NULL;
+
+    pos = 0;
+    if (last_undo)
+	pos = (zbyte *) last_undo - undo_arena + last_undo->size;
+
+    if (pos + size > undo_arena_size) {
+
+	/* Go back to the start, past the blocks from here to the end */
+
+	while (undo_count && (zbyte *) first_undo - undo_arena >= pos)
+	    drop_undo ();
+	pos = 0;
+    }
+
+    while (undo_count
+	   && (zbyte *) first_undo - undo_arena < pos + size
+	   && (zbyte *) first_undo - undo_arena + first_undo->size > pos)
+	drop_undo ();
+
+    return (undo_t *) (undo_arena + pos);
+
+}/* alloc_undo */
+
+/*
+ * undo_memory
+ *
+ * Tell the front end how many bytes of the undo ring are in use,
+ * and the most that have been since the story started.
+ *
+ */
+
+void undo_memory (long *used, long *peak)
+{
+
+    *used = undo_used;
+    *peak = undo_peak;
+
+}/* undo_memory */
+
+/*
+ * undo_journal
+ *
+ * Tell the front end how many bytes of the undo journal are in use,
+ * the most that have been, how many blocks have been written to it
+ * and how many read back.
+ *
+ */
+
+void undo_journal (long *used, long *peak, long *spills, long *reloads)
+{
+
+    *used = journal_used;
+    *peak = journal_peak;
+    *spills = journal_spills;
+    *reloads = journal_reloads;
+
+}/* undo_journal */
+
+/*
+ * free_timeline
+ *
+ * Forget all the turns.
+ *
+ */
+
+static void free_timeline (void)
+{
+
+    free (turns);
+    free (timeline);
+    free (timeline_prev);
+    turns = NULL;
+    timeline = NULL;
+    timeline_prev = NULL;
+    turn_count = turn_alloc = turns_dropped = 0;
+    timeline_start = 0;
+    timeline_size = timeline_alloc = 0;
+
+}/* free_timeline */
+
 /*
  * reset_memory
  *
@@ -495,6 +940,9 @@ static void free_undo (int count)
 void reset_memory (void)
 {
 
+    if (finish_save (TRUE) == 0)
+	print_string ("Error writing save file\n");
+
     if (story_fp)
 	fclose (story_fp);
     story_fp = NULL;
@@ -502,10 +950,30 @@ void reset_memory (void)
     if (undo_mem) {
 	free_undo (undo_count);
 	free (undo_mem);
+	free (undo_arena);
     }
     undo_mem = NULL;
+    undo_arena = NULL;
     undo_count = 0;
 
+#ifdef UNDO_JOURNAL
+    close_journal ();
+#endif
+
+    free_timeline ();
+
+    if (story_dynamic)
+	free (story_dynamic);
+    story_dynamic = NULL;
+
+#ifdef MAP_STORY
+    if (story_map) {
+	munmap (story_map, story_map_size);
+	story_map = NULL;
+	zmp = NULL;
+    }
+#endif
+
     if (zmp)
 	free (zmp);
     zmp = NULL;
@@ -579,10 +1047,9 @@ void z_restart (void)
 
     if (!first_restart) {
 
-	fseek (story_fp, init_fp_pos, SEEK_SET);
+	memcpy (zmp, story_dynamic, h_dynamic_size);
 
-	if (fread (zmp, 1, h_dynamic_size, story_fp) != h_dynamic_size)
-	    os_fatal ("Story file read error");
+	mark_all_dirty ();
 
     } else first_restart = FALSE;
 
@@ -645,6 +1112,28 @@ static void get_default_name (char *default_name, zword addr)
 
 }/* get_default_name */
 
+/*
+ * resume_read
+ *
+ * Carry on from a checkpoint just restored: it was taken in the middle
+ * of z_read, which is started again with the same arguments.
+ *
+ */
+
+static void resume_read (void)
+{
+    int i;
+
+    checkpoint_read = FALSE;
+
+    zargc = checkpoint_args[0];
+    for (i = 0; i < 4; i++)
+	zargs[i] = checkpoint_args[i + 1];
+
+    z_read ();
+
+}/* resume_read */
+
 /*
  * z_restore, restore [a part of] a Z-machine state from disk
  *
@@ -683,9 +1172,12 @@ void z_restore (void)
 	if ((gfp = fopen (new_name, "rb")) == NULL)
 	    goto finished;
 
-	/* Load auxilary file */
+	/* Load auxilary file, which must fit in dynamic memory */
 
-	success = fread (zmp + zargs[0], 1, zargs[1], gfp);
+	if ((long) zargs[0] + zargs[1] <= h_dynamic_size) {
+	    success = fread (zmp + zargs[0], 1, zargs[1], gfp);
+	    mark_all_dirty ();
+	}
 
 	/* Close auxilary file */
 
@@ -705,6 +1197,11 @@ void z_restore (void)
 
 	strcpy (save_name, new_name);
 
+	/* A save may still be on its way to this file */
+
+	if (finish_save (TRUE) == 0)
+	    print_string ("Error writing save file\n");
+
 	/* Open game file */
 
 	if ((gfp = fopen (new_name, "rb")) == NULL)
@@ -722,7 +1219,7 @@ void z_restore (void)
 		strcpy (ext, ".sav");
 	    }
 
-	    success = restore_quetzal (gfp, story_fp, bad ? 0 : init_fp_pos);
+	    success = restore_quetzal (gfp);
 
 	} else {
 	    /* Load game file */
@@ -753,19 +1250,19 @@ void z_restore (void)
 		    stack[i] |= fgetc (gfp);
 		}
 
-		fseek (story_fp, init_fp_pos, SEEK_SET);
-
 		for (addr = 0; addr < h_dynamic_size; addr++) {
 		    int skip = fgetc (gfp);
-		    for (i = 0; i < skip; i++)
-			zmp[addr++] = fgetc (story_fp);
-		    zmp[addr] = fgetc (gfp);
-		    (void) fgetc (story_fp);
+		    if (skip > h_dynamic_size - addr)
+			skip = h_dynamic_size - addr;
+		    memcpy (zmp + addr, story_dynamic + addr, skip);
+		    addr += skip;
+		    if (addr < h_dynamic_size)
+			zmp[addr] = fgetc (gfp);
 		}
 
 		/* Check for errors */
 
-		if (ferror (gfp) || ferror (story_fp) || addr != h_dynamic_size)
+		if (ferror (gfp) || addr != h_dynamic_size)
 		    success = -1;
 		else
 
@@ -776,6 +1273,10 @@ void z_restore (void)
 	    } else print_string ("Invalid save file\n");
 	}
 
+	/* Memory may have been written, even if the restore failed */
+
+	mark_all_dirty ();
+
 	if ((short) success >= 0) {
 
 	    /* Close game file */
@@ -805,6 +1306,13 @@ void z_restore (void)
 		    && (h_screen_rows != old_screen_rows
 		    || h_screen_cols != old_screen_cols))
 		    erase_window (1);
+
+		/* A checkpoint carries on with the line it was reading */
+
+		if (checkpoint_read) {
+		    resume_read ();
+		    return;
+		}
 	    }
 	} else
 	    os_fatal ("Error reading save file");
@@ -819,87 +1327,6 @@ finished:
 
 }/* z_restore */
 
-/*
- * mem_diff
- *
- * Set diff to a Quetzal-like difference between a and b,
- * copying a to b as we go.  It is assumed that diff points to a
- * buffer which is large enough to hold the diff.
- * mem_size is the number of bytes to compare.
- * Returns the number of bytes copied to diff.
- *
- */
-
-static long mem_diff (zbyte *a, zbyte *b, zword mem_size, zbyte *diff)
-{
-    unsigned size = mem_size;
-    zbyte *p = diff;
-    unsigned j;
-    zbyte c;
-
-    for (;;) {
-	for (j = 0; size > 0 && (c = *a++ ^ *b++) == 0; j++)
-	    size--;
-	if (size == 0) break;
-	size--;
-	if (j > 0x8000) {
-	    *p++ = 0;
-	    *p++ = 0xff;
-	    *p++ = 0xff;
-	    j -= 0x8000;
-	}
-	if (j > 0) {
-	    *p++ = 0;
-	    j--;
-	    if (j <= 0x7f) {
-		*p++ = j;
-	    } else {
-		*p++ = (j & 0x7f) | 0x80;
-		*p++ = (j & 0x7f80) >> 7;
-	    }
-	}
-	*p++ = c;
-	*(b - 1) ^= c;
-    }
-    return p - diff;
-}/* mem_diff */
-
-/*
- * mem_undiff
- *
- * Applies a quetzal-like diff to dest
- *
- */
-
-static void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
-{
-    zbyte c;
-
-    while (diff_length) {
-	c = *diff++;
-	diff_length--;
-	if (c == 0) {
-	    unsigned runlen;
-
-	    if (!diff_length)
-		return;  /* Incomplete run */
-	    runlen = *diff++;
-	    diff_length--;
-	    if (runlen & 0x80) {
-		if (!diff_length)
-		    return; /* Incomplete extended run */
-		c = *diff++;
-		diff_length--;
-		runlen = (runlen & 0x7f) | (((unsigned) c) << 7);
-	    }
-
-	    dest += runlen + 1;
-	} else {
-	    *dest++ ^= c;
-	}
-    }
-}/* mem_undiff */
-
 /*
  * restore_undo
  *
@@ -909,27 +1336,41 @@ static void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
 
 int restore_undo (void)
 {
+    undo_t *p = curr_undo;
 
     if (option_undo_slots == 0)	/* undo feature unavailable */
 
 	return -1;
 
-    if (curr_undo == NULL)	/* no saved game state */
+#ifdef UNDO_JOURNAL
+    if (p == NULL)		/* the ring is used up, try the journal */
+	p = journal_top ();
+#endif
+
+    if (p == NULL)		/* no saved game state */
 
 	return 0;
 
     /* undo possible */
 
     memcpy (zmp, prev_zmp, h_dynamic_size);
-    SET_PC (curr_undo->pc)
-    sp = stack + STACK_SIZE - curr_undo->stack_size;
-    fp = stack + curr_undo->frame_offset;
-    frame_count = curr_undo->frame_count;
-    mem_undiff ((zbyte *) (curr_undo + 1), curr_undo->diff_size, prev_zmp);
-    memcpy (sp, (zbyte *)(curr_undo + 1) + curr_undo->diff_size,
-	    curr_undo->stack_size * sizeof (*sp));
-
-    curr_undo = curr_undo->prev;
+    mark_all_dirty ();
+    SET_PC (p->pc)
+    sp = stack + STACK_SIZE - p->stack_size;
+    fp = stack + p->frame_offset;
+    frame_count = p->frames;
+    mem_undiff ((zbyte *) (p + 1), p->diff_size, prev_zmp);
+    memcpy (sp, (zbyte *)(p + 1) + p->diff_size,
+	    p->stack_size * sizeof (*sp));
+
+    if (curr_undo)
+	curr_undo = curr_undo->prev;
+#ifdef UNDO_JOURNAL
+    else {
+	journal_used -= p->size + JOURNAL_TRAILER;
+	journal_reloads++;
+    }
+#endif
 
     restart_header ();
 
@@ -1019,7 +1460,10 @@ void z_save (void)
 
 	if (option_save_quetzal) {
 
-	    success = save_quetzal (gfp, story_fp, init_fp_pos);
+	    /* The file is written, and closed, in the background */
+
+	    success = save_quetzal (gfp);
+	    goto finished;
 
 	} else {
 	    /* Write game file */
@@ -1048,10 +1492,8 @@ void z_save (void)
 		fputc ((int) lo (stack[i]), gfp);
 	    }
 
-	    fseek (story_fp, init_fp_pos, SEEK_SET);
-
 	    for (addr = 0, skip = 0; addr < h_dynamic_size; addr++)
-		if (zmp[addr] != fgetc (story_fp) || skip == 255 || addr + 1 == h_dynamic_size) {
+		if (zmp[addr] != story_dynamic[addr] || skip == 255 || addr + 1 == h_dynamic_size) {
 		    fputc (skip, gfp);
 		    fputc (zmp[addr], gfp);
 		    skip = 0;
@@ -1060,7 +1502,7 @@ void z_save (void)
 
 	/* Close game file and check for errors */
 
-	if (fclose (gfp) == EOF || ferror (story_fp)) {
+	if (fclose (gfp) == EOF) {
 	    print_string ("Error writing save file\n");
 	    goto finished;
 	}
@@ -1080,6 +1522,295 @@ finished:
 
 }/* z_save */
 
+#ifdef AUTOSAVE
+
+/*
+ * checkpoint_dir
+ *
+ * Find the directory under `dir' for checkpoints of the story with this
+ * header. There is one for each release, serial number and checksum.
+ *
+ */
+
+static void checkpoint_dir (char *path, const char *dir, const zbyte *header)
+{
+    char serial[7];
+    int i;
+
+    for (i = 0; i < 6; i++) {
+	int c = header[H_SERIAL + i];
+	serial[i] = (c >= '0' && c <= '9') ? c : '_';
+    }
+    serial[6] = 0;
+
+    sprintf (path, "%.*s/%u-%s-%04x", MAX_FILE_NAME - 64, dir,
+	(header[H_RELEASE] << 8) | header[H_RELEASE + 1], serial,
+	(header[H_CHECKSUM] << 8) | header[H_CHECKSUM + 1]);
+
+}/* checkpoint_dir */
+
+/*
+ * checkpoint_name
+ *
+ * Put the name of checkpoint number `seq' in `path' into `name'. The
+ * type is "qzl", or "tmp" while it is being written.
+ *
+ */
+
+static void checkpoint_name (char *name, const char *path, long seq,
+			     const char *type)
+{
+
+    sprintf (name, "%.*s/checkpoint-%ld.%.3s", MAX_FILE_NAME - 40, path,
+	seq, type);
+
+}/* checkpoint_name */
+
+/*
+ * last_checkpoint
+ *
+ * Return the number of the latest checkpoint in `path', or -1 if there
+ * are none.
+ *
+ */
+
+static long last_checkpoint (const char *path)
+{
+    DIR *d;
+    struct dirent *e;
+    long seq, last = -1;
+    int n;
+
+    if ((d = opendir (path)) == NULL)
+	return -1;
+
+    while ((e = readdir (d)) != NULL) {
+	n = 0;
+	if (sscanf (e->d_name, "checkpoint-%ld.qzl%n", &seq, &n) == 1
+	    && n > 0 && e->d_name[n] == 0 && seq > last)
+	    last = seq;
+    }
+
+    closedir (d);
+    return last;
+
+}/* last_checkpoint */
+
+#endif
+
+/*
+ * autosave_find
+ *
+ * Put the name of the latest checkpoint of a story, kept under `dir',
+ * into `name'. Return FALSE if there isn't one. This doesn't need a
+ * Z-machine, so a front end can ask before starting the story.
+ *
+ */
+
+bool autosave_find (const char *dir, const char *story_file, char *name)
+{
+#ifdef AUTOSAVE
+    char path[MAX_FILE_NAME + 1];
+    zbyte header[64];
+    FILE *f;
+    long seq;
+
+    if ((f = fopen (story_file, "rb")) == NULL)
+	return FALSE;
+    seq = fread (header, sizeof (header), 1, f);
+    fclose (f);
+    if (seq != 1)
+	return FALSE;
+
+    checkpoint_dir (path, dir, header);
+    if ((seq = last_checkpoint (path)) < 0)
+	return FALSE;
+
+    checkpoint_name (name, path, seq, "qzl");
+    return TRUE;
+#else
+    return FALSE;
+#endif
+
+}/* autosave_find */
+
+/*
+ * init_autosave
+ *
+ * Make the directory for this story's checkpoints, given
+ * option_autosave. They are numbered on from the last one there.
+ *
+ */
+
+void init_autosave (void)
+{
+#ifdef AUTOSAVE
+    autosave_dir[0] = 0;
+
+    if (option_autosave == NULL)
+	return;
+
+    checkpoint_dir (autosave_dir, option_autosave, zmp);
+    (void) make_dir (option_autosave);
+    (void) make_dir (autosave_dir);
+
+    autosave_turns = 0;
+    autosave_time = (long) time (NULL);
+#endif
+
+}/* init_autosave */
+
+/*
+ * autosave_turn
+ *
+ * Called by z_read at the start of each turn, as a line has been read:
+ * save a checkpoint if option_autosave_turns turns or
+ * option_autosave_seconds seconds have gone by since the last one.
+ * Only option_autosave_files are kept. A checkpoint is written in the
+ * background, so all this costs the turn is a copy of dynamic memory.
+ *
+ */
+
+void autosave_turn (void)
+{
+#ifdef AUTOSAVE
+    char name[MAX_FILE_NAME + 1];
+    char temp_name[MAX_FILE_NAME + 1];
+    char old_name[MAX_FILE_NAME + 1];
+    long now, seq;
+    FILE *gfp;
+    int result;
+
+    if (autosave_dir[0] == 0)
+	return;
+
+    now = (long) time (NULL);
+    autosave_turns++;
+
+    if ((option_autosave_turns <= 0 || autosave_turns < option_autosave_turns)
+	&& (option_autosave_seconds <= 0
+	    || now - autosave_time < option_autosave_seconds))
+	return;
+
+    /* The last one must be in place, or have failed, before this one
+       is numbered; if it's still being written, try again next turn */
+
+    if ((result = finish_save (FALSE)) < 0)
+	return;
+    if (result == 0)
+	print_string ("Error writing save file\n");
+
+    autosave_turns = 0;
+    autosave_time = now;
+
+    seq = last_checkpoint (autosave_dir) + 1;
+    checkpoint_name (name, autosave_dir, seq, "qzl");
+    checkpoint_name (temp_name, autosave_dir, seq, "tmp");
+
+    /* The oldest one kept goes once this one has been renamed into
+       place, so a failed write never leaves fewer */
+
+    old_name[0] = 0;
+    if (seq >= option_autosave_files)
+	checkpoint_name (old_name, autosave_dir,
+	    seq - option_autosave_files, "qzl");
+
+    if ((gfp = fopen (temp_name, "wb")) == NULL)
+	return;
+
+    (void) save_checkpoint (gfp, temp_name, name, old_name);
+#endif
+
+}/* autosave_turn */
+
+/*
+ * clear_autosave
+ *
+ * Called when the story quits: remove its checkpoints, and their
+ * directory, so that opening it again starts afresh. Checkpoints only
+ * survive a session that ended some other way.
+ *
+ */
+
+void clear_autosave (void)
+{
+#ifdef AUTOSAVE
+    DIR *d;
+    struct dirent *e;
+    char name[MAX_FILE_NAME + 1];
+    char type[4];
+    long seq;
+    int n;
+
+    if (autosave_dir[0] == 0)
+	return;
+
+    /* A checkpoint still being written would turn up afterwards */
+
+    if (finish_save (TRUE) == 0)
+	print_string ("Error writing save file\n");
+
+    if ((d = opendir (autosave_dir)) == NULL)
+	return;
+
+    while ((e = readdir (d)) != NULL) {
+	n = 0;
+	if (sscanf (e->d_name, "checkpoint-%ld.%3[a-z]%n", &seq, type, &n) == 2
+	    && n > 0 && e->d_name[n] == 0
+	    && (strcmp (type, "qzl") == 0 || strcmp (type, "tmp") == 0)) {
+	    checkpoint_name (name, autosave_dir, seq, type);
+	    (void) remove (name);
+	}
+    }
+
+    closedir (d);
+    (void) rmdir (autosave_dir);
+#endif
+
+}/* clear_autosave */
+
+/*
+ * restore_checkpoint
+ *
+ * Start the story from a checkpoint, or any other saved game, rather
+ * than from the beginning. If it can't be restored without harm, the
+ * story starts from the beginning after all.
+ *
+ */
+
+void restore_checkpoint (const char *name)
+{
+    FILE *gfp;
+    zword success;
+
+    if ((gfp = fopen (name, "rb")) == NULL)
+	return;
+
+    success = restore_quetzal (gfp);
+
+    mark_all_dirty ();
+
+    if ((short) success < 0)
+	os_fatal ("Error reading save file");
+
+    fclose (gfp);
+
+    if (success == 0)
+	return;
+
+    restart_header ();
+
+    /* A saved game takes up after its save instruction */
+
+    if (checkpoint_read)
+	resume_read ();
+    else if (h_version <= V3)
+	branch (TRUE);
+    else
+	store (success);
+
+}/* restore_checkpoint */
+
 /*
  * save_undo
  *
@@ -1091,6 +1822,7 @@ int save_undo (void)
 {
     long diff_size;
     zword stack_size;
+    long size;
     undo_t *p;
 
     if (option_undo_slots == 0)		/* undo feature unavailable */
@@ -1102,7 +1834,7 @@ int save_undo (void)
     while (last_undo != curr_undo) {
 	p = last_undo;
 	last_undo = last_undo->prev;
-	free (p);
+	undo_used -= p->size;
 	undo_count--;
     }
     if (last_undo)
@@ -1111,19 +1843,23 @@ int save_undo (void)
 	first_undo = NULL;
 
     if (undo_count == option_undo_slots)
-	free_undo (1);
+	drop_undo ();
 
-    diff_size = mem_diff (zmp, prev_zmp, h_dynamic_size, undo_diff);
+    diff_size = mem_diff (zmp, prev_zmp, h_dynamic_size, undo_diff, dirty_map);
+    memset (dirty_map, 0, sizeof (dirty_map));
     stack_size = stack + STACK_SIZE - sp;
-    do {
-	p = malloc (sizeof (undo_t) + diff_size + stack_size * sizeof (*sp));
-	if (p == NULL)
-	    free_undo (1);
-    } while (!p && undo_count);
-    if (p == NULL)
+    size = UNDO_ALIGN (sizeof (undo_t) + diff_size
+		       + stack_size * sizeof (*sp));
+    if ((p = alloc_undo (size)) == NULL) {
+	free_undo (undo_count);
+#ifdef UNDO_JOURNAL
+	close_journal ();
+#endif
 	return -1;
+    }
+    p->size = size;
     GET_PC (p->pc)
-    p->frame_count = frame_count;
+    p->frames = frame_count;
     p->diff_size = diff_size;
     p->stack_size = stack_size;
     p->frame_offset = fp - stack;
@@ -1140,6 +1876,9 @@ int save_undo (void)
     p->next = NULL;
     curr_undo = last_undo = p;
     undo_count++;
+    undo_used += size;
+    if (undo_used > undo_peak)
+	undo_peak = undo_used;
     return 1;
 
 }/* save_undo */
@@ -1158,6 +1897,289 @@ void z_save_undo (void)
 
 }/* z_save_undo */
 
+/*
+ * drop_turns
+ *
+ * Drop the oldest turns, as far as the next keyframe, so that the
+ * timeline has room for one more turn of up to size bytes within
+ * option_timeline_bytes. If there is only one keyframe, all the
+ * turns go, and the next is a keyframe. Returns false if even an
+ * empty timeline has no room.
+ *
+ */
+
+static bool drop_turns (long size)
+{
+    long k, i, offset;
+
+    while (timeline_size + (turn_count + 1) * (long) sizeof (turn_t)
+	   + size > option_timeline_bytes) {
+
+	if (turn_count == 0)
+	    return FALSE;
+
+	for (k = 1; k < turn_count && !turns[k].keyframe; k++)
+	    ;
+
+	timeline_start = turns[k - 1].scrollback;
+
+	if (k < turn_count) {
+	    offset = turns[k].data;
+	    memmove (timeline, timeline + offset, timeline_size - offset);
+	    timeline_size -= offset;
+	    for (i = k; i < turn_count; i++)
+		turns[i].data -= offset;
+	    memmove (turns, turns + k, (turn_count - k) * sizeof (turn_t));
+	} else timeline_size = 0;
+
+	turn_count -= k;
+	turns_dropped += k;
+
+    }
+
+    return TRUE;
+
+}/* drop_turns */
+
+/*
+ * grow_timeline
+ *
+ * Make room for one more turn, needing up to size more bytes.
+ *
+ */
+
+static bool grow_timeline (long size)
+{
+    long n;
+
+    if (!drop_turns (size))
+	return FALSE;
+
+    if (timeline_prev == NULL) {
+	if ((timeline_prev = malloc (h_dynamic_size)) == NULL)
+	    return FALSE;
+	memcpy (timeline_prev, zmp, h_dynamic_size);
+    }
+
+    if (turn_count == turn_alloc) {
+	turn_t *p;
+	n = turn_alloc ? 2 * turn_alloc : 64;
+	if ((p = realloc (turns, n * sizeof (turn_t))) == NULL)
+	    return FALSE;
+	turns = p;
+	turn_alloc = n;
+    }
+
+    if (timeline_size + size > timeline_alloc) {
+	zbyte *p;
+	n = timeline_alloc ? timeline_alloc : 0x10000L;
+	while (n < timeline_size + size)
+	    n *= 2;
+	if (n > option_timeline_bytes)
+	    n = timeline_size + size;
+	if ((p = realloc (timeline, n)) == NULL)
+	    return FALSE;
+	timeline = p;
+	timeline_alloc = n;
+    }
+
+    return TRUE;
+
+}/* grow_timeline */
+
+/*
+ * timeline_turn
+ *
+ * Add a turn to the timeline. Called when a line of input has been
+ * read, at the same point as save_undo for V1 to V4 games.
+ *
+ */
+
+void timeline_turn (void)
+{
+    zword stack_size;
+    turn_t *t;
+
+    if (option_timeline_interval <= 0)	/* timeline unavailable */
+
+	return;
+
+    if (timeline_rewound) {		/* the turn we went back to */
+	timeline_rewound = FALSE;	/* is carrying on */
+	turns[turn_count - 1].scrollback = scrollback_size;
+	return;
+    }
+
+    /* A delta can be half as big again as dynamic memory, and a
+       keyframe is as big */
+
+    stack_size = stack + STACK_SIZE - sp;
+    if (!grow_timeline ((h_dynamic_size * 5) / 2 + 2
+			+ stack_size * sizeof (*sp))) {
+	free_timeline ();
+	option_timeline_interval = 0;
+	return;
+    }
+
+    t = turns + turn_count;
+    GET_PC (t->pc)
+    t->frames = frame_count;
+    t->stack_size = stack_size;
+    t->frame_offset = fp - stack;
+    t->text = zargs[0];
+    t->parse = zargs[1];
+    t->scrollback = scrollback_size;
+    t->keyframe = turn_count == 0
+	|| (turns_dropped + turn_count) % option_timeline_interval == 0;
+
+    t->data = timeline_size;
+    t->diff_size = mem_diff (zmp, timeline_prev, h_dynamic_size,
+			     timeline + timeline_size, NULL);
+    timeline_size += t->diff_size;
+    if (t->keyframe) {
+	memcpy (timeline + timeline_size, zmp, h_dynamic_size);
+	timeline_size += h_dynamic_size;
+    }
+    memcpy (timeline + timeline_size, sp, stack_size * sizeof (*sp));
+    timeline_size += stack_size * sizeof (*sp);
+
+    turn_count++;
+
+}/* timeline_turn */
+
+/*
+ * timeline_seek
+ *
+ * Go back to the start of turn n, where 1 is the first of the game.
+ * Like an undo from the hot key, this happens during line input, and
+ * the line being typed carries on into the turn. Returns 0 if there
+ * is no such turn, or it has been dropped.
+ *
+ */
+
+int timeline_seek (long n)
+{
+    turn_t *t;
+    zbyte *p;
+    long i, k;
+
+    n -= turns_dropped;
+    if (n < 1 || n > turn_count)
+	return 0;
+
+    t = turns + n - 1;
+    for (k = n - 1; !turns[k].keyframe; k--)
+	;
+
+    /* Rebuild the turn's memory from the last turn or the keyframe,
+       whichever is nearer */
+
+    if (turn_count - n <= n - 1 - k) {
+	for (i = turn_count - 1; i > n - 1; i--)
+	    mem_undiff (timeline + turns[i].data, turns[i].diff_size,
+			timeline_prev);
+    } else {
+	memcpy (timeline_prev, timeline + turns[k].data + turns[k].diff_size,
+		h_dynamic_size);
+	for (i = k + 1; i <= n - 1; i++)
+	    mem_undiff (timeline + turns[i].data, turns[i].diff_size,
+			timeline_prev);
+    }
+
+    memcpy (zmp, timeline_prev, h_dynamic_size);
+    drop_props ();
+    SET_PC (t->pc)
+    sp = stack + STACK_SIZE - t->stack_size;
+    fp = stack + t->frame_offset;
+    frame_count = t->frames;
+    p = timeline + t->data + t->diff_size;
+    if (t->keyframe)
+	p += h_dynamic_size;
+    memcpy (sp, p, t->stack_size * sizeof (*sp));
+    zargs[0] = t->text;
+    zargs[1] = t->parse;
+
+    /* The later turns, and any undo states, are of another history */
+
+    turn_count = n;
+    timeline_size = p + t->stack_size * sizeof (*sp) - timeline;
+    timeline_rewound = TRUE;
+
+    if (undo_mem) {
+	free_undo (undo_count);
+#ifdef UNDO_JOURNAL
+	close_journal ();
+#endif
+	memcpy (prev_zmp, zmp, h_dynamic_size);
+    }
+    memset (dirty_map, 0, sizeof (dirty_map));
+
+    restart_header ();
+
+    return 1;
+
+}/* timeline_seek */
+
+/*
+ * timeline_find
+ *
+ * Return the number of the turn that a place in the scrollback, given
+ * in characters from the start of the game, belongs to: the first
+ * whose input ends after it. Going back to that turn shows the game
+ * as it was at that point. Returns 0 if the place is past the input
+ * of the last turn, or its turn has been dropped.
+ *
+ */
+
+long timeline_find (long position)
+{
+    long lo = 0, hi = turn_count, mid;
+
+    if (position < timeline_start)
+	return 0;
+
+    /* Turns end further on in the scrollback as they go */
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (turns[mid].scrollback > position)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+
+    return (lo < turn_count) ? turns_dropped + lo + 1 : 0;
+
+}/* timeline_find */
+
+/*
+ * timeline_turns
+ *
+ * Return the number of the last turn on the timeline, or 0.
+ *
+ */
+
+long timeline_turns (void)
+{
+
+    return turns_dropped + turn_count;
+
+}/* timeline_turns */
+
+/*
+ * timeline_oldest
+ *
+ * Return the number of the first turn still on the timeline, or 0.
+ *
+ */
+
+long timeline_oldest (void)
+{
+
+    return turn_count ? turns_dropped + 1 : 0;
+
+}/* timeline_oldest */
+
 /*
  * z_verify, check the story file integrity.
  *
@@ -1167,18 +2189,27 @@ void z_save_undo (void)
 
 void z_verify (void)
 {
-    zword checksum = 0;
     long i;
 
-    /* Sum all bytes in story file except header bytes */
+    /* Sum all bytes in story file except header bytes, the first
+       time we are asked: dynamic memory as it was loaded, then the
+       rest, which can't have changed */
+
+    if (!story_checksum_known) {
 
-    fseek (story_fp, init_fp_pos + 64, SEEK_SET);
+	story_checksum = 0;
 
-    for (i = 64; i < story_size; i++)
-	checksum += fgetc (story_fp);
+	for (i = 64; i < h_dynamic_size; i++)
+	    story_checksum += story_dynamic[i];
+	for (i = (h_dynamic_size > 64) ? h_dynamic_size : 64; i < story_size; i++)
+	    story_checksum += zmp[i];
+
+	story_checksum_known = TRUE;
+
+    }
 
     /* Branch if the checksums are equal */
 
-    branch (checksum == h_checksum);
+    branch (story_checksum == h_checksum);
 
 }/* z_verify */
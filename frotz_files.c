@@ -34,18 +34,16 @@ extern bool is_terminator (zword);
 
 extern bool read_yes_or_no (const char *);
 
-char script_name[MAX_FILE_NAME + 1] = DEFAULT_SCRIPT_NAME;
-char command_name[MAX_FILE_NAME + 1] = DEFAULT_COMMAND_NAME;
-
 #ifdef __MSDOS__
 extern char latin1_to_ibm[];
 #endif
 
-static int script_width = 0;
+#define script_width (zctx->script_width)
+#define script_valid (zctx->script_valid)
 
-static FILE *sfp = NULL;
-static FILE *rfp = NULL;
-static FILE *pfp = NULL;
+#define sfp (zctx->sfp)
+#define rfp (zctx->rfp)
+#define pfp (zctx->pfp)
 
 /*
  * script_open
@@ -63,8 +61,6 @@ static FILE *pfp = NULL;
 
 void script_open (void)
 {
-    static bool script_valid = FALSE;
-
     char new_name[MAX_FILE_NAME + 1];
 
     h_flags &= ~SCRIPTING_FLAG;
@@ -21,6 +21,7 @@
 #include "frotz.h"
 
 extern int restore_undo (void);
+extern int timeline_seek (long);
 
 extern int read_number (void);
 
@@ -73,6 +74,7 @@ static bool hot_key_help (void) {
 	"Alt-P  playback on\n"
 	"Alt-R  recording on/off\n"
 	"Alt-S  seed random numbers\n"
+	"Alt-T  go back to an earlier turn\n"
 	"Alt-U  undo one turn\n"
 	"Alt-X  exit game\n");
 
@@ -173,6 +175,57 @@ static bool hot_key_undo (void)
 
 }/* hot_key_undo */
 
+/*
+ * hot_key_rewind
+ *
+ * ...allows user to go back to any earlier turn, or to the one a
+ * place in the scrollback belongs to, if the front end has picked one.
+ *
+ */
+
+static bool hot_key_rewind (void)
+{
+    long oldest = timeline_oldest ();
+    long turns = timeline_turns ();
+    long position = rewind_position;
+    long n;
+
+    rewind_position = -1;
+
+    print_string ("Go back to an earlier turn\n");
+
+    if (turns == 0) {
+	print_string ("No turns have been recorded.\n");
+	return FALSE;
+    }
+
+    if (position >= 0)
+
+	n = timeline_find (position);
+
+    else {
+
+	print_string ("Enter turn number (");
+	print_num ((zword) (oldest < 0x7fff ? oldest : 0x7fff));
+	print_string (" to ");
+	print_num ((zword) (turns < 0x7fff ? turns : 0x7fff));
+	print_string ("): ");
+
+	n = read_number ();
+
+    }
+
+    if (timeline_seek (n)) {
+
+	if (h_version <= V3)		/* as for undo, the input */
+	    z_show_status ();		/* carries on in the turn */
+
+    } else print_string ("No such turn.\n");
+
+    return FALSE;
+
+}/* hot_key_rewind */
+
 /*
  * hot_key_restart
  *
@@ -243,6 +296,7 @@ bool handle_hot_key (zword key)
 	    case ZC_HKEY_QUIT: aborting = hot_key_quit (); break;
 	    case ZC_HKEY_DEBUG: aborting = hot_key_debugging (); break;
 	    case ZC_HKEY_HELP: aborting = hot_key_help (); break;
+	    case ZC_HKEY_REWIND: aborting = hot_key_rewind (); break;
 	}
 
 	if (aborting)
@@ -21,6 +21,8 @@
 #include "frotz.h"
 
 extern int save_undo (void);
+extern void timeline_turn (void);
+extern void autosave_turn (void);
 
 extern zword stream_read_key (zword, zword, bool);
 extern zword stream_read_input (int, zword *, zword, zword, bool, bool);
@@ -28,6 +30,8 @@ extern zword stream_read_input (int, zword *, zword, zword, bool, bool);
 extern void tokenise_line (zword, zword, zword, bool);
 zword unicode_tolower (zword);
 
+#define menu_text (zctx->menu_text)
+
 /*
  * is_terminator
  *
@@ -94,7 +98,6 @@ void z_make_menu (void)
 
 	for (i = 0; i < items; i++) {
 
-	    static zword menu[32];
 	    zword item;
 	    zbyte length;
 	    zbyte c;
@@ -105,18 +108,18 @@ void z_make_menu (void)
 
 	    if (length > 31)
 		length = 31;
-	    menu[length] = 0;
+	    menu_text[length] = 0;
 
 	    for (j = 0; j < length; j++) {
 
 		LOW_BYTE (item+j+1, c)
-		menu[j] = translate_from_zscii (c);
+		menu_text[j] = translate_from_zscii (c);
 	    }
 
 	    if (i == 0)
-		os_menu(MENU_NEW, zargs[0], menu);
+		os_menu(MENU_NEW, zargs[0], menu_text);
 	    else
-		os_menu(MENU_ADD, zargs[0], menu);
+		os_menu(MENU_ADD, zargs[0], menu_text);
 	}
     } else os_menu(MENU_REMOVE, zargs[0], 0);
 
@@ -215,9 +218,16 @@ void z_read (void)
 
     /* Supply default arguments */
 
+    if (zargc < 2)
+	zargs[1] = 0;
     if (zargc < 3)
 	zargs[2] = 0;
 
+    /* Own up to a save that failed in the background */
+
+    if (finish_save (FALSE) == 0)
+	print_string ("Error writing save file\n");
+
     /* Get maximum input size */
 
     addr = zargs[0];
@@ -269,6 +279,14 @@ void z_read (void)
     if (h_version <= V4)
 	save_undo ();
 
+    /* Mark the start of a turn on the timeline */
+
+    timeline_turn ();
+
+    /* and take a checkpoint, every so often */
+
+    autosave_turn ();
+
     /* Copy local buffer back to dynamic memory */
 
     for (i = 0; buffer[i] != 0; i++) {
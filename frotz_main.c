@@ -26,6 +26,8 @@
  *
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
 #ifndef MSDOS_16BIT
@@ -34,117 +36,130 @@
 
 extern void interpret (void);
 extern void init_memory (void);
+extern void init_opcodes (void);
 extern void init_buffer (void);
 extern void init_process (void);
 extern void init_sound (void);
 extern void init_undo (void);
+extern void init_autosave (void);
+extern void init_text (void);
+extern void init_words (void);
+extern void reset_text (void);
+extern void reset_props (void);
+extern void restore_checkpoint (const char *);
 extern void reset_memory (void);
 
-/* Story file name, id number and size */
-
-char *story_name = 0;
-
-enum story story_id = UNKNOWN;
-long story_size = 0;
-
-/* Story file header data */
-
-zbyte h_version = 0;
-zbyte h_config = 0;
-zword h_release = 0;
-zword h_resident_size = 0;
-zword h_start_pc = 0;
-zword h_dictionary = 0;
-zword h_objects = 0;
-zword h_globals = 0;
-zword h_dynamic_size = 0;
-zword h_flags = 0;
-zbyte h_serial[6] = { 0, 0, 0, 0, 0, 0 };
-zword h_abbreviations = 0;
-zword h_file_size = 0;
-zword h_checksum = 0;
-zbyte h_interpreter_number = 0;
-zbyte h_interpreter_version = 0;
-zbyte h_screen_rows = 0;
-zbyte h_screen_cols = 0;
-zword h_screen_width = 0;
-zword h_screen_height = 0;
-zbyte h_font_height = 1;
-zbyte h_font_width = 1;
-zword h_functions_offset = 0;
-zword h_strings_offset = 0;
-zbyte h_default_background = 0;
-zbyte h_default_foreground = 0;
-zword h_terminating_keys = 0;
-zword h_line_width = 0;
-zbyte h_standard_high = 1;
-zbyte h_standard_low = 1;
-zword h_alphabet = 0;
-zword h_extension_table = 0;
-zbyte h_user_name[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-
-zword hx_table_size = 0;
-zword hx_mouse_x = 0;
-zword hx_mouse_y = 0;
-zword hx_unicode_table = 0;
-zword hx_flags = 0;
-zword hx_fore_colour = 0;
-zword hx_back_colour = 0;
-
-/* Stack data */
-
-zword stack[STACK_SIZE];
-zword *sp = 0;
-zword *fp = 0;
-zword frame_count = 0;
-
-/* IO streams */
-
-bool ostream_screen = TRUE;
-bool ostream_script = FALSE;
-bool ostream_memory = FALSE;
-bool ostream_record = FALSE;
-bool istream_replay = FALSE;
-bool message = FALSE;
-
-/* Current window and mouse data */
-
-int cwin = 0;
-int mwin = 0;
-
-int mouse_y = 0;
-int mouse_x = 0;
-int menu_selected = 0;
-
-/* Window attributes */
-
-bool enable_wrapping = FALSE;
-bool enable_scripting = FALSE;
-bool enable_scrolling = FALSE;
-bool enable_buffering = FALSE;
-
-/* User options */
-
-int option_attribute_assignment = 0;
-int option_attribute_testing = 0;
-int option_context_lines = 0;
-int option_object_locating = 0;
-int option_object_movement = 0;
-int option_left_margin = 0;
-int option_right_margin = 0;
-int option_ignore_errors = 0;
-int option_piracy = 0;
-int option_undo_slots = MAX_UNDO_SLOTS;
-int option_expand_abbreviations = 0;
-int option_script_cols = 80;
-int option_save_quetzal = 1;
-int option_sound = 1;
-char *option_zcode_path;
-
-
-/* Size of memory to reserve (in bytes) */
-
-long reserve_mem = 0;
+/* Context of the Z-machine running on this thread */
+
+ZTHREAD ZContext *zctx = NULL;
+
+/*
+ * zcontext_new
+ *
+ * Allocate the state of a new Z-machine, with every field holding the
+ * value a freshly started interpreter expects. Return NULL if memory
+ * is short.
+ *
+ */
+
+ZContext *zcontext_new (void)
+{
+    ZContext *ctx, *saved = zctx;
+
+    if ((ctx = calloc (1, sizeof (ZContext))) == NULL)
+	return NULL;
+
+    /* Fill in the defaults through the usual names */
+
+    zctx = ctx;
+
+    story_id = UNKNOWN;
+    packed_shift = 1;
+
+    h_font_height = 1;
+    h_font_width = 1;
+    h_standard_high = 1;
+    h_standard_low = 1;
+
+    ostream_screen = TRUE;
+    rewind_position = -1;
+
+    option_undo_slots = MAX_UNDO_SLOTS;
+    option_text_cache = TEXT_CACHE_SIZE;
+    option_undo_bytes = UNDO_ARENA_SIZE;
+    option_timeline_interval = TIMELINE_INTERVAL;
+    option_timeline_bytes = TIMELINE_MEMORY;
+    option_autosave_turns = AUTOSAVE_TURNS;
+    option_autosave_seconds = AUTOSAVE_SECONDS;
+    option_autosave_files = AUTOSAVE_FILES;
+    option_script_cols = 80;
+    option_save_quetzal = 1;
+    option_sound = 1;
+
+    err_report_mode = ERR_DEFAULT_REPORT_MODE;
+
+    strcpy (save_name, DEFAULT_SAVE_NAME);
+    strcpy (auxilary_name, DEFAULT_AUXILARY_NAME);
+    strcpy (script_name, DEFAULT_SCRIPT_NAME);
+    strcpy (command_name, DEFAULT_COMMAND_NAME);
+
+    ctx->first_restart = TRUE;
+
+    ctx->redirect_depth = -1;
+
+    ctx->font_height = 1;
+    ctx->font_width = 1;
+    ctx->more_prompts = TRUE;
+    ctx->cursor = TRUE;
+    ctx->cwp = ctx->wp;
+
+    ctx->random_a = 1;
+
+    zctx = saved;
+
+    return ctx;
+
+}/* zcontext_new */
+
+/*
+ * zcontext_free
+ *
+ * Release a context created by zcontext_new, together with the caches
+ * allocated for it by the interpreter loop. The context must not be
+ * in use by a running game.
+ *
+ */
+
+void zcontext_free (ZContext *ctx)
+{
+
+    if (ctx == NULL)
+	return;
+
+    if (zctx == ctx)
+	zctx = NULL;
+
+    free (ctx->icache);
+    free (ctx->routine_cache);
+    free (ctx);
+
+}/* zcontext_free */
+
+/*
+ * zcontext_bind
+ *
+ * Make the given context the one the calling thread works on. Each
+ * thread running a Z-machine must bind its own context before calling
+ * frotz_main.
+ *
+ */
+
+void zcontext_bind (ZContext *ctx)
+{
+
+    zctx = ctx;
+
+}/* zcontext_bind */
 
 /*
  * z_piracy, branch if the story file is a legal copy.
@@ -160,6 +175,27 @@ void z_piracy (void)
 
 }/* z_piracy */
 
+/*
+ * frotz_finish
+ *
+ * Release what the game used. Front ends that leave frotz_main early
+ * must call this themselves.
+ *
+ */
+
+void frotz_finish (void)
+{
+
+    reset_text ();
+
+    reset_props ();
+
+    reset_memory ();
+
+    os_reset_screen ();
+
+}/* frotz_finish */
+
 /*
  * main
  *
@@ -176,8 +212,14 @@ int frotz_main (void)
 
     init_err ();
 
+    init_opcodes ();
+
     init_memory ();
 
+    init_text ();
+
+    init_words ();
+
     init_process ();
 
     init_sound ();
@@ -186,13 +228,16 @@ int frotz_main (void)
 
     init_undo ();
 
+    init_autosave ();
+
     z_restart ();
 
-    interpret ();
+    if (option_resume)
+	restore_checkpoint (option_resume);
 
-    reset_memory ();
+    interpret ();
 
-    os_reset_screen ();
+    frotz_finish ();
 
     return 0;
 
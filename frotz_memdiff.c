@@ -0,0 +1,239 @@
+/* memdiff.c - Differences between two copies of dynamic memory
+ *	Copyright (c) 1995-1997 Stefan Jokisch
+ *
+ * This file is part of Frotz.
+ *
+ * Frotz is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Frotz is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
+ */
+
+/*
+ * New undo mechanism added by Jim Dunleavy <jim.dunleavy@erha.ie>
+ */
+
+/*
+ * Undo states and the timeline keep each turn's memory as a
+ * Quetzal-like difference from the one before. The differences are
+ * made and applied here, apart from the rest of memory handling, so
+ * that memdiffbench.c can time them.
+ *
+ */
+
+#include <string.h>
+#include "frotz.h"
+
+/* Memory is compared a machine word at a time, or with SSE2 where
+   the compiler offers it. BYTE_MEM_DIFF keeps the byte loops, for
+   comparison */
+
+#if !defined(MSDOS_16BIT) && !defined(BYTE_MEM_DIFF)
+#include <stdint.h>
+#define WIDE_MEM_DIFF
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#endif
+
+/*
+ * mem_diff_run
+ *
+ * Add a run of j unchanged bytes to a Quetzal-like difference.
+ *
+ */
+
+static void mem_diff_run (zbyte **pp, unsigned j)
+{
+    zbyte *p = *pp;
+
+    if (j > 0x8000) {
+	*p++ = 0;
+	*p++ = 0xff;
+	*p++ = 0xff;
+	j -= 0x8000;
+    }
+    if (j > 0) {
+	*p++ = 0;
+	j--;
+	if (j <= 0x7f) {
+	    *p++ = j;
+	} else {
+	    *p++ = (j & 0x7f) | 0x80;
+	    *p++ = (j & 0x7f80) >> 7;
+	}
+    }
+    *pp = p;
+
+}/* mem_diff_run */
+
+/*
+ * mem_scan
+ *
+ * Return the offset of the first byte from i on where a and b
+ * differ, or end if they are the same up to there.
+ *
+ */
+
+static unsigned mem_scan (const zbyte *a, const zbyte *b, unsigned i,
+			  unsigned end)
+{
+
+#ifdef WIDE_MEM_DIFF
+
+#if defined(__GNUC__) && defined(__SSE2__)
+    while (i + 16 <= end) {
+	__m128i x = _mm_loadu_si128 ((const __m128i *) (a + i));
+	__m128i y = _mm_loadu_si128 ((const __m128i *) (b + i));
+	unsigned same = _mm_movemask_epi8 (_mm_cmpeq_epi8 (x, y));
+	if (same != 0xffff)
+	    return i + __builtin_ctz (~same);
+	i += 16;
+    }
+#endif
+
+    while (i + 8 <= end) {
+	uint64_t x, y;
+	memcpy (&x, a + i, 8);
+	memcpy (&y, b + i, 8);
+	if (x != y)
+	    break;
+	i += 8;
+    }
+
+#endif
+
+    while (i < end && a[i] == b[i])
+	i++;
+    return i;
+
+}/* mem_scan */
+
+/*
+ * mem_diff
+ *
+ * Set diff to a Quetzal-like difference between a and b,
+ * copying a to b as we go.  It is assumed that diff points to a
+ * buffer which is large enough to hold the diff.
+ * mem_size is the number of bytes to compare; only the blocks
+ * marked in dirty are looked at, as the others must be the same,
+ * unless dirty is NULL.
+ * Returns the number of bytes copied to diff.
+ *
+ */
+
+long mem_diff (zbyte *a, zbyte *b, zword mem_size, zbyte *diff,
+		      const zbyte *dirty)
+{
+    const unsigned block = 1 << DIRTY_SHIFT;
+    unsigned i = 0;
+    unsigned end;
+    zbyte *p = diff;
+    unsigned j = 0;
+    zbyte c;
+
+    while (i < mem_size) {
+
+	/* Skip eight clean blocks at a time where we can, then one */
+
+	if (dirty == NULL)
+	    end = mem_size;
+	else if (dirty[i >> (DIRTY_SHIFT + 3)] == 0
+		 && (i & (8 * block - 1)) == 0) {
+	    j += 8 * block;
+	    i += 8 * block;
+	    continue;
+	} else {
+	    end = (i | (block - 1)) + 1;
+	    if (!(dirty[i >> (DIRTY_SHIFT + 3)]
+		  & (1 << ((i >> DIRTY_SHIFT) & 7)))) {
+		j += end - i;
+		i = end;
+		continue;
+	    }
+	    if (end > mem_size)
+		end = mem_size;
+	}
+
+	while (i < end) {
+	    unsigned k = mem_scan (a, b, i, end);
+	    j += k - i;
+	    if ((i = k) == end)
+		break;
+	    c = a[i] ^ b[i];
+	    mem_diff_run (&p, j);
+	    j = 0;
+	    *p++ = c;
+	    b[i++] ^= c;
+	}
+    }
+    return p - diff;
+}/* mem_diff */
+
+/*
+ * mem_undiff
+ *
+ * Applies a quetzal-like diff to dest
+ *
+ */
+
+void mem_undiff (zbyte *diff, long diff_length, zbyte *dest)
+{
+    zbyte c;
+
+    while (diff_length) {
+
+#ifdef WIDE_MEM_DIFF
+
+	/* Changed bytes come as themselves, and are never zero; XOR them
+	   in a word at a time while the next eight are all changes */
+
+	while (diff_length >= 8) {
+	    uint64_t x, y;
+	    memcpy (&x, diff, 8);
+	    if ((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL)
+		break;
+	    memcpy (&y, dest, 8);
+	    y ^= x;
+	    memcpy (dest, &y, 8);
+	    diff += 8;
+	    dest += 8;
+	    diff_length -= 8;
+	}
+	if (!diff_length)
+	    return;
+
+#endif
+
+	c = *diff++;
+	diff_length--;
+	if (c == 0) {
+	    unsigned runlen;
+
+	    if (!diff_length)
+		return;  /* Incomplete run */
+	    runlen = *diff++;
+	    diff_length--;
+	    if (runlen & 0x80) {
+		if (!diff_length)
+		    return; /* Incomplete extended run */
+		c = *diff++;
+		diff_length--;
+		runlen = (runlen & 0x7f) | (((unsigned) c) << 7);
+	    }
+
+	    dest += runlen + 1;
+	} else {
+	    *dest++ ^= c;
+	}
+    }
+}/* mem_undiff */
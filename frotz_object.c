@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
 #define MAX_OBJECT 2000
@@ -34,6 +36,9 @@
 #define O4_PROPERTY_OFFSET 12
 #define O4_SIZE 14
 
+extern void guard_abbreviations (void);
+extern void abbreviation_written (zword);
+
 /*
  * object_address
  *
@@ -153,6 +158,243 @@ static zword next_property (zword prop_addr)
 
 }/* next_property */
 
+/*
+ * Rather than walk an object's property list on every access, the
+ * property opcodes look in an index of it, built the first time the
+ * object is asked about. For each property number the index holds the
+ * entry a walk for it would stop at: the first whose number is no
+ * greater. The index depends only on the bytes that give the layout of
+ * the list, and they are guarded: a game that writes one, rather than
+ * a property value, drops every index, as does replacing memory
+ * wholesale.
+ *
+ */
+
+#define PROP_ENTRIES 256	/* longest property list indexed */
+
+struct prop_slot {
+    zword entry;		/* address of the entry */
+    zword data;			/* and of its data */
+    zbyte value;		/* first size byte */
+    zbyte len;			/* length of the data */
+};
+
+#define prop_index (zctx->prop_index)
+
+/*
+ * guard_prop
+ *
+ * Drop the property index when the given byte is written.
+ *
+ */
+
+static inline void guard_prop (zword addr)
+{
+
+    write_guard[addr >> 3] |= 1 << (addr & 7);
+
+}/* guard_prop */
+
+/*
+ * fill_slot
+ *
+ * Describe the property list entry at the given address.
+ *
+ */
+
+static void fill_slot (struct prop_slot *slot, zword prop_addr)
+{
+    zbyte value;
+
+    LOW_BYTE (prop_addr, value)
+
+    slot->entry = prop_addr;
+    slot->value = value;
+    slot->data = prop_addr + ((h_version >= V4 && (value & 0x80)) ? 2 : 1);
+    slot->len = next_property (prop_addr) - slot->data;
+
+}/* fill_slot */
+
+/*
+ * index_props
+ *
+ * Build the index of an object's property list, and guard the bytes it
+ * was built from. Returns NULL if the list runs on for too long, to be
+ * walked instead.
+ *
+ */
+
+static struct prop_slot *index_props (zword obj)
+{
+    struct prop_slot *slots;
+    struct prop_slot entry;
+    zword obj_addr;
+    zword name_addr;
+    zword prop_addr;
+    zbyte mask;
+    int lowest;
+    int count;
+    int i;
+
+    if (prop_index == NULL)
+	if ((prop_index = calloc (MAX_OBJECT + 1, sizeof (*prop_index))) == NULL)
+	    return NULL;
+
+    mask = (h_version <= V3) ? 0x1f : 0x3f;
+
+    if ((slots = malloc ((mask + 1) * sizeof (*slots))) == NULL)
+	return NULL;
+
+    /* The pointer to the property list, and the length of the name */
+
+    obj_addr = object_address (obj);
+    obj_addr += (h_version <= V3) ? O1_PROPERTY_OFFSET : O4_PROPERTY_OFFSET;
+
+    prop_addr = first_property (obj);
+
+    guard_prop (obj_addr);
+    guard_prop (obj_addr + 1);
+    LOW_WORD (obj_addr, name_addr)
+    guard_prop (name_addr);
+
+    /* Each entry resolves the numbers from its own up to the lowest
+       seen so far; property 0 ends the list */
+
+    lowest = mask + 1;
+
+    for (count = 0; lowest != 0; count++) {
+
+	if (count == PROP_ENTRIES || prop_addr >= story_size - 1) {
+	    free (slots);
+	    return NULL;
+	}
+
+	fill_slot (&entry, prop_addr);
+
+	guard_prop (entry.entry);
+	if (entry.data - entry.entry == 2)
+	    guard_prop (entry.entry + 1);
+
+	for (i = entry.value & mask; i < lowest; i++)
+	    slots[i] = entry;
+	if ((entry.value & mask) < lowest)
+	    lowest = entry.value & mask;
+
+	prop_addr = entry.data + entry.len;
+
+    }
+
+    prop_index[obj] = slots;
+
+    return slots;
+
+}/* index_props */
+
+/*
+ * find_prop
+ *
+ * Return the entry of an object's property list at which a walk for
+ * the given property stops. Either it has that number, or the object
+ * doesn't have the property.
+ *
+ */
+
+static const struct prop_slot *find_prop (zword obj, zword prop,
+					  struct prop_slot *walk)
+{
+    struct prop_slot *slots;
+    zword prop_addr;
+    zbyte value;
+    zbyte mask;
+
+    mask = (h_version <= V3) ? 0x1f : 0x3f;
+
+    /* Look in the index */
+
+    if (obj <= ((h_version <= V3) ? 255 : MAX_OBJECT)) {
+
+	if (prop_index != NULL && (slots = prop_index[obj]) != NULL)
+	    return slots + (prop < mask ? prop : mask);
+
+	if ((slots = index_props (obj)) != NULL)
+	    return slots + (prop < mask ? prop : mask);
+
+    }
+
+    /* Scan down the property list */
+
+    prop_addr = first_property (obj);
+
+    for (;;) {
+	LOW_BYTE (prop_addr, value)
+	if ((value & mask) <= prop)
+	    break;
+	prop_addr = next_property (prop_addr);
+    }
+
+    fill_slot (walk, prop_addr);
+
+    return walk;
+
+}/* find_prop */
+
+/*
+ * drop_props
+ *
+ * Drop the property index of every object, after a write to a byte it
+ * depends on, and guard the abbreviation table again.
+ *
+ */
+
+void drop_props (void)
+{
+    int i;
+
+    if (prop_index != NULL)
+	for (i = 0; i <= MAX_OBJECT; i++) {
+	    free (prop_index[i]);
+	    prop_index[i] = NULL;
+	}
+
+    memset (write_guard, 0, sizeof (write_guard));
+
+    guard_abbreviations ();
+
+}/* drop_props */
+
+/*
+ * guarded_write
+ *
+ * Drop what depends on a guarded byte that is about to be written.
+ *
+ */
+
+void guarded_write (zword addr)
+{
+
+    abbreviation_written (addr);
+
+    drop_props ();
+
+}/* guarded_write */
+
+/*
+ * reset_props
+ *
+ * Free the property index.
+ *
+ */
+
+void reset_props (void)
+{
+
+    drop_props ();
+
+    free (prop_index);
+    prop_index = NULL;
+
+}/* reset_props */
+
 /*
  * unlink_object
  *
@@ -435,6 +677,8 @@ void z_get_child (void)
 
 void z_get_next_prop (void)
 {
+    const struct prop_slot *slot;
+    struct prop_slot walk;
     zword prop_addr;
     zbyte value;
     zbyte mask;
@@ -449,25 +693,23 @@ void z_get_next_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
     if (zargs[1] != 0) {
 
-	/* Scan down the property list */
+	/* Find the property, and the one after it */
 
-	do {
-	    LOW_BYTE (prop_addr, value)
-	    prop_addr = next_property (prop_addr);
-	} while ((value & mask) > zargs[1]);
+	slot = find_prop (zargs[0], zargs[1], &walk);
+	prop_addr = slot->data + slot->len;
 
 	/* Exit if the property does not exist */
 
-	if ((value & mask) != zargs[1])
+	if ((slot->value & mask) != zargs[1])
 	    runtime_error (ERR_NO_PROP);
 
-    }
+    } else
+
+	/* Load address of first property */
+
+	prop_addr = first_property (zargs[0]);
 
     /* Return the property id */
 
@@ -544,6 +786,8 @@ void z_get_parent (void)
 
 void z_get_prop (void)
 {
+    const struct prop_slot *slot;
+    struct prop_slot walk;
     zword prop_addr;
     zword wprop_val;
     zbyte bprop_val;
@@ -560,18 +804,11 @@ void z_get_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
+    /* Find the property */
 
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
-
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    slot = find_prop (zargs[0], zargs[1], &walk);
+    prop_addr = slot->entry;
+    value = slot->value;
 
     if ((value & mask) == zargs[1]) {	/* property found */
 
@@ -611,8 +848,8 @@ void z_get_prop (void)
 
 void z_get_prop_addr (void)
 {
-    zword prop_addr;
-    zbyte value;
+    const struct prop_slot *slot;
+    struct prop_slot walk;
     zbyte mask;
 
     if (zargs[0] == 0) {
@@ -629,28 +866,16 @@ void z_get_prop_addr (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
+    /* Find the property */
 
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
-
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    slot = find_prop (zargs[0], zargs[1], &walk);
 
     /* Calculate the property address or return zero */
 
-    if ((value & mask) == zargs[1]) {
-
-	if (h_version >= V4 && (value & 0x80))
-	    prop_addr++;
-	store ((zword) (prop_addr + 1));
-
-    } else store (0);
+    if ((slot->value & mask) == zargs[1])
+	store (slot->data);
+    else
+	store (0);
 
 }/* z_get_prop_addr */
 
@@ -836,6 +1061,8 @@ void z_insert_obj (void)
 
 void z_put_prop (void)
 {
+    const struct prop_slot *slot;
+    struct prop_slot walk;
     zword prop_addr;
     zword value;
     zbyte mask;
@@ -849,18 +1076,11 @@ void z_put_prop (void)
 
     mask = (h_version <= V3) ? 0x1f : 0x3f;
 
-    /* Load address of first property */
-
-    prop_addr = first_property (zargs[0]);
-
-    /* Scan down the property list */
+    /* Find the property */
 
-    for (;;) {
-	LOW_BYTE (prop_addr, value)
-	if ((value & mask) <= zargs[1])
-	    break;
-	prop_addr = next_property (prop_addr);
-    }
+    slot = find_prop (zargs[0], zargs[1], &walk);
+    prop_addr = slot->entry;
+    value = slot->value;
 
     /* Exit if the property does not exist */
 
@@ -18,22 +18,96 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <stdlib.h>
+#include <string.h>
+#define ZCONTEXT_STACK_ALIASES
 #include "frotz.h"
 
 #ifdef DJGPP
 #include "djfrotz.h"
 #endif
 
+extern void clear_autosave (void);
 
-zword zargs[8];
-int zargc;
+/* Threaded dispatch relies on the GCC "labels as values" extension */
 
-static int finished = 0;
+#if defined(THREADED_DISPATCH) && !defined(__GNUC__)
+#undef THREADED_DISPATCH
+#endif
+
+#define finished (zctx->finished)
+#define icache (zctx->icache)
+#define curr_insn (zctx->curr_insn)
+#define routine_cache (zctx->routine_cache)
+#define routine_hits (zctx->routine_hits)
+#define routine_misses (zctx->routine_misses)
+#define fused_count (zctx->fused_count)
+
+/*
+ * Decoded instruction cache. Code in static and high memory can't
+ * change, so an instruction found there is decoded only once: we keep
+ * its handler, its operands and (after the first time branch() reads
+ * it) its branch data, and run it again without re-parsing the opcode
+ * and operand type bytes. The cache is direct mapped on the PC.
+ */
+
+typedef struct icache_struct icache_t;
+struct icache_struct {
+    zbyte *pc;			/* opcode address, NULL if slot unused */
+    zbyte *tail;		/* address following the operands */
+    void (*handler) (void);
+    zbyte opcode;		/* first opcode byte, 0xbe if extended */
+    zword args[8];		/* constant value or variable number */
+    zbyte argc;
+    zbyte variables;		/* bit n set if args[n] is a variable */
+    zbyte *branch_at;		/* address of branch data, NULL if unknown */
+    zbyte branch_len;
+    zbyte branch_specifier;
+    zword branch_offset;
+    zbyte fused;		/* superinstruction kind, FUSED_NONE if not */
+    zbyte fused_var;		/* variable written by a fused store */
+    zbyte *fused_next;		/* PC after a superinstruction */
+};
+
+/*
+ * Routine header cache. The header of a routine outside dynamic memory
+ * (locals count and, in V1 to V4, their default values) is decoded on
+ * the first call and kept, keyed by packed address.
+ */
+
+typedef struct routine_struct routine_t;
+struct routine_struct {
+    zbyte *start;		/* first instruction, NULL if slot unused */
+    long pc;			/* byte address of the routine */
+    zword routine;		/* packed address */
+    zbyte count;		/* number of locals */
+    zword defaults[15];
+};
+
+/*
+ * Superinstructions. When a cached instruction is decoded, a few very
+ * common sequences starting with it are fused into a single handler:
+ * a test with its branch decoded up front, an inc_chk or dec_chk whose
+ * fall-through is a jump (the typical loop tail), and a loadw to the
+ * stack that is immediately popped by a store. The kinds are listed
+ * in frotz.h, which keeps a count of each.
+ */
+
+static const char *fused_names[FUSED_KINDS] = {
+    "none",
+    "je+branch",
+    "jz+branch",
+    "inc_chk+branch",
+    "dec_chk+branch",
+    "inc_chk+jump",
+    "dec_chk+jump",
+    "loadw+store"
+};
 
 static void __extended__ (void);
 static void __illegal__ (void);
 
-void (*op0_opcodes[0x10]) (void) = {
+static void (*const op0_defaults[0x10]) (void) = {
     z_rtrue,
     z_rfalse,
     z_print,
@@ -52,7 +126,7 @@ void (*op0_opcodes[0x10]) (void) = {
     z_piracy
 };
 
-void (*op1_opcodes[0x10]) (void) = {
+static void (*const op1_defaults[0x10]) (void) = {
     z_jz,
     z_get_sibling,
     z_get_child,
@@ -71,7 +145,7 @@ void (*op1_opcodes[0x10]) (void) = {
     z_call_n
 };
 
-void (*var_opcodes[0x40]) (void) = {
+static void (*const var_defaults[0x40]) (void) = {
     __illegal__,
     z_je,
     z_jl,
@@ -171,6 +245,23 @@ void (*ext_opcodes[0x1e]) (void) = {
     z_buffer_screen	/* spec 1.1 */
 };
 
+/*
+ * init_opcodes
+ *
+ * Give the current context its own copy of the opcode tables, which
+ * init_memory adjusts to the story version.
+ *
+ */
+
+void init_opcodes (void)
+{
+
+    memcpy (op0_opcodes, op0_defaults, sizeof (op0_defaults));
+    memcpy (op1_opcodes, op1_defaults, sizeof (op1_defaults));
+    memcpy (var_opcodes, var_defaults, sizeof (var_defaults));
+
+}/* init_opcodes */
+
 /*
  * init_process
  *
@@ -181,8 +272,68 @@ void (*ext_opcodes[0x1e]) (void) = {
 void init_process (void)
 {
     finished = 0;
+
+    if (icache == NULL)
+	icache = malloc (ICACHE_SIZE * sizeof (icache_t));
+    if (routine_cache == NULL)
+	routine_cache = malloc (ROUTINE_CACHE_SIZE * sizeof (routine_t));
+
+    if (icache == NULL || routine_cache == NULL)
+	os_fatal ("Out of memory");
+
+    /* Opcode tables depend on the story version; forget old decodings */
+
+    memset (icache, 0, ICACHE_SIZE * sizeof (icache_t));
+    curr_insn = NULL;
+
+    memset (routine_cache, 0, ROUTINE_CACHE_SIZE * sizeof (routine_t));
 }
 
+/*
+ * load_variable
+ *
+ * Return the value of a variable (stack, local or global).
+ *
+ */
+
+static zword load_variable (zbyte variable)
+{
+    zword value;
+
+    if (variable == 0)
+	value = *sp++;
+    else if (variable < 16)
+	value = *(fp - variable);
+    else {
+	zword addr = h_globals + 2 * (variable - 16);
+	LOW_WORD (addr, value)
+    }
+
+    return value;
+
+}/* load_variable */
+
+/*
+ * store_variable
+ *
+ * Write a variable (stack top, local or global) in place.
+ *
+ */
+
+static void store_variable (zbyte variable, zword value)
+{
+
+    if (variable == 0)
+	*sp = value;
+    else if (variable < 16)
+	*(fp - variable) = value;
+    else {
+	zword addr = h_globals + 2 * (variable - 16);
+	SET_WORD (addr, value)
+    }
+
+}/* store_variable */
+
 /*
  * load_operand
  *
@@ -200,14 +351,7 @@ static void load_operand (zbyte type)
 
 	CODE_BYTE (variable)
 
-	if (variable == 0)
-	    value = *sp++;
-	else if (variable < 16)
-	    value = *(fp - variable);
-	else {
-	    zword addr = h_globals + 2 * (variable - 16);
-	    LOW_WORD (addr, value)
-	}
+	value = load_variable (variable);
 
     } else if (type & 1) { 		/* small constant */
 
@@ -247,6 +391,779 @@ static void load_all_operands (zbyte specifier)
 
 }/* load_all_operands */
 
+/*
+ * decode_branch
+ *
+ * Decode the branch data at the given address into a cache entry.
+ *
+ */
+
+static void decode_branch (icache_t *ic, zbyte *p)
+{
+    zbyte specifier;
+    zbyte off1;
+
+    ic->branch_at = p;
+
+    specifier = *p++;
+
+    off1 = specifier & 0x3f;
+
+    if (!(specifier & 0x40)) {		/* it's a long branch */
+
+	if (off1 & 0x20)		/* propagate sign bit */
+	    off1 |= 0xc0;
+
+	ic->branch_offset = (off1 << 8) | *p++;
+
+    } else ic->branch_offset = off1;	/* it's a short branch */
+
+    ic->branch_specifier = specifier;
+    ic->branch_len = p - ic->branch_at;
+
+}/* decode_branch */
+
+/*
+ * take_branch
+ *
+ * Leave a fused test instruction, either through its branch or
+ * to the PC following the superinstruction.
+ *
+ */
+
+static void take_branch (const icache_t *ic, bool flag)
+{
+
+    if (((ic->branch_specifier & 0x80) != 0) == (flag != 0))
+	pcp = ic->branch_at + ic->branch_len + (short) ic->branch_offset - 2;
+    else
+	pcp = ic->fused_next;
+
+}/* take_branch */
+
+/*
+ * fused_je, fused_jz, fused_inc_chk, fused_dec_chk, fused_loadw_store
+ *
+ * Superinstruction handlers. Like the plain opcode handlers they take
+ * their operands from zargs; everything else comes from the cache
+ * entry being executed.
+ *
+ */
+
+static void fused_je (void)
+{
+
+    fused_count[FUSED_JE_BRANCH]++;
+
+    take_branch (curr_insn,
+	zargc > 1 && (zargs[0] == zargs[1] || (
+	zargc > 2 && (zargs[0] == zargs[2] || (
+	zargc > 3 && (zargs[0] == zargs[3]))))));
+
+}/* fused_je */
+
+static void fused_jz (void)
+{
+
+    fused_count[FUSED_JZ_BRANCH]++;
+
+    take_branch (curr_insn, (short) zargs[0] == 0);
+
+}/* fused_jz */
+
+static void fused_inc_chk (void)
+{
+    zword value;
+
+    fused_count[curr_insn->fused]++;
+
+    if (zargs[0] == 0)
+	value = ++(*sp);
+    else if (zargs[0] < 16)
+	value = ++(*(fp - zargs[0]));
+    else {
+	zword addr = h_globals + 2 * (zargs[0] - 16);
+	LOW_WORD (addr, value)
+	value++;
+	SET_WORD (addr, value)
+    }
+
+    take_branch (curr_insn, (short) value > (short) zargs[1]);
+
+}/* fused_inc_chk */
+
+static void fused_dec_chk (void)
+{
+    zword value;
+
+    fused_count[curr_insn->fused]++;
+
+    if (zargs[0] == 0)
+	value = --(*sp);
+    else if (zargs[0] < 16)
+	value = --(*(fp - zargs[0]));
+    else {
+	zword addr = h_globals + 2 * (zargs[0] - 16);
+	LOW_WORD (addr, value)
+	value--;
+	SET_WORD (addr, value)
+    }
+
+    take_branch (curr_insn, (short) value < (short) zargs[1]);
+
+}/* fused_dec_chk */
+
+static void fused_loadw_store (void)
+{
+    zword addr = zargs[0] + 2 * zargs[1];
+    zword value;
+
+    fused_count[FUSED_LOADW_STORE]++;
+
+    LOW_WORD (addr, value)
+
+    store_variable (curr_insn->fused_var, value);
+
+    pcp = curr_insn->fused_next;
+
+}/* fused_loadw_store */
+
+/*
+ * fuse_instruction
+ *
+ * Try to turn a freshly decoded instruction into a superinstruction by
+ * looking at the code that follows it. Only code outside dynamic memory
+ * is fused, and branches that return rather than jump are left to the
+ * ordinary handlers.
+ *
+ */
+
+static void fuse_instruction (icache_t *ic)
+{
+    zbyte *end = zmp + story_size;
+    zbyte *p = ic->tail;
+    zbyte opcode = ic->opcode;
+    zbyte op;
+
+    ic->fused = FUSED_NONE;
+
+    if (ic->pc - zmp < h_dynamic_size || p + 4 > end)
+	return;
+
+    if (opcode < 0x80)			/* 2OP opcodes, long form */
+	op = opcode & 0x1f;
+    else if (opcode >= 0xc0 && opcode < 0xe0)	/* 2OP opcodes, VAR form */
+	op = opcode - 0xc0;
+    else if (opcode < 0xb0 && (opcode & 0x0f) == 0x00)	/* jz */
+	op = 0x80;
+    else
+	return;
+
+    switch (op) {
+
+    case 0x01:				/* je */
+    case 0x80:				/* jz */
+    case 0x04:				/* dec_chk */
+    case 0x05:				/* inc_chk */
+
+	decode_branch (ic, p);
+
+	if (ic->branch_offset <= 1)
+	    return;
+
+	ic->fused_next = p + ic->branch_len;
+
+	if (op == 0x01) {
+	    ic->fused = FUSED_JE_BRANCH;
+	    ic->handler = fused_je;
+	    return;
+	}
+
+	if (op == 0x80) {
+	    ic->fused = FUSED_JZ_BRANCH;
+	    ic->handler = fused_jz;
+	    return;
+	}
+
+	ic->fused = (op == 0x05) ? FUSED_INC_CHK_BRANCH : FUSED_DEC_CHK_BRANCH;
+	ic->handler = (op == 0x05) ? fused_inc_chk : fused_dec_chk;
+
+	/* A following jump with a constant offset becomes the fall-through */
+
+	p = ic->fused_next;
+
+	if (p + 3 <= end && *p == 0x8c) {
+
+	    zbyte *target = p + 3 + (short) ((p[1] << 8) | p[2]) - 2;
+
+	    if (target >= zmp && target < end) {
+		ic->fused = (op == 0x05) ? FUSED_INC_CHK_JUMP : FUSED_DEC_CHK_JUMP;
+		ic->fused_next = target;
+	    }
+
+	}
+
+	return;
+
+    case 0x0f:				/* loadw */
+
+	/* loadw ... -> sp; store var sp, with var not the stack itself */
+
+	if (p[0] == 0x00 && p[1] == 0x2d && p[2] != 0x00 && p[3] == 0x00) {
+	    ic->fused = FUSED_LOADW_STORE;
+	    ic->fused_var = p[2];
+	    ic->fused_next = p + 4;
+	    ic->handler = fused_loadw_store;
+	}
+
+	return;
+
+    }
+
+}/* fuse_instruction */
+
+/*
+ * superinstruction
+ *
+ * Return the name of the nth kind of superinstruction, counting from
+ * 1, and how often one has been run; or NULL if there are no more.
+ *
+ */
+
+const char *superinstruction (int n, long *count)
+{
+
+    if (n <= FUSED_NONE || n >= FUSED_KINDS)
+	return NULL;
+
+    *count = fused_count[n];
+
+    return fused_names[n];
+
+}/* superinstruction */
+
+/*
+ * routine_headers
+ *
+ * Return how many calls found their routine header cached, and how
+ * many had to decode it.
+ *
+ */
+
+void routine_headers (long *hits, long *misses)
+{
+
+    *hits = routine_hits;
+    *misses = routine_misses;
+
+}/* routine_headers */
+
+/*
+ * decode_operand
+ *
+ * Record an operand, either a variable number or a constant, in a
+ * cache entry.
+ *
+ */
+
+static void decode_operand (icache_t *ic, zbyte type)
+{
+    zword value;
+
+    if (type & 2) { 			/* variable */
+
+	zbyte variable;
+
+	CODE_BYTE (variable)
+
+	ic->variables |= 1 << ic->argc;
+	value = variable;
+
+    } else if (type & 1) { 		/* small constant */
+
+	zbyte bvalue;
+
+	CODE_BYTE (bvalue)
+	value = bvalue;
+
+    } else CODE_WORD (value) 		/* large constant */
+
+    ic->args[ic->argc++] = value;
+
+}/* decode_operand */
+
+/*
+ * decode_all_operands
+ *
+ * Given the operand specifier byte, record all (up to four) operands
+ * of a VAR or EXT opcode in a cache entry.
+ *
+ */
+
+static void decode_all_operands (icache_t *ic, zbyte specifier)
+{
+    int i;
+
+    for (i = 6; i >= 0; i -= 2) {
+
+	zbyte type = (specifier >> i) & 0x03;
+
+	if (type == 3)
+	    break;
+
+	decode_operand (ic, type);
+
+    }
+
+}/* decode_all_operands */
+
+/*
+ * decode_instruction
+ *
+ * Decode the instruction at PC into a cache entry, fusing it with
+ * the following code where possible. The PC is left after the
+ * operands; neither the operands nor the handler are evaluated.
+ *
+ */
+
+static void decode_instruction (icache_t *ic)
+{
+    zbyte opcode;
+
+    ic->pc = pcp;
+    ic->argc = 0;
+    ic->variables = 0;
+    ic->branch_at = NULL;
+
+    CODE_BYTE (opcode)
+
+    ic->opcode = opcode;
+
+    if (opcode < 0x80) {			/* 2OP opcodes */
+
+	decode_operand (ic, (zbyte) (opcode & 0x40) ? 2 : 1);
+	decode_operand (ic, (zbyte) (opcode & 0x20) ? 2 : 1);
+
+	ic->handler = var_opcodes[opcode & 0x1f];
+
+    } else if (opcode < 0xb0) {		/* 1OP opcodes */
+
+	decode_operand (ic, (zbyte) (opcode >> 4));
+
+	ic->handler = op1_opcodes[opcode & 0x0f];
+
+    } else if (opcode == 0xbe) {		/* extended opcodes */
+
+	zbyte specifier;
+
+	CODE_BYTE (opcode)
+	CODE_BYTE (specifier)
+
+	decode_all_operands (ic, specifier);
+
+	ic->handler = (opcode < 0x1e) ? ext_opcodes[opcode] : z_nop;
+
+    } else if (opcode < 0xc0) {		/* 0OP opcodes */
+
+	ic->handler = op0_opcodes[opcode - 0xb0];
+
+    } else {				/* VAR opcodes */
+
+	zbyte specifier1;
+	zbyte specifier2;
+
+	if (opcode == 0xec || opcode == 0xfa) {	/* opcodes 0xec */
+	    CODE_BYTE (specifier1)                  /* and 0xfa are */
+	    CODE_BYTE (specifier2)                  /* call opcodes */
+	    decode_all_operands (ic, specifier1);	/* with up to 8 */
+	    decode_all_operands (ic, specifier2);	/* arguments    */
+	} else {
+	    CODE_BYTE (specifier1)
+	    decode_all_operands (ic, specifier1);
+	}
+
+	ic->handler = var_opcodes[opcode - 0xc0];
+
+    }
+
+    ic->tail = pcp;
+
+    fuse_instruction (ic);
+
+}/* decode_instruction */
+
+/*
+ * load_cached_operands
+ *
+ * Load the operands of a cached instruction into the given array,
+ * reading any variables in their original order. Returns the number
+ * of operands.
+ *
+ */
+
+static int load_cached_operands (const icache_t *ic, zword *args)
+{
+    int argc = ic->argc;
+    int i;
+
+    if (ic->variables == 0) {
+
+	for (i = 0; i < argc; i++)
+	    args[i] = ic->args[i];
+
+    } else {
+
+	for (i = 0; i < argc; i++)
+	    if (ic->variables & (1 << i))
+		args[i] = load_variable ((zbyte) ic->args[i]);
+	    else
+		args[i] = ic->args[i];
+
+    }
+
+    return argc;
+
+}/* load_cached_operands */
+
+/* The backend doesn't change while the story runs, so interpret looks
+   up its os_tick once rather than once per instruction. A backend with
+   nothing to do between instructions leaves it out */
+
+#define BACKEND_TICK void (*const tick) (void) = zctx->os->tick;
+
+#ifdef THREADED_DISPATCH
+
+/*
+ * fetch_instruction
+ *
+ * Return the decoded instruction at PC and move PC past its operands.
+ * Instructions in dynamic memory are decoded into the scratch entry
+ * every time since they may change.
+ *
+ */
+
+static icache_t *fetch_instruction (icache_t *scratch)
+{
+    long pc;
+    icache_t *ic;
+
+    GET_PC (pc)
+
+    ic = icache + (pc & (ICACHE_SIZE - 1));
+
+    if (ic->pc != pcp) {
+
+	if (pc < h_dynamic_size)
+	    ic = scratch;
+
+	decode_instruction (ic);
+
+    }
+
+    pcp = ic->tail;
+    curr_insn = (ic != scratch) ? ic : NULL;
+
+    return ic;
+
+}/* fetch_instruction */
+
+/*
+ * interpret
+ *
+ * Z-code interpreter main loop, threaded version. Every opcode byte
+ * has a label in the dispatch table, and every handler jumps straight
+ * to the next one. The most frequent opcodes are executed inline on
+ * operands held in local storage; the rest, and superinstructions,
+ * go through the same handler functions as the portable loop.
+ *
+ */
+
+#define OP_2OP_LABELS \
+    &&op_call,    &&op_je,      &&op_jl,      &&op_jg,		\
+    &&op_dec_chk, &&op_inc_chk, &&op_call,    &&op_test,	\
+    &&op_or,      &&op_and,     &&op_call,    &&op_call,	\
+    &&op_call,    &&op_store,   &&op_call,    &&op_loadw,	\
+    &&op_loadb,   &&op_call,    &&op_call,    &&op_call,	\
+    &&op_add,     &&op_sub,     &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call
+
+#define OP_1OP_LABELS \
+    &&op_jz,      &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_jump,    &&op_call,    &&op_load,    &&op_call
+
+#define OP_16_CALLS \
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call,	\
+    &&op_call,    &&op_call,    &&op_call,    &&op_call
+
+#if defined(DJGPP) && defined(SOUND_SUPPORT)
+#define CHECK_SOUND if (end_of_sound_flag) end_of_sound ();
+#else
+#define CHECK_SOUND
+#endif
+
+#define DISPATCH { \
+    long pc; \
+    GET_PC (pc) \
+    ic = icache + (pc & (ICACHE_SIZE - 1)); \
+    if (ic->pc == pcp) { \
+	pcp = ic->tail; \
+	curr_insn = ic; \
+    } else ic = fetch_instruction (&scratch); \
+    if (ic->fused != FUSED_NONE) goto op_call; \
+    goto *dispatch[ic->opcode]; }
+
+#define NEXT { \
+    CHECK_SOUND \
+    if (tick) tick (); \
+    if (finished != 0) goto done; \
+    DISPATCH }
+
+#define OPERANDS { \
+    int i; \
+    argc = ic->argc; \
+    for (i = 0; i < argc; i++) \
+	args[i] = (ic->variables & (1 << i)) ? \
+	    load_variable ((zbyte) ic->args[i]) : ic->args[i]; }
+
+#define OPERAND(n) \
+    args[n] = (ic->variables & (1 << n)) ? \
+	load_variable ((zbyte) ic->args[n]) : ic->args[n];
+
+#define OPERANDS_1 { OPERAND (0) }
+#define OPERANDS_2 { OPERAND (0) OPERAND (1) }
+
+#define STORE(value) { \
+    zword v = (value); \
+    zbyte variable; \
+    CODE_BYTE (variable) \
+    if (variable == 0) \
+	*--sp = v; \
+    else if (variable < 16) \
+	*(fp - variable) = v; \
+    else { \
+	zword addr = h_globals + 2 * (variable - 16); \
+	SET_WORD (addr, v) \
+    } }
+
+#define BRANCH(flag) { \
+    bool f = (flag); \
+    if (pcp == ic->branch_at && ic->branch_offset > 1) { \
+	pcp += ic->branch_len; \
+	if (((ic->branch_specifier & 0x80) != 0) == (f != 0)) \
+	    pcp += (short) ic->branch_offset - 2; \
+    } else branch (f); }
+
+void interpret (void)
+{
+    static void *const dispatch[0x100] = {
+	OP_2OP_LABELS,				/* 0x00 - 0x7f */
+	OP_2OP_LABELS,
+	OP_2OP_LABELS,
+	OP_2OP_LABELS,
+	OP_1OP_LABELS,				/* 0x80 - 0xaf */
+	OP_1OP_LABELS,
+	OP_1OP_LABELS,
+	OP_16_CALLS,				/* 0xb0 - 0xbf */
+	OP_2OP_LABELS,				/* 0xc0 - 0xdf */
+	OP_16_CALLS,				/* 0xe0 - 0xff */
+	OP_16_CALLS
+    };
+
+    icache_t scratch;
+    icache_t *ic;
+    zword args[8];
+    int argc;
+
+    BACKEND_TICK
+
+    DISPATCH
+
+op_call:
+
+    zargc = load_cached_operands (ic, zargs);
+    ic->handler ();
+    NEXT
+
+op_je:
+
+    OPERANDS
+    BRANCH (
+	argc > 1 && (args[0] == args[1] || (
+	argc > 2 && (args[0] == args[2] || (
+	argc > 3 && (args[0] == args[3]))))));
+    NEXT
+
+op_jl:
+
+    OPERANDS_2
+    BRANCH ((short) args[0] < (short) args[1]);
+    NEXT
+
+op_jg:
+
+    OPERANDS_2
+    BRANCH ((short) args[0] > (short) args[1]);
+    NEXT
+
+op_jz:
+
+    OPERANDS_1
+    BRANCH ((short) args[0] == 0);
+    NEXT
+
+op_dec_chk:
+
+    OPERANDS_2
+    {
+	zword value;
+
+	if (args[0] == 0)
+	    value = --(*sp);
+	else if (args[0] < 16)
+	    value = --(*(fp - args[0]));
+	else {
+	    zword addr = h_globals + 2 * (args[0] - 16);
+	    LOW_WORD (addr, value)
+	    value--;
+	    SET_WORD (addr, value)
+	}
+
+	BRANCH ((short) value < (short) args[1]);
+    }
+    NEXT
+
+op_inc_chk:
+
+    OPERANDS_2
+    {
+	zword value;
+
+	if (args[0] == 0)
+	    value = ++(*sp);
+	else if (args[0] < 16)
+	    value = ++(*(fp - args[0]));
+	else {
+	    zword addr = h_globals + 2 * (args[0] - 16);
+	    LOW_WORD (addr, value)
+	    value++;
+	    SET_WORD (addr, value)
+	}
+
+	BRANCH ((short) value > (short) args[1]);
+    }
+    NEXT
+
+op_test:
+
+    OPERANDS_2
+    BRANCH ((args[0] & args[1]) == args[1]);
+    NEXT
+
+op_or:
+
+    OPERANDS_2
+    STORE ((zword) (args[0] | args[1]));
+    NEXT
+
+op_and:
+
+    OPERANDS_2
+    STORE ((zword) (args[0] & args[1]));
+    NEXT
+
+op_add:
+
+    OPERANDS_2
+    STORE ((zword) ((short) args[0] + (short) args[1]));
+    NEXT
+
+op_sub:
+
+    OPERANDS_2
+    STORE ((zword) ((short) args[0] - (short) args[1]));
+    NEXT
+
+op_store:
+
+    OPERANDS_2
+    store_variable ((zbyte) args[0], args[1]);
+    NEXT
+
+op_load:
+
+    OPERANDS_1
+    {
+	zword value;
+
+	if (args[0] == 0)
+	    value = *sp;
+	else if (args[0] < 16)
+	    value = *(fp - args[0]);
+	else {
+	    zword addr = h_globals + 2 * (args[0] - 16);
+	    LOW_WORD (addr, value)
+	}
+
+	STORE (value);
+    }
+    NEXT
+
+op_loadw:
+
+    OPERANDS_2
+    {
+	zword addr = args[0] + 2 * args[1];
+	zword value;
+
+	LOW_WORD (addr, value)
+
+	STORE (value);
+    }
+    NEXT
+
+op_loadb:
+
+    OPERANDS_2
+    {
+	zword addr = args[0] + args[1];
+	zbyte value;
+
+	LOW_BYTE (addr, value)
+
+	STORE (value);
+    }
+    NEXT
+
+op_jump:
+
+    OPERANDS_1
+    {
+	long pc;
+
+	GET_PC (pc)
+
+	pc += (short) args[0] - 2;
+
+	if (pc >= story_size)
+	    runtime_error (ERR_ILL_JUMP_ADDR);
+
+	SET_PC (pc)
+    }
+    NEXT
+
+done:
+
+    finished--;
+
+}/* interpret */
+
+#else
+
 /*
  * interpret
  *
@@ -256,15 +1173,48 @@ static void load_all_operands (zbyte specifier)
 
 void interpret (void)
 {
+    BACKEND_TICK
 
     do {
 
 	zbyte opcode;
+	long pc;
+	icache_t *ic;
 
-	CODE_BYTE (opcode)
+	GET_PC (pc)
+
+	ic = icache + (pc & (ICACHE_SIZE - 1));
+
+	if (ic->pc == pcp) {			/* cached instruction */
+
+	    zargc = load_cached_operands (ic, zargs);
+	    pcp = ic->tail;
+
+	    curr_insn = ic;
+	    ic->handler ();
+
+	    goto next;
+
+	}
+
+	if (pc >= h_dynamic_size) {		/* cacheable instruction */
+
+	    decode_instruction (ic);
+	    zargc = load_cached_operands (ic, zargs);
+
+	    curr_insn = ic;
+	    ic->handler ();
+
+	    goto next;
+
+	}
+
+	curr_insn = NULL;
 
 	zargc = 0;
 
+	CODE_BYTE (opcode)
+
 	if (opcode < 0x80) {			/* 2OP opcodes */
 
 	    load_operand ((zbyte) (opcode & 0x40) ? 2 : 1);
@@ -301,12 +1251,14 @@ void interpret (void)
 
 	}
 
+    next:
+
 #if defined(DJGPP) && defined(SOUND_SUPPORT)
 	if (end_of_sound_flag)
 	    end_of_sound ();
 #endif
 
-	os_tick ();
+	if (tick) tick ();
 
     } while (finished == 0);
 
@@ -314,6 +1266,51 @@ void interpret (void)
 
 }/* interpret */
 
+#endif /* THREADED_DISPATCH */
+
+/*
+ * decode_routine
+ *
+ * Decode the header of a routine into a routine cache entry. Returns
+ * NULL, leaving the work to call (), if the routine lies in dynamic
+ * memory or its header is invalid.
+ *
+ */
+
+static routine_t *decode_routine (zword routine, routine_t *rc)
+{
+    long pc;
+    zbyte *p;
+    int i;
+
+    pc = ((long) routine << packed_shift) + routine_offset;
+
+    if (pc < h_dynamic_size || pc >= story_size)
+	return NULL;
+
+    p = zmp + pc;
+
+    if (*p > 15 || p + 1 + 2 * *p > zmp + story_size)
+	return NULL;
+
+    rc->routine = routine;
+    rc->pc = pc;
+    rc->count = *p++;
+
+    /* V1 to V4 games provide default values for all local variables */
+
+    for (i = 0; i < rc->count; i++)
+	if (h_version <= V4) {
+	    rc->defaults[i] = (p[0] << 8) | p[1];
+	    p += 2;
+	} else rc->defaults[i] = 0;
+
+    rc->start = p;
+
+    return rc;
+
+}/* decode_routine */
+
 /*
  * call
  *
@@ -326,6 +1323,7 @@ void interpret (void)
 
 void call (zword routine, int argc, zword *args, int ct)
 {
+    routine_t *rc;
     long pc;
     zword value;
     zbyte count;
@@ -344,16 +1342,38 @@ void call (zword routine, int argc, zword *args, int ct)
     fp = sp;
     frame_count++;
 
+    /* Use the cached routine header if there is one */
+
+    rc = routine_cache + (routine & (ROUTINE_CACHE_SIZE - 1));
+
+    if (rc->start != NULL && rc->routine == routine) {
+	routine_hits++;
+    } else {
+	routine_misses++;
+	rc = decode_routine (routine, rc);
+    }
+
+    if (rc != NULL) {
+
+	pcp = rc->start;
+	count = rc->count;
+
+	if (sp - stack < count)
+	    runtime_error (ERR_STK_OVF);
+
+	if (option_save_quetzal)
+	    fp[0] |= (zword) count << 8;
+
+	for (i = 0; i < count; i++)
+	    *--sp = (zword) ((argc-- > 0) ? args[i] : rc->defaults[i]);
+
+	goto started;
+
+    }
+
     /* Calculate byte address of routine */
 
-    if (h_version <= V3)
-	pc = (long) routine << 1;
-    else if (h_version <= V5)
-	pc = (long) routine << 2;
-    else if (h_version <= V7)
-	pc = ((long) routine << 2) + ((long) h_functions_offset << 3);
-    else /* (h_version == V8) */
-	pc = (long) routine << 3;
+    pc = ((long) routine << packed_shift) + routine_offset;
 
     if (pc >= story_size)
 	runtime_error (ERR_ILL_CALL_ADDR);
@@ -383,6 +1403,8 @@ void call (zword routine, int argc, zword *args, int ct)
 
     }
 
+started:
+
     /* Start main loop for direct calls */
 
     if (ct == 2)
@@ -449,39 +1471,41 @@ void ret (zword value)
 
 void branch (bool flag)
 {
+    icache_t scratch;
+    icache_t *ic = curr_insn;
     long pc;
-    zword offset;
     zbyte specifier;
-    zbyte off1;
-    zbyte off2;
 
-    CODE_BYTE (specifier)
+    if (ic == NULL || pcp != ic->branch_at) {
 
-    off1 = specifier & 0x3f;
+	/* Decode the branch data, remembering it if it follows the
+	   operands (or the store variable) of the cached instruction
+	   being executed */
 
-    if (!flag)
-	specifier ^= 0x80;
+	if (ic == NULL || ic->branch_at != NULL
+	    || (pcp != ic->tail && pcp != ic->tail + 1))
+	    ic = &scratch;
 
-    if (!(specifier & 0x40)) {		/* it's a long branch */
+	decode_branch (ic, pcp);
 
-	if (off1 & 0x20)		/* propagate sign bit */
-	    off1 |= 0xc0;
+    }
 
-	CODE_BYTE (off2)
+    pcp += ic->branch_len;
 
-	offset = (off1 << 8) | off2;
+    specifier = ic->branch_specifier;
 
-    } else offset = off1;		/* it's a short branch */
+    if (!flag)
+	specifier ^= 0x80;
 
     if (specifier & 0x80) {
 
-	if (offset > 1) {		/* normal branch */
+	if (ic->branch_offset > 1) {	/* normal branch */
 
 	    GET_PC (pc)
-	    pc += (short) offset - 2;
+	    pc += (short) ic->branch_offset - 2;
 	    SET_PC (pc)
 
-	} else ret (offset);		/* special case, return 0 or 1 */
+	} else ret (ic->branch_offset);	/* special case, return 0 or 1 */
     }
 
 }/* branch */
@@ -738,6 +1762,8 @@ void z_nop (void)
 void z_quit (void)
 {
 
+    clear_autosave ();
+
     finished = 9999;
 
 }/* z_quit */
@@ -20,6 +20,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#define ZCONTEXT_STACK_ALIASES
 #include "frotz.h"
 
 #ifdef MSDOS_16BIT
@@ -45,17 +46,42 @@
 
 #endif
 
-#define get_c fgetc
-#define put_c fputc
+/*
+ * Saves are written on a thread of their own where there are POSIX
+ * threads; elsewhere save_quetzal waits for the file to be written.
+ */
+
+#if !defined (MSDOS_16BIT) && !defined (WIN32)
+#define ASYNC_SAVE
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
 
 typedef unsigned long zlong;
 
 /*
- * This is used only by save_quetzal. It probably should be allocated
- * dynamically rather than statically.
+ * This is used only by save_quetzal.
+ */
+
+#define quetzal_frames (zctx->quetzal_frames)
+
+/*
+ * Dynamic memory as loaded, which `CMem' chunks are relative to.
  */
 
-static zword frames[STACK_SIZE/4+1];
+#define story_dynamic (zctx->story_dynamic)
+
+/*
+ * A checkpoint is taken while a line is being read, and has an `IntD'
+ * chunk of ours giving the arguments of the read, so that it can be
+ * carried on with after a restore.
+ */
+
+#define checkpoint_read (zctx->checkpoint_read)
+#define checkpoint_args (zctx->checkpoint_args)
+
+#define CHECKPOINT_INTD (12 + 2 * 5)	/* its length */
 
 /*
  * ID types.
@@ -70,424 +96,677 @@ static zword frames[STACK_SIZE/4+1];
 #define ID_CMem makeid ('C','M','e','m')
 #define ID_Stks makeid ('S','t','k','s')
 #define ID_ANNO makeid ('A','N','N','O')
+#define ID_IntD makeid ('I','n','t','D')
+#define ID_GRTZ makeid ('G','R','T','Z')	/* our interpreter ID */
 
 /*
- * Various parsing states within restoration.
+ * Macros used to put the files together in memory, advancing `p'.
  */
 
-#define GOT_HEADER	0x01
-#define GOT_STACK	0x02
-#define GOT_MEMORY	0x04
-#define GOT_NONE	0x00
-#define GOT_ALL		0x07
-#define GOT_ERROR	0x80
+#define put_bytx(p,b) (*(p)++ = (zbyte) ((b) & 0xFF))
+#define put_word(p,w) \
+    (put_bytx (p, (w) >>  8), put_bytx (p, (w)))
+#define put_long(p,l) \
+    (put_bytx (p, (l) >> 24), put_bytx (p, (l) >> 16), \
+     put_bytx (p, (l) >>  8), put_bytx (p, (l)))
+#define put_chnk(p,id,len) \
+    (put_long (p, (id)), put_long (p, (len)))
+#define put_run(p,run) \
+    (*(p)++ = 0, put_bytx (p, (run)))
 
 /*
- * Macros used to write the files.
+ * A save on its way to disk. Everything save_quetzal needs from the
+ * Z-machine is copied into it, so it can be written on another thread.
  */
 
-#define write_byte(fp,b) (put_c (b, fp) != EOF)
-#define write_bytx(fp,b) write_byte (fp, (b) & 0xFF)
-#define write_word(fp,w) \
-    (write_bytx (fp, (w) >>  8) && write_bytx (fp, (w)))
-#define write_long(fp,l) \
-    (write_bytx (fp, (l) >> 24) && write_bytx (fp, (l) >> 16) && \
-     write_bytx (fp, (l) >>  8) && write_bytx (fp, (l)))
-#define write_chnk(fp,id,len) \
-    (write_long (fp, (id))      && write_long (fp, (len)))
-#define write_run(fp,run) \
-    (write_byte (fp, 0)         && write_byte (fp, (run)))
-
-/* Read one word from file; return TRUE if OK. */
-static bool read_word (FILE *f, zword *result)
+typedef struct save_job {
+    FILE *svf;
+    zbyte ifhd[14];		/* `IFhd' chunk body, with pad */
+    zbyte *memory;		/* dynamic memory */
+    const zbyte *original;	/* dynamic memory as loaded */
+    long dynamic_size;
+    zbyte *stks;		/* `Stks' chunk body */
+    long stks_size;
+    bool checkpoint;		/* for a checkpoint: */
+    zword args[5];		/* the read's zargc and zargs */
+    char temp_name[MAX_FILE_NAME + 1];	/* being written to, */
+    char name[MAX_FILE_NAME + 1];	/* and renamed to when done, */
+    char old_name[MAX_FILE_NAME + 1];	/* retiring this one, if any */
+    int result;			/* -1 while being written */
+#ifdef ASYNC_SAVE
+    pthread_t thread;
+    pthread_mutex_t lock;
+#endif
+} save_job_t;
+
+#define save_job (zctx->save_job)
+
+/*
+ * Macros used to read the files, once they're in memory.
+ */
+
+#define get_word(p) ((zword) (((p)[0] << 8) | (p)[1]))
+#define get_long(p) \
+    (((zlong) (p)[0] << 24) | ((zlong) (p)[1] << 16) | \
+     ((zlong) (p)[2] <<  8) |  (zlong) (p)[3])
+
+/*
+ * Check a `CMem' chunk: return the number of bytes of dynamic memory it
+ * describes, or -1 if it ends in the middle of a run.
+ */
+
+static long cmem_length (const zbyte *p, zlong len)
 {
-    int a, b;
+    const zbyte *end = p + len;
+    long n = 0;
 
-    if ((a = get_c (f)) == EOF) return FALSE;
-    if ((b = get_c (f)) == EOF) return FALSE;
+    while (p < end)
+    {
+	if (*p == 0)	/* A run... */
+	{
+	    if (end - p < 2)
+		return -1;
+	    n += p[1] + 1;
+	    p += 2;
+	}
+	else		/* ...or a changed byte. */
+	{
+	    ++n;
+	    ++p;
+	}
+    }
+    return n;
+}
 
-    *result = ((zword) a << 8) | (zword) b;
-    return TRUE;
+/*
+ * Uncompress a `CMem' chunk that cmem_length has passed into dynamic
+ * memory. Runs are copied from memory as loaded, and the changed bytes
+ * between them are done together.
+ */
+
+static void cmem_decode (const zbyte *p, zlong len)
+{
+    const zbyte *end = p + len, *q;
+    long i = 0, n;
+
+    while (p < end && i < h_dynamic_size)
+    {
+	if (*p == 0)
+	{
+	    n = p[1] + 1;
+	    p += 2;
+	    if (n > h_dynamic_size - i)
+		n = h_dynamic_size - i;
+	    memcpy (zmp + i, story_dynamic + i, n);
+	}
+	else
+	{
+	    if ((q = memchr (p, 0, end - p)) == NULL)
+		q = end;
+	    n = q - p;
+	    if (n > h_dynamic_size - i)
+		n = h_dynamic_size - i;
+	    for (q = p + n; p < q; ++i, ++p)
+		zmp[i] = *p ^ story_dynamic[i];
+	    continue;
+	}
+	i += n;
+    }
+
+    /* If chunk is short, assume a run. */
+    if (i < h_dynamic_size)
+	memcpy (zmp + i, story_dynamic + i, h_dynamic_size - i);
 }
 
-/* Read one long from file; return TRUE if OK. */
-static bool read_long (FILE *f, zlong *result)
+/*
+ * Rebuild the stacks from a `Stks' chunk in `new_stack', leaving the
+ * real ones alone. Return FALSE if it can't be done.
+ */
+
+static bool stks_decode (const zbyte *p, zlong currlen, zword *new_stack,
+			 zword **new_sp, zword **new_fp, zword *new_frames)
 {
-    int a, b, c, d;
+    zword *sp_ = new_stack + STACK_SIZE, *fp_;
+    zlong tmpl;
+    zword i, tmpw, count;
+    int x, y;
 
-    if ((a = get_c (f)) == EOF) return FALSE;
-    if ((b = get_c (f)) == EOF) return FALSE;
-    if ((c = get_c (f)) == EOF) return FALSE;
-    if ((d = get_c (f)) == EOF) return FALSE;
+    /*
+     * All versions other than V6 may use evaluation stack outside
+     * any function context. As a result a faked function context
+     * will be present in the file here. We skip this context, but
+     * load the associated stack onto the stack proper...
+     */
+    if (h_version != V6)
+    {
+	if (currlen < 8)					return FALSE;
+	for (i=0; i<6; ++i)
+	    if (*p++ != 0)					return FALSE;
+	tmpw = get_word (p);
+	p += 2;
+	if (tmpw > STACK_SIZE)
+	{
+	    print_string ("Save-file has too much stack (and I can't cope).\n");
+	    return FALSE;
+	}
+	currlen -= 8;
+	if (currlen < tmpw*2)					return FALSE;
+	for (i=0; i<tmpw; ++i, p += 2)
+	    *--sp_ = get_word (p);
+	currlen -= tmpw*2;
+    }
+
+    /* We now proceed to load the main block of stack frames. */
+    for (fp_ = new_stack+STACK_SIZE, count = 0;
+	 currlen > 0;
+	 ++count)
+    {
+	if (currlen < 8)					return FALSE;
+	if (sp_ - new_stack < 4)	/* No space for frame. */
+	{
+	    print_string ("Save-file has too much stack (and I can't cope).\n");
+	    return FALSE;
+	}
+
+	/* Read PC, procedure flag and formal param count. */
+	tmpl = get_long (p);
+	y = (int) (tmpl & 0x0F);	/* Number of formals. */
+	tmpw = y << 8;
+
+	/* Read result variable. */
+	x = p[4];
+
+	/* Check the procedure flag... */
+	if (tmpl & 0x10)
+	{
+	    tmpw |= 0x1000;	/* It's a procedure. */
+	    tmpl >>= 8;		/* Shift to get PC value. */
+	}
+	else
+	{
+	    /* Functions have type 0, so no need to or anything. */
+	    tmpl >>= 8;		/* Shift to get PC value. */
+	    --tmpl;		/* Point at result byte. */
+	    /*
+	     * Sanity check on result variable... which can only be done
+	     * here, before memory is restored, if it isn't in dynamic
+	     * memory.
+	     */
+	    if (tmpl >= story_size
+		|| (tmpl >= h_dynamic_size && zmp[tmpl] != (zbyte) x))
+	    {
+		print_string ("Save-file has wrong variable number on stack (possibly wrong game version?)\n");
+		return FALSE;
+	    }
+	}
+	*--sp_ = (zword) (tmpl >> 9);		/* High part of PC */
+	*--sp_ = (zword) (tmpl & 0x1FF);	/* Low part of PC */
+	*--sp_ = (zword) (fp_ - new_stack - 1);	/* FP */
+
+	/* Read and process argument mask. */
+	x = p[5] + 1;	/* Should now be a power of 2 */
+	for (i=0; i<8; ++i)
+	    if (x & (1<<i))
+		break;
+	if (x ^ (1<<i))	/* Not a power of 2 */
+	{
+	    print_string ("Save-file uses incomplete argument lists (which I can't handle)\n");
+	    return FALSE;
+	}
+	*--sp_ = tmpw | i;
+	fp_ = sp_;	/* FP for next frame. */
+
+	/* Read amount of eval stack used. */
+	tmpw = get_word (p + 6);
+	p += 8;
+	currlen -= 8;
+
+	tmpw += y;	/* Amount of stack + number of locals. */
+	if (sp_ - new_stack <= tmpw)
+	{
+	    print_string ("Save-file has too much stack (and I can't cope).\n");
+	    return FALSE;
+	}
+	if (currlen < tmpw*2)					return FALSE;
+	for (i=0; i<tmpw; ++i, p += 2)
+	    *--sp_ = get_word (p);
+	currlen -= tmpw*2;
+    }
 
-    *result = ((zlong) a << 24) | ((zlong) b << 16) |
-	      ((zlong) c <<  8) |  (zlong) d;
+    *new_sp = sp_;
+    *new_fp = fp_;
+    *new_frames = count;
     return TRUE;
 }
 
 /*
- * Restore a saved game using Quetzal format. Return 2 if OK, 0 if an error
- * occurred before any damage was done, -1 on a fatal error.
+ * Restore a saved game held in memory. Every chunk is found and checked
+ * before anything is changed, so nothing is damaged if this fails.
+ * The stacks are rebuilt in `new_stack' meanwhile.
  */
 
-zword restore_quetzal (FILE *svf, FILE *stf)
+static zword restore_image (const zbyte *buf, zlong size, zword *new_stack)
 {
-    zlong ifzslen, currlen, tmpl;
+    zword *new_sp, *new_fp, new_frames;
+    const zbyte *p, *end, *body;
+    const zbyte *ifhd = NULL, *stks = NULL, *cmem = NULL, *umem = NULL;
+    const zbyte *intd = NULL;
+    zlong ifzslen, currlen, stkslen = 0, cmemlen = 0, id;
     zlong pc;
-    zword i, tmpw;
-    zword fatal = 0;	/* Set to -1 when errors must be fatal. */
-    zbyte skip, progress = GOT_NONE;
-    int x, y;
+    zword i;
+    long n;
 
     /* Check it's really an `IFZS' file. */
-    if (!read_long (svf, &tmpl)
-	|| !read_long (svf, &ifzslen)
-	|| !read_long (svf, &currlen))				return 0;
-    if (tmpl != ID_FORM || currlen != ID_IFZS)
+    if (size < 12 || get_long (buf) != ID_FORM || get_long (buf + 8) != ID_IFZS)
     {
 	print_string ("This is not a saved game file!\n");
 	return 0;
     }
-    if ((ifzslen & 1) || ifzslen<4) /* Sanity checks. */	return 0;
-    ifzslen -= 4;
+    ifzslen = get_long (buf + 4);
+    if ((ifzslen & 1) || ifzslen<4 || ifzslen > size-8) /* Sanity checks. */
+	return 0;
 
-    /* Read each chunk and process it. */
-    while (ifzslen > 0)
+    /* Find each chunk, making sure it's all there. */
+    for (p = buf + 12, end = buf + 8 + ifzslen; p < end;
+	 p = body + currlen + (currlen & 1))
     {
-	/* Read chunk header. */
-	if (ifzslen < 8) /* Couldn't contain a chunk. */	return 0;
-	if (!read_long (svf, &tmpl)
-	    || !read_long (svf, &currlen))			return 0;
-	ifzslen -= 8;	/* Reduce remaining by size of header. */
-
-	/* Handle chunk body. */
-	if (ifzslen < currlen) /* Chunk goes past EOF?! */	return 0;
-	skip = currlen & 1;
-	ifzslen -= currlen + (zlong) skip;
-
-	switch (tmpl)
+	if (end - p < 8) /* Couldn't contain a chunk. */	return 0;
+	id = get_long (p);
+	currlen = get_long (p + 4);
+	body = p + 8;
+	if (currlen + (currlen & 1) > (zlong) (end - body))
+	    return 0;	/* Chunk goes past EOF?! */
+
+	switch (id)
 	{
-	    /* `IFhd' header chunk; must be first in file. */
+	    /* `IFhd' header chunk. */
 	    case ID_IFhd:
-		if (progress & GOT_HEADER)
+		if (ifhd != NULL)
 		{
 		    print_string ("Save file has two IFZS chunks!\n");
-		    return fatal;
+		    return 0;
 		}
-		progress |= GOT_HEADER;
-		if (currlen < 13
-		    || !read_word (svf, &tmpw))			return fatal;
-		if (tmpw != h_release)
-		    progress = GOT_ERROR;
-
-		for (i=H_SERIAL; i<H_SERIAL+6; ++i)
-		{
-		    if ((x = get_c (svf)) == EOF)		return fatal;
-		    if (x != zmp[i])
-			progress = GOT_ERROR;
-		}
-
-		if (!read_word (svf, &tmpw))			return fatal;
-		if (tmpw != h_checksum)
-		    progress = GOT_ERROR;
-
-		if (progress & GOT_ERROR)
-		{
-		    print_string ("File was not saved from this story!\n");
-		    return fatal;
-		}
-		if ((x = get_c (svf)) == EOF)			return fatal;
-		pc = (zlong) x << 16;
-		if ((x = get_c (svf)) == EOF)			return fatal;
-		pc |= (zlong) x << 8;
-		if ((x = get_c (svf)) == EOF)			return fatal;
-		pc |= (zlong) x;
-		fatal = -1;	/* Setting PC means errors must be fatal. */
-		SET_PC (pc);
-
-		for (i=13; i<currlen; ++i)
-		    (void) get_c (svf);	/* Skip rest of chunk. */
+		if (currlen < 13)				return 0;
+		ifhd = body;
 		break;
-	    /* `Stks' stacks chunk; restoring this is quite complex. ;) */
+	    /* `Stks' stacks chunk. */
 	    case ID_Stks:
-		if (progress & GOT_STACK)
+		if (stks != NULL)
 		{
 		    print_string ("File contains two stack chunks!\n");
 		    break;
 		}
-		progress |= GOT_STACK;
-
-		fatal = -1;	/* Setting SP means errors must be fatal. */
-		sp = stack + STACK_SIZE;
-
-		/*
-		 * All versions other than V6 may use evaluation stack outside
-		 * any function context. As a result a faked function context
-		 * will be present in the file here. We skip this context, but
-		 * load the associated stack onto the stack proper...
-		 */
-		if (h_version != V6)
-		{
-		    if (currlen < 8)				return fatal;
-		    for (i=0; i<6; ++i)
-			if (get_c (svf) != 0)			return fatal;
-		    if (!read_word (svf, &tmpw))		return fatal;
-		    if (tmpw > STACK_SIZE)
-		    {
-			print_string ("Save-file has too much stack (and I can't cope).\n");
-			return fatal;
-		    }
-		    currlen -= 8;
-		    if (currlen < tmpw*2)			return fatal;
-		    for (i=0; i<tmpw; ++i)
-			if (!read_word (svf, --sp))		return fatal;
-		    currlen -= tmpw*2;
-		}
-
-		/* We now proceed to load the main block of stack frames. */
-		for (fp = stack+STACK_SIZE, frame_count = 0;
-		     currlen > 0;
-		     currlen -= 8, ++frame_count)
-		{
-		    if (currlen < 8)				return fatal;
-		    if (sp - stack < 4)	/* No space for frame. */
-		    {
-			print_string ("Save-file has too much stack (and I can't cope).\n");
-			return fatal;
-		    }
-
-		    /* Read PC, procedure flag and formal param count. */
-		    if (!read_long (svf, &tmpl))		return fatal;
-		    y = (int) (tmpl & 0x0F);	/* Number of formals. */
-		    tmpw = y << 8;
-
-		    /* Read result variable. */
-		    if ((x = get_c (svf)) == EOF)		return fatal;
-
-		    /* Check the procedure flag... */
-		    if (tmpl & 0x10)
-		    {
-			tmpw |= 0x1000;	/* It's a procedure. */
-			tmpl >>= 8;	/* Shift to get PC value. */
-		    }
-		    else
-		    {
-			/* Functions have type 0, so no need to or anything. */
-			tmpl >>= 8;	/* Shift to get PC value. */
-			--tmpl;		/* Point at result byte. */
-			/* Sanity check on result variable... */
-			if (zmp[tmpl] != (zbyte) x)
-			{
-			    print_string ("Save-file has wrong variable number on stack (possibly wrong game version?)\n");
-			    return fatal;
-			}
-		    }
-		    *--sp = (zword) (tmpl >> 9);	/* High part of PC */
-		    *--sp = (zword) (tmpl & 0x1FF);	/* Low part of PC */
-		    *--sp = (zword) (fp - stack - 1);	/* FP */
-
-		    /* Read and process argument mask. */
-		    if ((x = get_c (svf)) == EOF)		return fatal;
-		    ++x;	/* Should now be a power of 2 */
-		    for (i=0; i<8; ++i)
-			if (x & (1<<i))
-			    break;
-		    if (x ^ (1<<i))	/* Not a power of 2 */
-		    {
-			print_string ("Save-file uses incomplete argument lists (which I can't handle)\n");
-			return fatal;
-		    }
-		    *--sp = tmpw | i;
-		    fp = sp;	/* FP for next frame. */
-
-		    /* Read amount of eval stack used. */
-		    if (!read_word (svf, &tmpw))		return fatal;
-
-		    tmpw += y;	/* Amount of stack + number of locals. */
-		    if (sp - stack <= tmpw)
-		    {
-			print_string ("Save-file has too much stack (and I can't cope).\n");
-			return fatal;
-		    }
-		    if (currlen < tmpw*2)			return fatal;
-		    for (i=0; i<tmpw; ++i)
-			if (!read_word (svf, --sp))		return fatal;
-		    currlen -= tmpw*2;
-		}
-		/* End of `Stks' processing... */
+		stks = body;
+		stkslen = currlen;
 		break;
-	    /* Any more special chunk types must go in HERE or ABOVE. */
-	    /* `CMem' compressed memory chunk; uncompress it. */
+	    /* `CMem' compressed memory chunk; the first good one wins. */
 	    case ID_CMem:
-		if (!(progress & GOT_MEMORY))	/* Don't complain if two. */
-		{
-		    (void) fseek (stf, 0, SEEK_SET);
-		    i=0;	/* Bytes written to data area. */
-		    for (; currlen > 0; --currlen)
-		    {
-			if ((x = get_c (svf)) == EOF)		return fatal;
-			if (x == 0)	/* Start run. */
-			{
-			    /* Check for bogus run. */
-			    if (currlen < 2)
-			    {
-				print_string ("File contains bogus `CMem' chunk.\n");
-				for (; currlen > 0; --currlen)
-				    (void) get_c (svf);	/* Skip rest. */
-				currlen = 1;
-				i = 0xFFFF;
-				break; /* Keep going; may be a `UMem' too. */
-			    }
-			    /* Copy story file to memory during the run. */
-			    --currlen;
-			    if ((x = get_c (svf)) == EOF)	return fatal;
-			    for (; x >= 0 && i<h_dynamic_size; --x, ++i)
-				if ((y = get_c (stf)) == EOF)	return fatal;
-				else
-				    zmp[i] = (zbyte) y;
-			}
-			else	/* Not a run. */
-			{
-			    if ((y = get_c (stf)) == EOF)	return fatal;
-			    zmp[i] = (zbyte) (x ^ y);
-			    ++i;
-			}
-			/* Make sure we don't load too much. */
-			if (i > h_dynamic_size)
-			{
-			    print_string ("warning: `CMem' chunk too long!\n");
-			    for (; currlen > 1; --currlen)
-				(void) get_c (svf);	/* Skip rest. */
-			    break;	/* Keep going; there may be a `UMem' too. */
-			}
-		    }
-		    /* If chunk is short, assume a run. */
-		    for (; i<h_dynamic_size; ++i)
-			if ((y = get_c (stf)) == EOF)		return fatal;
-			else
-			    zmp[i] = (zbyte) y;
-		    if (currlen == 0)
-			progress |= GOT_MEMORY;	/* Only if succeeded. */
+		if (cmem != NULL || umem != NULL)	/* Don't complain if two. */
 		    break;
-	    }
-		/* Fall right thru (to default) if already GOT_MEMORY */
-	    /* `UMem' uncompressed memory chunk; load it. */
-	    case ID_UMem:
-		if (!(progress & GOT_MEMORY))	/* Don't complain if two. */
+		if ((n = cmem_length (body, currlen)) < 0)
 		{
-		    /* Must be exactly the right size. */
-		    if (currlen == h_dynamic_size)
-		    {
-			if (fread (zmp, currlen, 1, svf) == 1)
-			{
-			    progress |= GOT_MEMORY;	/* Only on success. */
-			    break;
-			}
-		    }
-		    else
-			print_string ("`UMem' chunk wrong size!\n");
-		    /* Fall into default action (skip chunk) on errors. */
+		    print_string ("File contains bogus `CMem' chunk.\n");
+		    break; /* Keep going; may be a `UMem' too. */
 		}
-		/* Fall thru (to default) if already GOT_MEMORY */
+		if (n > h_dynamic_size)
+		    print_string ("warning: `CMem' chunk too long!\n");
+		cmem = body;
+		cmemlen = currlen;
+		break;
+	    /* `UMem' uncompressed memory chunk. */
+	    case ID_UMem:
+		if (cmem != NULL || umem != NULL)	/* Don't complain if two. */
+		    break;
+		/* Must be exactly the right size. */
+		if (currlen == h_dynamic_size)
+		    umem = body;
+		else
+		    print_string ("`UMem' chunk wrong size!\n");
+		break;
+	    /* `IntD' chunk, which we only understand if it's ours. */
+	    case ID_IntD:
+		if (currlen == CHECKPOINT_INTD && get_long (body + 8) == ID_GRTZ)
+		    intd = body;
+		break;
 	    /* Unrecognised chunk type; skip it. */
 	    default:
-		(void) fseek (svf, currlen, SEEK_CUR);	/* Skip chunk. */
 		break;
 	}
-	if (skip)
-	    (void) get_c (svf);	/* Skip pad byte. */
     }
 
     /*
-     * We've reached the end of the file. For the restoration to have been a
-     * success, we must have had one of each of the required chunks.
+     * We've reached the end of the file. For the restoration to succeed,
+     * we must have had one of each of the required chunks.
      */
-    if (!(progress & GOT_HEADER))
+    if (ifhd == NULL)
 	print_string ("error: no valid header (`IFhd') chunk in file.\n");
-    if (!(progress & GOT_STACK))
+    if (stks == NULL)
 	print_string ("error: no valid stack (`Stks') chunk in file.\n");
-    if (!(progress & GOT_MEMORY))
+    if (cmem == NULL && umem == NULL)
 	print_string ("error: no valid memory (`CMem' or `UMem') chunk in file.\n");
+    if (ifhd == NULL || stks == NULL || (cmem == NULL && umem == NULL))
+	return 0;
+
+    /* Is it this story? */
+    if (get_word (ifhd) != h_release
+	|| memcmp (ifhd + 2, zmp + H_SERIAL, 6) != 0
+	|| get_word (ifhd + 8) != h_checksum)
+    {
+	print_string ("File was not saved from this story!\n");
+	return 0;
+    }
+    pc = ((zlong) ifhd[10] << 16) | ((zlong) ifhd[11] << 8) | ifhd[12];
+    if (pc >= story_size)
+	return 0;
+
+    if (!stks_decode (stks, stkslen, new_stack, &new_sp, &new_fp, &new_frames))
+	return 0;
+
+    /* Now it's safe to change the Z-machine. */
+    SET_PC (pc);
+
+    memcpy (stack + (new_sp - new_stack), new_sp,
+	    (new_stack + STACK_SIZE - new_sp) * sizeof (zword));
+    sp = stack + (new_sp - new_stack);
+    fp = stack + (new_fp - new_stack);
+    frame_count = new_frames;
+
+    if (cmem != NULL)
+	cmem_decode (cmem, cmemlen);
+    else
+	memcpy (zmp, umem, h_dynamic_size);
 
-    return (progress == GOT_ALL ? 2 : fatal);
+    if (intd != NULL)
+    {
+	for (i=0; i<5; ++i)
+	    checkpoint_args[i] = get_word (intd + 12 + 2*i);
+	checkpoint_read = TRUE;
+    }
+
+    return 2;
 }
 
 /*
- * Save a game using Quetzal format. Return 1 if OK, 0 if failed.
+ * Restore a saved game using Quetzal format. The file is read in one go
+ * and restored from memory. Return 2 if OK, 0 if an error occurred; no
+ * damage is done then, so there are no fatal errors (-1) any more.
  */
 
-zword save_quetzal (FILE *svf, FILE *stf)
+zword restore_quetzal (FILE *svf)
 {
-    zlong ifzslen = 0, cmemlen = 0, stkslen = 0;
-    zlong pc;
-    zword i, j, n;
-    zword nvars, nargs, nstk, *p;
-    zbyte var;
-    long cmempos, stkspos;
-    int c;
+    zword *new_stack;
+    zbyte *buf;
+    long size;
+    zword result;
 
-    /* Write `IFZS' header. */
-    if (!write_chnk (svf, ID_FORM, 0))			return 0;
-    if (!write_long (svf, ID_IFZS))			return 0;
+    checkpoint_read = FALSE;
 
-    /* Write `IFhd' chunk. */
-    GET_PC (pc);
-    if (!write_chnk (svf, ID_IFhd, 13))			return 0;
-    if (!write_word (svf, h_release))			return 0;
-    for (i=H_SERIAL; i<H_SERIAL+6; ++i)
-	if (!write_byte (svf, zmp[i]))			return 0;
-    if (!write_word (svf, h_checksum))			return 0;
-    if (!write_long (svf, pc << 8)) /* Includes pad. */	return 0;
-
-    /* Write `CMem' chunk. */
-    if ((cmempos = ftell (svf)) < 0)			return 0;
-    if (!write_chnk (svf, ID_CMem, 0))			return 0;
-    (void) fseek (stf, 0, SEEK_SET);
-    /* j holds current run length. */
-    for (i=0, j=0, cmemlen=0; i < h_dynamic_size; ++i)
+    if (fseek (svf, 0, SEEK_END) != 0
+	|| (size = ftell (svf)) < 0
+	|| fseek (svf, 0, SEEK_SET) != 0)
+	return 0;
+
+    /* The stack is too big to be built on the C stack. */
+    new_stack = (zword far *) malloc (STACK_SIZE * sizeof (zword) + size + 1);
+    if (new_stack == NULL)
+	return 0;
+    buf = (zbyte far *) (new_stack + STACK_SIZE);
+
+    if (size > 0 && fread (buf, size, 1, svf) != 1)
+	result = 0;
+    else
+	result = restore_image (buf, size, new_stack);
+
+    free (new_stack);
+    return result;
+}
+
+/*
+ * Write a save assembled by save_quetzal: compress the snapshot of
+ * dynamic memory into a `CMem' chunk, put the file together and write
+ * it out in one go. This runs on a thread of its own, so it mustn't
+ * touch the Z-machine, only the job. Return 1 if OK, 0 if failed.
+ */
+
+static int write_quetzal (save_job_t *job)
+{
+    zlong ifzslen, cmemlen, i, j;
+    zbyte *buf, *p, *cmem;
+    int c, ok;
+
+    /* Worst case for `CMem' is a run of one between each changed byte. */
+    buf = (zbyte far *) malloc (12 + 22 + 8 + 2 * job->dynamic_size + 2
+				+ 8 + job->stks_size + 8 + CHECKPOINT_INTD);
+    if (buf == NULL)
+	ok = 0;
+    else
     {
-	if ((c = get_c (stf)) == EOF)			return 0;
-	c ^= (int) zmp[i];
-	if (c == 0)
-	    ++j;	/* It's a run of equal bytes. */
-	else
+	p = buf + 12;
+
+	/* `IFhd' chunk. */
+	put_chnk (p, ID_IFhd, 13);
+	memcpy (p, job->ifhd, 14);	/* Includes pad. */
+	p += 14;
+
+	/* `CMem' chunk. j holds current run length. */
+	cmem = p + 8;
+	for (i=0, j=0; i < job->dynamic_size; ++i)
 	{
-	    /* Write out any run there may be. */
-	    if (j > 0)
+	    c = job->original[i] ^ job->memory[i];
+	    if (c == 0)
+		++j;	/* It's a run of equal bytes. */
+	    else
 	    {
-		for (; j > 0x100; j -= 0x100)
+		/* Write out any run there may be. */
+		if (j > 0)
 		{
-		    if (!write_run (svf, 0xFF))		return 0;
-		    cmemlen += 2;
+		    for (; j > 0x100; j -= 0x100)
+			put_run (cmem, 0xFF);
+		    put_run (cmem, j-1);
+		    j = 0;
 		}
-		if (!write_run (svf, j-1))		return 0;
-		cmemlen += 2;
-		j = 0;
+		/* Any runs are now written. Write this (nonzero) byte. */
+		*cmem++ = (zbyte) c;
 	    }
-	    /* Any runs are now written. Write this (nonzero) byte. */
-	    if (!write_byte (svf, (zbyte) c))		return 0;
-	    ++cmemlen;
 	}
+	/*
+	 * Reached end of dynamic memory. We ignore any unwritten run there
+	 * may be at this point.
+	 */
+	cmemlen = cmem - (p + 8);
+	put_chnk (p, ID_CMem, cmemlen);
+	p = cmem;
+	if (cmemlen & 1)	/* Chunk length must be even. */
+	    *p++ = 0;
+
+	/* `Stks' chunk. */
+	put_chnk (p, ID_Stks, job->stks_size);
+	memcpy (p, job->stks, job->stks_size);
+	p += job->stks_size;
+
+	/* `IntD' chunk, for a checkpoint. */
+	if (job->checkpoint)
+	{
+	    put_chnk (p, ID_IntD, CHECKPOINT_INTD);
+	    put_long (p, makeid (' ',' ',' ',' '));	/* Any OS. */
+	    put_long (p, 0);	/* Flags, contents ID, reserved. */
+	    put_long (p, ID_GRTZ);
+	    for (i=0; i<5; ++i)
+		put_word (p, job->args[i]);
+	}
+
+	/* And the `IFZS' header, now the length is known. */
+	ifzslen = 3*8 + 4 + 14 + cmemlen + job->stks_size;
+	if (cmemlen & 1)
+	    ++ifzslen;
+	if (job->checkpoint)
+	    ifzslen += 8 + CHECKPOINT_INTD;
+	cmem = buf;
+	put_chnk (cmem, ID_FORM, ifzslen);
+	put_long (cmem, ID_IFZS);
+
+	ok = fwrite (buf, p - buf, 1, job->svf) == 1
+	    && fflush (job->svf) == 0;
+#ifdef ASYNC_SAVE
+	ok = ok && fsync (fileno (job->svf)) == 0;
+#endif
+	free (buf);
     }
+
+    if (fclose (job->svf) == EOF)
+	ok = 0;
+    job->svf = NULL;
+
+    /* A checkpoint only takes the place of the oldest one when complete. */
+    if (job->checkpoint)
+    {
+	if (ok && rename (job->temp_name, job->name) != 0)
+	    ok = 0;
+	if (!ok)
+	    (void) remove (job->temp_name);
+	else if (job->old_name[0])
+	    (void) remove (job->old_name);
+    }
+    return ok;
+}
+
+static void free_job (save_job_t *job)
+{
+    if (job->memory)
+	free (job->memory);
+    if (job->stks)
+	free (job->stks);
+    free (job);
+}
+
+#ifdef ASYNC_SAVE
+
+static void *save_thread (void *arg)
+{
+    save_job_t *job = (save_job_t *) arg;
+    int result = write_quetzal (job);
+
+    pthread_mutex_lock (&job->lock);
+    job->result = result;
+    pthread_mutex_unlock (&job->lock);
+
+    return NULL;
+}
+
+#endif
+
+/*
+ * finish_save
+ *
+ * Collect the save being written in the background, if there is one,
+ * waiting for it if `wait' is set. Return 1 if it was written, or if
+ * there was none, 0 if it failed, and -1 if it's still being written.
+ *
+ */
+
+int finish_save (bool wait)
+{
+    save_job_t *job = save_job;
+    int result;
+
+    if (job == NULL)
+	return 1;
+
+#ifdef ASYNC_SAVE
+    pthread_mutex_lock (&job->lock);
+    result = job->result;
+    pthread_mutex_unlock (&job->lock);
+
+    if (result < 0 && !wait)
+	return -1;
+
+    pthread_join (job->thread, NULL);
+    pthread_mutex_destroy (&job->lock);
+    result = job->result;
+#else
+    result = job->result;
+#endif
+
+    free_job (job);
+    save_job = NULL;
+
+    return result;
+
+}/* finish_save */
+
+/*
+ * Take a snapshot for save_quetzal or save_checkpoint, and start it on
+ * its way to disk.
+ */
+
+static zword start_save (FILE *svf, const char *temp_name, const char *name,
+			 const char *old_name)
+{
+    zlong pc;
+    zword i, j, n;
+    zword nvars, nargs, nstk, *p;
+    zbyte var;
+    save_job_t *job;
+    zbyte *q;
+
+    /* One at a time: the last save may have been to the same file. */
+    if (finish_save (TRUE) == 0)
+	print_string ("Error writing save file\n");
+
+    if ((job = (save_job_t *) malloc (sizeof (save_job_t))) == NULL)
+    {
+	fclose (svf);
+	return 0;
+    }
+    job->svf = svf;
+    job->original = story_dynamic;
+    job->dynamic_size = h_dynamic_size;
+    job->checkpoint = name != NULL;
+    if (job->checkpoint)
+    {
+	job->args[0] = zargc;
+	for (i=0; i<4; ++i)
+	    job->args[i+1] = zargs[i];
+	strcpy (job->temp_name, temp_name);
+	strcpy (job->name, name);
+	strcpy (job->old_name, old_name);
+    }
+    job->result = -1;
+
+    /* `IFhd' chunk body. */
+    GET_PC (pc);
+    q = job->ifhd;
+    put_word (q, h_release);
+    for (i=H_SERIAL; i<H_SERIAL+6; ++i)
+	*q++ = zmp[i];
+    put_word (q, h_checksum);
+    put_long (q, pc << 8); /* Includes pad. */
+
+    /* Dynamic memory, which is compressed into `CMem' in the background. */
+    job->memory = (zbyte far *) malloc (h_dynamic_size);
+
     /*
-     * Reached end of dynamic memory. We ignore any unwritten run there may be
-     * at this point.
+     * `Stks' chunk body. Each frame takes 8 bytes besides the words on
+     * the stack, and there can be no more than one per four words.
      */
-    if (cmemlen & 1)	/* Chunk length must be even. */
-	if (!write_byte (svf, 0))			return 0;
+    job->stks = (zbyte far *) malloc (8 * (STACK_SIZE/4+2) + 2 * STACK_SIZE);
+
+    if (job->memory == NULL || job->stks == NULL)
+	goto failed;
+
+    memcpy (job->memory, zmp, h_dynamic_size);
 
-    /* Write `Stks' chunk. You are not expected to understand this. ;) */
-    if ((stkspos = ftell (svf)) < 0)			return 0;
-    if (!write_chnk (svf, ID_Stks, 0))			return 0;
+    /* You are not expected to understand this. ;) */
+    q = job->stks;
 
     /*
-     * We construct a list of frame indices, most recent first, in `frames'.
-     * These indices are the offsets into the `stack' array of the word before
-     * the first word pushed in each frame.
+     * We construct a list of frame indices, most recent first, in
+     * `quetzal_frames'. These indices are the offsets into the `stack'
+     * array of the word before the first word pushed in each frame.
      */
-    frames[0] = sp - stack;	/* The frame we'd get by doing a call now. */
+    quetzal_frames[0] = sp - stack;	/* The frame we'd get by doing a call now. */
     for (i = fp - stack + 4, n=0; i < STACK_SIZE+4; i = stack[i-3] + 5)
-	frames[++n] = i;
+	quetzal_frames[++n] = i;
 
     /*
      * All versions other than V6 can use evaluation stack outside a function
@@ -497,21 +776,20 @@ zword save_quetzal (FILE *svf, FILE *stf)
     if (h_version != V6)
     {
 	for (i=0; i<6; ++i)
-	    if (!write_byte (svf, 0))			return 0;
-	nstk = STACK_SIZE - frames[n];
-	if (!write_word (svf, nstk))			return 0;
-	for (j=STACK_SIZE-1; j >= frames[n]; --j)
-	    if (!write_word (svf, stack[j]))		return 0;
-	stkslen = 8 + 2*nstk;
+	    *q++ = 0;
+	nstk = STACK_SIZE - quetzal_frames[n];
+	put_word (q, nstk);
+	for (j=STACK_SIZE-1; j >= quetzal_frames[n]; --j)
+	    put_word (q, stack[j]);
     }
 
     /* Write out the rest of the stack frames. */
     for (i=n; i>0; --i)
     {
-	p = stack + frames[i] - 4;	/* Points to call frame. */
+	p = stack + quetzal_frames[i] - 4;	/* Points to call frame. */
 	nvars = (p[0] & 0x0F00) >> 8;
 	nargs =  p[0] & 0x00FF;
-	nstk  =  frames[i] - frames[i-1] - nvars - 4;
+	nstk  =  quetzal_frames[i] - quetzal_frames[i-1] - nvars - 4;
 	pc    =  ((zlong) p[3] << 9) | p[2];
 
 	switch (p[0] & 0xF000)	/* Check type of call. */
@@ -527,36 +805,65 @@ zword save_quetzal (FILE *svf, FILE *stf)
 	    /* case 0x2000: */
 	    default:
 		runtime_error (ERR_SAVE_IN_INTER);
-		return 0;
+		goto failed;
 	}
 	if (nargs != 0)
 	    nargs = (1 << nargs) - 1;	/* Make args into bitmap. */
 
 	/* Write the main part of the frame... */
-	if (!write_long (svf, pc)
-	    || !write_byte (svf, var)
-	    || !write_byte (svf, nargs)
-	    || !write_word (svf, nstk))			return 0;
+	put_long (q, pc);
+	*q++ = var;
+	*q++ = (zbyte) nargs;
+	put_word (q, nstk);
 
 	/* Write the variables and eval stack. */
 	for (j=0, --p; j<nvars+nstk; ++j, --p)
-	    if (!write_word (svf, *p))			return 0;
+	    put_word (q, *p);
+    }
+    job->stks_size = q - job->stks;
+
+    /* The rest can be done without the Z-machine. */
 
-	/* Calculate length written thus far. */
-	stkslen += 8 + 2 * (nvars + nstk);
+#ifdef ASYNC_SAVE
+    pthread_mutex_init (&job->lock, NULL);
+    if (pthread_create (&job->thread, NULL, save_thread, job) == 0) {
+	save_job = job;
+	return 1;
     }
+    pthread_mutex_destroy (&job->lock);
+#endif
 
-    /* Fill in variable chunk lengths. */
-    ifzslen = 3*8 + 4 + 14 + cmemlen + stkslen;
-    if (cmemlen & 1)
-	++ifzslen;
-    (void) fseek (svf,         4, SEEK_SET);
-    if (!write_long (svf, ifzslen))			return 0;
-    (void) fseek (svf, cmempos+4, SEEK_SET);
-    if (!write_long (svf, cmemlen))			return 0;
-    (void) fseek (svf, stkspos+4, SEEK_SET);
-    if (!write_long (svf, stkslen))			return 0;
-
-    /* After all that, still nothing went wrong! */
-    return 1;
+    n = write_quetzal (job);
+    free_job (job);
+    return n;
+
+failed:
+    fclose (svf);
+    free_job (job);
+    return 0;
+}
+
+/*
+ * Save a game using Quetzal format. Only a snapshot is taken here; the
+ * file is written in the background, and closed when it has been, so
+ * `svf' belongs to this function from now on. Return 1 if OK so far,
+ * 0 if failed. Whether the file was written is found out from
+ * finish_save.
+ */
+
+zword save_quetzal (FILE *svf)
+{
+    return start_save (svf, NULL, NULL, NULL);
+}
+
+/*
+ * Save a checkpoint, from within z_read, in the same way. `svf' is
+ * open on `temp_name', which is renamed to `name' once it has been
+ * written, and then `old_name', unless empty, is removed.
+ */
+
+zword save_checkpoint (FILE *svf, const char *temp_name, const char *name,
+		       const char *old_name)
+{
+    return start_save (svf, temp_name, name, old_name);
 }
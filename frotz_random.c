@@ -20,10 +20,10 @@
 
 #include "frotz.h"
 
-static long A = 1;
+#define A (zctx->random_a)
 
-static int interval = 0;
-static int counter = 0;
+#define random_interval (zctx->random_interval)
+#define random_counter (zctx->random_counter)
 
 /*
  * seed_random
@@ -37,13 +37,13 @@ void seed_random (int value)
 
     if (value == 0) {		/* ask interface for seed value */
 	A = os_random_seed ();
-	interval = 0;
+	random_interval = 0;
     } else if (value < 1000) {	/* special seed value */
-	counter = 0;
-	interval = value;
+	random_counter = 0;
+	random_interval = value;
     } else {			/* standard seed value */
 	A = value;
-	interval = 0;
+	random_interval = 0;
     }
 
 }/* seed_random */
@@ -67,9 +67,9 @@ void z_random ()
 
 	zword result;
 
-	if (interval != 0) {		/* ...in special mode */
-	    result = counter++;
-	    if (counter == interval) counter = 0;
+	if (random_interval != 0) {		/* ...in special mode */
+	    result = random_counter++;
+	    if (random_counter == random_interval) random_counter = 0;
 	} else {			/* ...in standard mode */
 	    A = 0x015a4e35L * A + 1;
 	    result = (A >> 16) & 0x7fff;
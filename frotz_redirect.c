@@ -20,18 +20,10 @@
 
 #include "frotz.h"
 
-#define MAX_NESTING 16
-
 extern zword get_max_width (zword);
 
-static int depth = -1;
-
-static struct {
-    zword xsize;
-    zword table;
-    zword width;
-    zword total;
-} redirect[MAX_NESTING];
+#define redirect_depth (zctx->redirect_depth)
+#define redirect (zctx->redirect)
 
 /*
  * memory_open
@@ -43,7 +35,7 @@ static struct {
 void memory_open (zword table, zword xsize, bool buffering)
 {
 
-    if (++depth < MAX_NESTING) {
+    if (++redirect_depth < MAX_NESTING) {
 
 	if (!buffering)
 	    xsize = 0xffff;
@@ -52,10 +44,10 @@ void memory_open (zword table, zword xsize, bool buffering)
 
 	storew (table, 0);
 
-	redirect[depth].table = table;
-	redirect[depth].width = 0;
-	redirect[depth].total = 0;
-	redirect[depth].xsize = xsize;
+	redirect[redirect_depth].table = table;
+	redirect[redirect_depth].width = 0;
+	redirect[redirect_depth].total = 0;
+	redirect[redirect_depth].xsize = xsize;
 
 	ostream_memory = TRUE;
 
@@ -75,22 +67,22 @@ void memory_new_line (void)
     zword size;
     zword addr;
 
-    redirect[depth].total += redirect[depth].width;
-    redirect[depth].width = 0;
+    redirect[redirect_depth].total += redirect[redirect_depth].width;
+    redirect[redirect_depth].width = 0;
 
-    addr = redirect[depth].table;
+    addr = redirect[redirect_depth].table;
 
     LOW_WORD (addr, size)
     addr += 2;
 
-    if (redirect[depth].xsize != 0xffff) {
+    if (redirect[redirect_depth].xsize != 0xffff) {
 
-	redirect[depth].table = addr + size;
+	redirect[redirect_depth].table = addr + size;
 	size = 0;
 
     } else storeb ((zword) (addr + (size++)), 13);
 
-    storew (redirect[depth].table, size);
+    storew (redirect[redirect_depth].table, size);
 
 }/* memory_new_line */
 
@@ -111,9 +103,9 @@ void memory_word (const zword *s)
 
 	int width = os_string_width (s);
 
-	if (redirect[depth].xsize != 0xffff)
+	if (redirect[redirect_depth].xsize != 0xffff)
 
-	    if (redirect[depth].width + width > redirect[depth].xsize) {
+	    if (redirect[redirect_depth].width + width > redirect[redirect_depth].xsize) {
 
 		if (*s == ' ' || *s == ZC_INDENT || *s == ZC_GAP)
 		    width = os_string_width (++s);
@@ -122,11 +114,11 @@ void memory_word (const zword *s)
 
 	    }
 
-	redirect[depth].width += width;
+	redirect[redirect_depth].width += width;
 
     }
 
-    addr = redirect[depth].table;
+    addr = redirect[redirect_depth].table;
 
     LOW_WORD (addr, size)
     addr += 2;
@@ -134,7 +126,7 @@ void memory_word (const zword *s)
     while ((c = *s++) != 0)
 	storeb ((zword) (addr + (size++)), translate_to_zscii (c));
 
-    storew (redirect[depth].table, size);
+    storew (redirect[redirect_depth].table, size);
 
 }/* memory_word */
 
@@ -148,24 +140,24 @@ void memory_word (const zword *s)
 void memory_close (void)
 {
 
-    if (depth >= 0) {
+    if (redirect_depth >= 0) {
 
-	if (redirect[depth].xsize != 0xffff)
+	if (redirect[redirect_depth].xsize != 0xffff)
 	    memory_new_line ();
 
 	if (h_version == V6) {
 
-	    h_line_width = (redirect[depth].xsize != 0xffff) ?
-		redirect[depth].total : redirect[depth].width;
+	    h_line_width = (redirect[redirect_depth].xsize != 0xffff) ?
+		redirect[redirect_depth].total : redirect[redirect_depth].width;
 
 	    SET_WORD (H_LINE_WIDTH, h_line_width)
 
 	}
 
-	if (depth == 0)
+	if (redirect_depth == 0)
 	    ostream_memory = FALSE;
 
-	depth--;
+	redirect_depth--;
 
     }
 
@@ -25,7 +25,7 @@ extern void set_header_extension (int, zword);
 extern int direct_call (zword);
 
 static struct {
-    enum story story_id;
+    enum story story;
     int pic;
     int pic1;
     int pic2;
@@ -39,36 +39,18 @@ static struct {
     {   UNKNOWN,  0,   0,   0 }
 };
 
-static int font_height = 1;
-static int font_width = 1;
+#define font_height (zctx->font_height)
+#define font_width (zctx->font_width)
 
-static bool input_redraw = FALSE;
-static bool more_prompts = TRUE;
-static bool discarding = FALSE;
-static bool cursor = TRUE;
+#define input_redraw (zctx->input_redraw)
+#define more_prompts (zctx->more_prompts)
+#define discarding (zctx->discarding)
+#define cursor (zctx->cursor)
 
-static int input_window = 0;
+#define input_window (zctx->input_window)
 
-static struct {
-    zword y_pos;
-    zword x_pos;
-    zword y_size;
-    zword x_size;
-    zword y_cursor;
-    zword x_cursor;
-    zword left;
-    zword right;
-    zword nl_routine;
-    zword nl_countdown;
-    zword style;
-    zword colour;
-    zword font;
-    zword font_size;
-    zword attribute;
-    zword line_count;
-    zword true_fore;
-    zword true_back;
-} wp[8], *cwp = wp;
+#define wp (zctx->wp)
+#define cwp (zctx->cwp)
 
 
 /*
@@ -1018,9 +1000,9 @@ void z_draw_picture (void)
        Zork Zero were split into several MCGA pictures (left, right
        and top borders).  We pretend this has not happened. */
 
-    for (i = 0; mapper[i].story_id != UNKNOWN; i++)
+    for (i = 0; mapper[i].story != UNKNOWN; i++)
 
-	if (story_id == mapper[i].story_id && pic == mapper[i].pic) {
+	if (story_id == mapper[i].story && pic == mapper[i].pic) {
 
 	    int height1, width1;
 	    int height2, width2;
@@ -1256,9 +1238,9 @@ void z_picture_data (void)
 
     bool avail = os_picture_data (pic, &height, &width);
 
-    for (i = 0; mapper[i].story_id != UNKNOWN; i++)
+    for (i = 0; mapper[i].story != UNKNOWN; i++)
 
-	if (story_id == mapper[i].story_id) {
+	if (story_id == mapper[i].story) {
 
 	    if (pic == mapper[i].pic) {
 
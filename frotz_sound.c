@@ -31,13 +31,13 @@
 
 extern int direct_call (zword);
 
-static zword routine = 0;
+#define sound_routine (zctx->sound_routine)
 
-static int next_sample = 0;
-static int next_volume = 0;
+#define next_sample (zctx->next_sample)
+#define next_volume (zctx->next_volume)
 
-static bool locked = FALSE;
-static bool playing = FALSE;
+#define sound_locked (zctx->sound_locked)
+#define playing (zctx->playing)
 
 /*
  * init_sound
@@ -48,7 +48,7 @@ static bool playing = FALSE;
 
 void init_sound (void)
 {
-    locked = FALSE;
+    sound_locked = FALSE;
     playing = FALSE;
 } /* init_sound */
 
@@ -75,7 +75,7 @@ static void start_sample (int number, int volume, int repeats, zword eos)
 
     os_start_sample (number, volume, repeats, eos);
 
-    routine = eos;
+    sound_routine = eos;
     playing = TRUE;
 
 }/* start_sample */
@@ -118,12 +118,12 @@ void end_of_sound (void)
 
     playing = FALSE;
 
-    if (!locked) {
+    if (!sound_locked) {
 
 	if (story_id == LURKING_HORROR)
 	    start_next_sample ();
 
-	direct_call (routine);
+	direct_call (sound_routine);
 
     }
 
@@ -158,7 +158,7 @@ void z_sound_effect (void)
 
     if (number >= 3 || number == 0) {
 
-	locked = TRUE;
+	sound_locked = TRUE;
 
 	if (story_id == LURKING_HORROR && (number == 9 || number == 16)) {
 
@@ -167,12 +167,12 @@ void z_sound_effect (void)
 		next_sample = number;
 		next_volume = volume;
 
-		locked = FALSE;
+		sound_locked = FALSE;
 
 		if (!playing)
 		    start_next_sample ();
 
-	    } else locked = FALSE;
+	    } else sound_locked = FALSE;
 
 	    return;
 
@@ -197,7 +197,7 @@ void z_sound_effect (void)
 
 	}
 
-	locked = FALSE;
+	sound_locked = FALSE;
 
     } else os_beep (number);
 
@@ -59,6 +59,8 @@ extern zword console_read_input (int, zword *, zword, bool);
 
 extern int direct_call (zword);
 
+#define message (zctx->message)
+
 /*
  * scrollback_char
  *
@@ -74,6 +76,7 @@ void scrollback_char (zword c)
     if (c == ZC_GAP)
 	{ scrollback_char (' '); scrollback_char (' '); return; }
 
+    scrollback_size++;
     os_scrollback_char (c);
 
 }/* scrollback_char */
@@ -132,6 +135,7 @@ void scrollback_erase_input (const zword *buf)
     for (i = 0, width = 0; buf[i] != 0; i++)
 	width++;
 
+    scrollback_size -= width;
     os_scrollback_erase (width);
 
 }/* scrollback_erase_input */
@@ -281,7 +285,7 @@ void stream_new_line (void)
 	if (ostream_script && enable_scripting)
 	    script_new_line ();
 	if (enable_scripting)
-	    os_scrollback_char ('\n');
+	    scrollback_char ('\n');
 
     }
 
@@ -356,6 +360,8 @@ continue_input:
 
 	if (h_version == V4 && key == ZC_HKEY_UNDO)
 	    goto continue_input;
+	if (key == ZC_HKEY_REWIND)	/* turns begin with line input */
+	    goto continue_input;
 	if (!handle_hot_key (key))
 	    goto continue_input;
 
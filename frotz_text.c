@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA
  */
 
+#include <stdlib.h>
+#include <string.h>
 #include "frotz.h"
 
 enum string_type {
@@ -26,9 +28,15 @@ enum string_type {
 
 extern zword object_name (zword);
 extern zword get_window_font (zword);
+extern zword unicode_tolower (zword);
 
-static zword decoded[10];
-static zword encoded[3];
+#define decoded (zctx->decoded)
+#define encoded (zctx->encoded)
+#define alphabet_table (zctx->alphabet_table)
+#define alphabet_index (zctx->alphabet_index)
+#define zscii_unicode (zctx->zscii_unicode)
+#define unicode_key (zctx->unicode_key)
+#define unicode_zscii (zctx->unicode_zscii)
 
 /* 
  * According to Matteo De Luigi <matteo.de.luigi@libero.it>, 
@@ -48,13 +56,14 @@ static zword zscii_to_latin1[] = {
 };
 
 /*
- * translate_from_zscii
+ * zscii_to_unicode
  *
- * Map a ZSCII character into Unicode.
+ * Work out the Unicode for a ZSCII character from the story's tables,
+ * for init_alphabet.
  *
  */
 
-zword translate_from_zscii (zbyte c)
+static zword zscii_to_unicode (zbyte c)
 {
 
     if (c == 0xfc)
@@ -97,54 +106,148 @@ zword translate_from_zscii (zbyte c)
 
     return (zword) c;
 
-}/* translate_from_zscii */
+}/* zscii_to_unicode */
+
+#define unicode_hash(c)	(((c) ^ ((c) >> 9)) & (UNICODE_HASH_SIZE - 1))
+#define next_hash(i)	(((i) + 1) & (UNICODE_HASH_SIZE - 1))
 
 /*
- * unicode_to_zscii
+ * add_unicode
  *
- * Convert a Unicode character to ZSCII, returning 0 on failure.
+ * Enter a character in the Unicode to ZSCII table, unless a lower
+ * ZSCII code already has it. Only characters from ZC_LATIN1_MIN up are
+ * looked up, so 0 marks an empty slot.
  *
  */
 
-zbyte unicode_to_zscii (zword c)
+static void add_unicode (zword unicode, zbyte c)
 {
     int i;
 
-    if (c >= ZC_LATIN1_MIN) {
+    if (unicode < ZC_LATIN1_MIN)
+	return;
 
-	if (hx_unicode_table != 0) {	/* game has its own Unicode table */
+    for (i = unicode_hash (unicode); unicode_key[i] != 0; i = next_hash (i))
+	if (unicode_key[i] == unicode)
+	    return;
 
-	    zbyte N;
-	    int i;
+    unicode_key[i] = unicode;
+    unicode_zscii[i] = c;
 
-	    LOW_BYTE (hx_unicode_table, N)
+}/* add_unicode */
 
-	    for (i = 0x9b; i < 0x9b + N; i++) {
+/*
+ * init_alphabet
+ *
+ * Build the tables for the character sets and for translating between
+ * ZSCII and Unicode. They depend on the alphabet and Unicode tables
+ * named in the header and its extension, which are read once when the
+ * story is loaded, so init_memory calls this after reading them.
+ *
+ */
 
-		zword addr = hx_unicode_table + 1 + 2 * (i - 0x9b);
-		zword unicode;
+void init_alphabet (void)
+{
+    zbyte N;
+    int set, index, i;
 
-		LOW_WORD (addr, unicode)
+    for (i = 0; i < 256; i++)
+	zscii_unicode[i] = zscii_to_unicode ((zbyte) i);
 
-		if (c == unicode)
-		    return (zbyte) i;
+    for (set = 0; set < 3; set++)
+	for (index = 0; index < 26; index++) {
 
-	    }
+	    zword c;
 
-	    return 0;
+	    if (h_alphabet != 0) {	/* game uses its own alphabet */
 
-	} else {			/* game uses standard set */
+		zbyte z;
 
-	    for (i = 0x9b; i <= 0xdf; i++)
-		if (c == zscii_to_latin1[i - 0x9b])
-		    return (zbyte) i;
+		zword addr = h_alphabet + 26 * set + index;
+		LOW_BYTE (addr, z)
 
-	    return 0;
+		c = zscii_unicode[z];
+
+	    } else if (set == 0)	/* game uses default alphabet */
+		c = 'a' + index;
+	    else if (set == 1)
+		c = 'A' + index;
+	    else if (h_version == V1)
+		c = " 0123456789.,!?_#'\"/\\<-:()"[index];
+	    else
+		c = " ^0123456789.,!?_#'\"/\\-:()"[index];
+
+	    alphabet_table[set][index] = c;
 
 	}
-    }
 
-    return (zbyte) c;
+    if (h_version > V1)
+	alphabet_table[2][1] = 0x0D;	/* always newline */
+
+    memset (alphabet_index, 0xff, sizeof (alphabet_index));
+
+    for (set = 2; set >= 0; set--)
+	for (index = 25; index >= 0; index--)
+	    if (alphabet_table[set][index] < 128)
+		alphabet_index[alphabet_table[set][index]] = (set << 5) | index;
+
+    memset (unicode_key, 0, sizeof (unicode_key));
+
+    if (hx_unicode_table != 0) {	/* game has its own Unicode table */
+
+	LOW_BYTE (hx_unicode_table, N)
+
+	for (i = 0x9b; i < 0x9b + N; i++) {
+
+	    zword addr = hx_unicode_table + 1 + 2 * (i - 0x9b);
+	    zword unicode;
+
+	    LOW_WORD (addr, unicode)
+
+	    add_unicode (unicode, (zbyte) i);
+
+	}
+
+    } else				/* game uses standard set */
+
+	for (i = 0x9b; i <= 0xdf; i++)
+	    add_unicode (zscii_to_latin1[i - 0x9b], (zbyte) i);
+
+}/* init_alphabet */
+
+/*
+ * translate_from_zscii
+ *
+ * Map a ZSCII character into Unicode.
+ *
+ */
+
+zword translate_from_zscii (zbyte c)
+{
+
+    return zscii_unicode[c];
+
+}/* translate_from_zscii */
+
+/*
+ * unicode_to_zscii
+ *
+ * Convert a Unicode character to ZSCII, returning 0 on failure.
+ *
+ */
+
+zbyte unicode_to_zscii (zword c)
+{
+    int i;
+
+    if (c < ZC_LATIN1_MIN)
+	return (zbyte) c;
+
+    for (i = unicode_hash (c); unicode_key[i] != 0; i = next_hash (i))
+	if (unicode_key[i] == c)
+	    return unicode_zscii[i];
+
+    return 0;
 
 }/* unicode_to_zscii */
 
@@ -182,32 +285,7 @@ zbyte translate_to_zscii (zword c)
  *
  */
 
-static zword alphabet (int set, int index)
-{
-    if (h_version > V1 && set == 2 && index == 1)
-	return 0x0D;		/* always newline */
-
-    if (h_alphabet != 0) {	/* game uses its own alphabet */
-
-	zbyte c;
-
-	zword addr = h_alphabet + 26 * set + index;
-	LOW_BYTE (addr, c)
-
-	return translate_from_zscii (c);
-
-    } else			/* game uses default alphabet */
-
-	if (set == 0)
-	    return 'a' + index;
-	else if (set == 1)
-	    return 'A' + index;
-	else if (h_version == V1)
-	    return " 0123456789.,!?_#'\"/\\<-:()"[index];
-	else
-	    return " ^0123456789.,!?_#'\"/\\-:()"[index];
-
-}/* alphabet */
+#define alphabet(set,index) (alphabet_table[set][index])
 
 /*
  * load_string
@@ -294,10 +372,20 @@ static void encode_text (int padding)
 
 	    /* Search character in the alphabet */
 
-	    for (set = 0; set < 3; set++)
-		for (index = 0; index < 26; index++)
-		    if (c == alphabet (set, index))
-			goto letter_found;
+	    if (c < 128) {
+
+		if (alphabet_index[c] != 0xff) {
+		    set = alphabet_index[c] >> 5;
+		    index = alphabet_index[c] & 0x1f;
+		    goto letter_found;
+		}
+
+	    } else
+
+		for (set = 0; set < 3; set++)
+		    for (index = 0; index < 26; index++)
+			if (c == alphabet (set, index))
+			    goto letter_found;
 
 	    /* Character not found, store its ZSCII value */
 
@@ -387,7 +475,307 @@ void z_encode_text (void)
 }/* z_encode_text */
 
 /*
- * decode_text
+ * Decoded strings are kept in a hash table, by the byte address of the
+ * encoded text, and on a list from the most to the least recently
+ * used. The decoded text follows each entry, with a new line written
+ * as TEXT_ESCAPE, 0 and TEXT_ESCAPE itself doubled. Text in dynamic
+ * memory can be changed by the game, so for that a copy of the encoded
+ * text follows too, and is checked before the entry is used.
+ *
+ */
+
+typedef struct text_entry text_entry_t;
+
+struct text_entry {
+    text_entry_t *next;		/* in the same bucket */
+    text_entry_t *newer;
+    text_entry_t *older;
+    long addr;			/* byte address of the encoded text */
+    long length;		/* bytes of encoded text */
+    long run;			/* words of decoded text */
+    int busy;			/* being printed, so can't be dropped */
+};
+
+#define TEXT_BUCKETS 1024	/* must be a power of 2 */
+#define TEXT_ESCAPE 0xffff
+
+#define text_hash_of(a)	((((a) >> 1) ^ ((a) >> 11)) & (TEXT_BUCKETS - 1))
+#define text_of(e)	((zword *) ((e) + 1))
+#define text_size(e)	(sizeof (text_entry_t) + 2 * (e)->run \
+			 + ((e)->addr < h_dynamic_size ? (e)->length : 0))
+
+#define text_hash (zctx->text_hash)
+#define text_newest (zctx->text_newest)
+#define text_oldest (zctx->text_oldest)
+#define text_used (zctx->text_used)
+#define text_hits (zctx->text_hits)
+#define text_misses (zctx->text_misses)
+#define text_run (zctx->text_run)
+#define text_run_len (zctx->text_run_len)
+#define text_run_size (zctx->text_run_size)
+#define text_capture (zctx->text_capture)
+#define text_volatile (zctx->text_volatile)
+#define abbreviations_written (zctx->abbreviations_written)
+#define story_dynamic (zctx->story_dynamic)
+
+/*
+ * unlink_text
+ *
+ * Take an entry off the list of entries in use.
+ *
+ */
+
+static void unlink_text (text_entry_t *e)
+{
+
+    if (e->newer)
+	e->newer->older = e->older;
+    else
+	text_newest = e->older;
+
+    if (e->older)
+	e->older->newer = e->newer;
+    else
+	text_oldest = e->newer;
+
+}/* unlink_text */
+
+/*
+ * link_text
+ *
+ * Put an entry at the head of the list, as the most recently used.
+ *
+ */
+
+static void link_text (text_entry_t *e)
+{
+
+    e->newer = NULL;
+    e->older = text_newest;
+
+    if (text_newest)
+	text_newest->newer = e;
+    else
+	text_oldest = e;
+
+    text_newest = e;
+
+}/* link_text */
+
+/*
+ * drop_text
+ *
+ * Remove an entry from the cache and free it.
+ *
+ */
+
+static void drop_text (text_entry_t *e)
+{
+    text_entry_t **p;
+
+    for (p = &text_hash[text_hash_of (e->addr)]; *p != e; p = &(*p)->next)
+	;
+
+    *p = e->next;
+
+    unlink_text (e);
+
+    text_used -= text_size (e);
+
+    free (e);
+
+}/* drop_text */
+
+/*
+ * find_text
+ *
+ * Return the entry for the string at the given byte address, or NULL
+ * if there isn't one, or it no longer matches the story.
+ *
+ */
+
+static text_entry_t *find_text (long addr)
+{
+    text_entry_t *e;
+
+    for (e = text_hash[text_hash_of (addr)]; e != NULL; e = e->next)
+	if (e->addr == addr)
+	    break;
+
+    if (e == NULL)
+	return NULL;
+
+    if (addr < h_dynamic_size
+	&& memcmp (zmp + addr, text_of (e) + e->run, e->length) != 0) {
+
+	if (!e->busy)
+	    drop_text (e);
+
+	return NULL;
+
+    }
+
+    if (e != text_newest) {
+	unlink_text (e);
+	link_text (e);
+    }
+
+    return e;
+
+}/* find_text */
+
+/*
+ * keep_text
+ *
+ * Add the decoded text of a string to the cache, making room for it
+ * by dropping the least recently used entries. Returns NULL if the
+ * text won't fit.
+ *
+ */
+
+static text_entry_t *keep_text (long addr, long length,
+				const zword *run, long n)
+{
+    text_entry_t *e, *next;
+    long size;
+
+    size = sizeof (text_entry_t) + 2 * n;
+
+    if (addr < h_dynamic_size)
+	size += length;
+
+    if (size > option_text_cache)
+	return NULL;
+
+    for (e = text_oldest;
+	 e != NULL && text_used + size > option_text_cache; e = next) {
+	next = e->newer;
+	if (!e->busy)
+	    drop_text (e);
+    }
+
+    if (text_used + size > option_text_cache)
+	return NULL;
+
+    if ((e = malloc (size)) == NULL)
+	return NULL;
+
+    e->addr = addr;
+    e->length = length;
+    e->run = n;
+    e->busy = 0;
+
+    memcpy (text_of (e), run, 2 * n);
+
+    if (addr < h_dynamic_size)
+	memcpy (text_of (e) + n, zmp + addr, length);
+
+    e->next = text_hash[text_hash_of (addr)];
+    text_hash[text_hash_of (addr)] = e;
+
+    link_text (e);
+
+    text_used += size;
+
+    return e;
+
+}/* keep_text */
+
+/*
+ * run_word
+ *
+ * Add a word to the text being decoded for the cache.
+ *
+ */
+
+static void run_word (zword c)
+{
+
+    if (text_run_len == text_run_size) {
+
+	zword *run;
+	long size = text_run_size ? 2 * text_run_size : 256;
+
+	if ((run = realloc (text_run, 2 * size)) == NULL)
+	    os_fatal ("Out of memory");
+
+	text_run = run;
+	text_run_size = size;
+
+    }
+
+    text_run[text_run_len++] = c;
+
+}/* run_word */
+
+/*
+ * run_char
+ *
+ * Add a character to the text being decoded for the cache.
+ *
+ */
+
+static void run_char (zword c)
+{
+
+    run_word (c);
+
+    if (c == TEXT_ESCAPE)
+	run_word (TEXT_ESCAPE);
+
+}/* run_char */
+
+/*
+ * run_new_line
+ *
+ * Add a new line to the text being decoded for the cache.
+ *
+ */
+
+static void run_new_line (void)
+{
+
+    run_word (TEXT_ESCAPE);
+    run_word (0);
+
+}/* run_new_line */
+
+/*
+ * print_run
+ *
+ * Print the decoded text of a cache entry. Printing a new line can
+ * call an interrupt routine in V6, which can print in turn, so the
+ * entry is kept busy meanwhile.
+ *
+ */
+
+static void print_run (text_entry_t *e)
+{
+    const zword *p = text_of (e);
+    const zword *end = p + e->run;
+
+    e->busy++;
+
+    while (p < end)
+
+	if (*p != TEXT_ESCAPE)
+	    print_char (*p++);
+	else if (p[1] == TEXT_ESCAPE) {
+	    print_char (TEXT_ESCAPE);
+	    p += 2;
+	} else {
+	    new_line ();
+	    p += 2;
+	}
+
+    e->busy--;
+
+}/* print_run */
+
+static void decode_text (enum string_type, zword);
+
+/*
+ * decode_string
  *
  * Convert encoded text to Unicode. The encoded text consists of 16bit
  * words. Every word holds 3 Z-characters (5 bits each) plus a spare
@@ -403,15 +791,19 @@ void z_encode_text (void)
  *    EMBEDDED_STRING - from the instruction stream (at PC)
  *    VOCABULARY - from the dictionary (byte address)
  *
- * The last type is only used for word completion.
+ * The last type is only used for word completion. While text_capture
+ * is set, the text goes to the cache's run rather than the screen.
+ * Returns the number of bytes of encoded text.
  *
  */
 
-#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else print_char(c)
+#define outchar(c)	if (st==VOCABULARY) *ptr++=c; else if (text_capture) run_char(c); else print_char(c)
+#define outline()	if (text_capture) run_new_line(); else new_line()
 
-static void decode_text (enum string_type st, zword addr)
+static long decode_string (enum string_type st, zword addr)
 {
     zword *ptr;
+    long length = 0;
     long byte_addr;
     zword c2;
     zword code;
@@ -431,14 +823,7 @@ static void decode_text (enum string_type st, zword addr)
 
     else if (st == HIGH_STRING) {
 
-	if (h_version <= V3)
-	    byte_addr = (long) addr << 1;
-	else if (h_version <= V5)
-	    byte_addr = (long) addr << 2;
-	else if (h_version <= V7)
-	    byte_addr = ((long) addr << 2) + ((long) h_strings_offset << 3);
-	else /* (h_version == V8) */
-	    byte_addr = (long) addr << 3;
+	byte_addr = ((long) addr << packed_shift) + string_offset;
 
 	if (byte_addr >= story_size)
 	    runtime_error (ERR_ILL_PRINT_ADDR);
@@ -465,6 +850,8 @@ static void decode_text (enum string_type st, zword addr)
 	} else
 	    CODE_WORD (code)
 
+	length += 2;
+
 	/* Read its three Z-characters */
 
 	for (i = 10; i >= 0; i -= 5) {
@@ -482,10 +869,10 @@ static void decode_text (enum string_type st, zword addr)
 		    status = 2;
 
 		else if (h_version == V1 && c == 1)
-		    new_line ();
+		    outline ();
 
 		else if (h_version >= V2 && shift_state == 2 && c == 7)
-		    new_line ();
+		    outline ();
 
 		else if (c >= 6)
 		    outchar (alphabet (shift_state, c - 6));
@@ -519,6 +906,10 @@ static void decode_text (enum string_type st, zword addr)
 		ptr_addr = h_abbreviations + 64 * (prev_c - 1) + 2 * c;
 
 		LOW_WORD (ptr_addr, abbr_addr)
+
+		if (abbreviations_written)
+		    text_volatile = TRUE;
+
 		decode_text (ABBREVIATION, abbr_addr);
 
 		status = 0;
@@ -548,58 +939,387 @@ static void decode_text (enum string_type st, zword addr)
     if (st == VOCABULARY)
 	*ptr = 0;
 
-}/* decode_text */
+    return length;
+
+}/* decode_string */
 
 #undef outchar
+#undef outline
 
 /*
- * z_new_line, print a new line.
+ * cache_text
  *
- * 	no zargs used
+ * Decode a string into the run and add it to the cache, unless it
+ * takes text from an abbreviation in dynamic memory, or from one the
+ * game has repointed, which the game could change under it. Nested
+ * abbreviations are added to the run of the string that uses them as
+ * well as getting entries of their own.
  *
  */
 
-void z_new_line (void)
+static text_entry_t *cache_text (enum string_type st, zword addr,
+				long byte_addr)
 {
+    text_entry_t *e = NULL;
+    bool outer = !text_capture;
+    bool was_volatile = text_volatile;
+    long start, length;
+
+    if (outer) {
+	text_capture = TRUE;
+	text_run_len = 0;
+	was_volatile = FALSE;
+    }
 
-    new_line ();
+    text_volatile = FALSE;
 
-}/* z_new_line */
+    start = text_run_len;
+    length = decode_string (st, addr);
 
-/*
- * z_print, print a string embedded in the instruction stream.
- *
- *	no zargs used
- *
- */
+    if (!text_volatile && byte_addr + length <= story_size)
+	e = keep_text (byte_addr, length, text_run + start, text_run_len - start);
 
-void z_print (void)
-{
+    if (outer)
+	text_capture = FALSE;
+    else
+	text_volatile = was_volatile || text_volatile || byte_addr < h_dynamic_size;
 
-    decode_text (EMBEDDED_STRING, 0);
+    return e;
 
-}/* z_print */
+}/* cache_text */
 
 /*
- * z_print_addr, print a string from the lower 64KB.
+ * decode_text
  *
- *	zargs[0] = address of string to print
+ * Print a string, through the cache of decoded strings where it can.
+ * If the string can't be cached it is simply decoded again.
  *
  */
 
-void z_print_addr (void)
+static void decode_text (enum string_type st, zword addr)
 {
+    text_entry_t *e;
+    long byte_addr;
+    long i;
 
-    decode_text (LOW_STRING, zargs[0]);
+    switch (st) {
+    case LOW_STRING:
+	byte_addr = addr;
+	break;
+    case ABBREVIATION:
+	byte_addr = (long) addr << 1;
+	break;
+    case HIGH_STRING:
+	byte_addr = ((long) addr << packed_shift) + string_offset;
+	break;
+    case EMBEDDED_STRING:
+	GET_PC (byte_addr)
+	break;
+    default:
+	byte_addr = story_size;
+    }
 
-}/* z_print_addr */
+    if (text_hash == NULL || byte_addr >= story_size) {
+	decode_string (st, addr);
+	return;
+    }
 
-/*
- * z_print_char print a single ZSCII character.
- *
- *	zargs[0] = ZSCII character to be printed
- *
- */
+    if ((e = find_text (byte_addr)) != NULL) {
+
+	text_hits++;
+
+	if (st == EMBEDDED_STRING)
+	    SET_PC (byte_addr + e->length)
+
+	if (text_capture) {
+
+	    for (i = 0; i < e->run; i++)
+		run_word (text_of (e)[i]);
+
+	    if (byte_addr < h_dynamic_size)
+		text_volatile = TRUE;
+
+	} else print_run (e);
+
+	return;
+
+    }
+
+    text_misses++;
+
+    if (text_capture) {
+	cache_text (st, addr, byte_addr);
+	return;
+    }
+
+    if ((e = cache_text (st, addr, byte_addr)) != NULL)
+	print_run (e);
+    else {
+	if (st == EMBEDDED_STRING)
+	    SET_PC (byte_addr)
+	decode_string (st, addr);
+    }
+
+}/* decode_text */
+
+/*
+ * plain_text
+ *
+ * Check that a string ends inside the story and uses no abbreviations,
+ * so it can be decoded ahead of time. Unused entries of the table may
+ * point anywhere, and a nonsense string could be a nonsense length.
+ *
+ */
+
+static bool plain_text (long addr)
+{
+    zword code;
+    int i, c;
+
+    do {
+
+	if (addr + 2 > story_size)
+	    return FALSE;
+
+	HIGH_WORD (addr, code)
+	addr += 2;
+
+	for (i = 10; i >= 0; i -= 5) {
+
+	    c = (code >> i) & 0x1f;
+
+	    if (h_version >= V3 && c >= 1 && c <= 3)
+		return FALSE;
+	    if (h_version == V2 && c == 1)
+		return FALSE;
+
+	}
+
+    } while (!(code & 0x8000));
+
+    return TRUE;
+
+}/* plain_text */
+
+/*
+ * abbreviation_table
+ *
+ * Find the part of the abbreviation table in dynamic memory. Returns
+ * FALSE if none of it is.
+ *
+ */
+
+static bool abbreviation_table (long *start, long *end)
+{
+
+    if (h_version == V1 || h_abbreviations == 0
+	|| h_abbreviations >= h_dynamic_size)
+	return FALSE;
+
+    *start = h_abbreviations;
+    *end = *start + ((h_version == V2) ? 64 : 192);
+
+    if (*end > h_dynamic_size)
+	*end = h_dynamic_size;
+
+    return TRUE;
+
+}/* abbreviation_table */
+
+/*
+ * abbreviation_written
+ *
+ * Note a write to the given byte. If it lies in the abbreviation table
+ * the strings that use abbreviations are dropped from the cache, and
+ * are not cached again.
+ *
+ */
+
+void abbreviation_written (zword addr)
+{
+    text_entry_t *e, *next;
+    long start, end;
+
+    if (text_hash == NULL || abbreviations_written)
+	return;
+
+    if (!abbreviation_table (&start, &end) || addr < start || addr >= end)
+	return;
+
+    abbreviations_written = TRUE;
+
+    for (e = text_oldest; e != NULL; e = next) {
+	next = e->newer;
+	if (!e->busy)
+	    drop_text (e);
+    }
+
+}/* abbreviation_written */
+
+/*
+ * guard_abbreviations
+ *
+ * Guard the abbreviation table in dynamic memory, for as long as the
+ * game has left it alone. Called again whenever the guard is cleared,
+ * which happens after dynamic memory has changed wholesale, so it also
+ * checks that the table still holds what the story loaded with.
+ *
+ */
+
+void guard_abbreviations (void)
+{
+    long start, end, addr;
+
+    if (text_hash == NULL || abbreviations_written)
+	return;
+
+    if (!abbreviation_table (&start, &end))
+	return;
+
+    if (memcmp (zmp + start, story_dynamic + start, end - start) != 0) {
+	abbreviation_written ((zword) start);
+	return;
+    }
+
+    for (addr = start; addr < end; addr++)
+	write_guard[addr >> 3] |= 1 << (addr & 7);
+
+}/* guard_abbreviations */
+
+/*
+ * init_text
+ *
+ * Set up the cache of decoded strings, starting it off with the
+ * abbreviations. The alphabet and Unicode tables are taken to be
+ * fixed once the story is loaded.
+ *
+ */
+
+void init_text (void)
+{
+    zword addr;
+    int count, i;
+
+    if (option_text_cache <= 0)
+	return;
+
+    if ((text_hash = calloc (TEXT_BUCKETS, sizeof (text_entry_t *))) == NULL)
+	return;
+
+    guard_abbreviations ();
+
+    if (h_version == V1 || h_abbreviations == 0)
+	return;
+
+    count = (h_version == V2) ? 32 : 96;
+
+    for (i = 0; i < count; i++) {
+
+	LOW_WORD (h_abbreviations + 2 * i, addr)
+
+	if (plain_text ((long) addr << 1))
+	    cache_text (ABBREVIATION, addr, (long) addr << 1);
+
+    }
+
+}/* init_text */
+
+static void free_dictionaries (void);
+static void free_words (void);
+
+/*
+ * reset_text
+ *
+ * Free the cache of decoded strings, the dictionary indexes and the
+ * trie for completion.
+ *
+ */
+
+void reset_text (void)
+{
+
+    while (text_oldest)
+	drop_text (text_oldest);
+
+    free (text_hash);
+    text_hash = NULL;
+    abbreviations_written = FALSE;
+
+    free_dictionaries ();
+    free_words ();
+
+    free (text_run);
+    text_run = NULL;
+    text_run_len = 0;
+    text_run_size = 0;
+
+}/* reset_text */
+
+/*
+ * text_cache
+ *
+ * Tell the front end how many bytes of decoded strings are cached,
+ * and how many strings were found in the cache and how many not.
+ *
+ */
+
+void text_cache (long *used, long *hits, long *misses)
+{
+
+    *used = text_used;
+    *hits = text_hits;
+    *misses = text_misses;
+
+}/* text_cache */
+
+/*
+ * z_new_line, print a new line.
+ *
+ * 	no zargs used
+ *
+ */
+
+void z_new_line (void)
+{
+
+    new_line ();
+
+}/* z_new_line */
+
+/*
+ * z_print, print a string embedded in the instruction stream.
+ *
+ *	no zargs used
+ *
+ */
+
+void z_print (void)
+{
+
+    decode_text (EMBEDDED_STRING, 0);
+
+}/* z_print */
+
+/*
+ * z_print_addr, print a string from the lower 64KB.
+ *
+ *	zargs[0] = address of string to print
+ *
+ */
+
+void z_print_addr (void)
+{
+
+    decode_text (LOW_STRING, zargs[0]);
+
+}/* z_print_addr */
+
+/*
+ * z_print_char print a single ZSCII character.
+ *
+ *	zargs[0] = ZSCII character to be printed
+ *
+ */
 
 void z_print_char (void)
 {
@@ -800,20 +1520,21 @@ void z_print_unicode (void)
 }/* z_print_unicode */
 
 /*
- * lookup_text
+ * search_dictionary
  *
- * Scan a dictionary searching for the given word. The first argument
+ * Scan a dictionary searching for the encoded word. The first argument
  * can be
  *
  * 0x00 - find the first word which is >= the given one
  * 0x05 - find the word which exactly matches the given one
  * 0x1f - find the last word which is <= the given one
  *
- * The return value is 0 if the search fails.
+ * The return value is 0 if the search fails. This reads the entries
+ * from memory, for dictionaries too odd to index.
  *
  */
 
-static zword lookup_text (int padding, zword dct)
+static zword search_dictionary (int padding, zword dct)
 {
     zword entry_addr;
     zword entry_count;
@@ -827,8 +1548,6 @@ static zword lookup_text (int padding, zword dct)
     int i;
     bool sorted;
 
-    encode_text (padding);
-
     LOW_BYTE (dct, sep_count)		/* skip word separators */
     dct += 1 + sep_count;
     LOW_BYTE (dct, entry_len)		/* get length of entries */
@@ -893,6 +1612,303 @@ static zword lookup_text (int padding, zword dct)
 
     return dct + entry_number * entry_len;
 
+}/* search_dictionary */
+
+/*
+ * Dictionaries are indexed the first time they are used, with a copy
+ * of the encoded words, in order, and a hash table from each word to
+ * the number of the first entry for it. A dictionary in dynamic memory
+ * can be changed by the game, so for that a copy of the whole thing is
+ * kept too, and checked against it before each line is tokenised.
+ *
+ */
+
+typedef struct dict_index dict_index_t;
+
+struct dict_index {
+    dict_index_t *next;
+    zword addr;			/* of the dictionary */
+    zword entries;		/* of the first entry */
+    int entry_len;
+    int count;
+    bool sorted;
+    int mask;			/* of the hash table */
+    int *slots;			/* entry number + 1 for each word, or 0 */
+    zword *words;		/* encoded words, in entry order */
+    zbyte *copy;		/* of a dictionary in dynamic memory */
+    long size;
+};
+
+#define DICT_INDEXES 4		/* dictionaries indexed at once */
+
+#define dict_indexes (zctx->dict_indexes)
+
+#define same_word(a,b,n) (memcmp (a, b, (n) * sizeof (zword)) == 0)
+
+/*
+ * hash_word
+ *
+ * Hash an encoded word for the dictionary index.
+ *
+ */
+
+static unsigned hash_word (const zword *word, int resolution)
+{
+    unsigned h = 0;
+    int i;
+
+    for (i = 0; i < resolution; i++)
+	h = h * 0x9e3779b1u + word[i];
+
+    return h ^ (h >> 16);
+
+}/* hash_word */
+
+/*
+ * index_dictionary
+ *
+ * Build the index for the dictionary at the given address. Returns
+ * NULL if the dictionary runs off the end of the story or its entries
+ * are too short to hold a word, so it must be searched in memory.
+ *
+ */
+
+static dict_index_t *index_dictionary (zword dct)
+{
+    dict_index_t *d;
+    int resolution = (h_version <= V3) ? 2 : 3;
+    zword entry_count;
+    zbyte entry_len;
+    zbyte sep_count;
+    long entries, end, size;
+    int slots, count, i, j;
+    unsigned h;
+
+    LOW_BYTE (dct, sep_count)
+    entries = (long) dct + 1 + sep_count;
+    LOW_BYTE (entries, entry_len)
+    LOW_WORD (entries + 1, entry_count)
+    entries += 3;
+
+    if ((short) entry_count < 0)
+	count = - (short) entry_count;
+    else
+	count = entry_count;
+
+    end = entries + (long) count * entry_len;
+
+    if (entry_len < 2 * resolution || end > story_size || end > 0x10000)
+	return NULL;
+
+    for (slots = 16; slots < 2 * count; slots <<= 1)
+	;
+
+    size = sizeof (dict_index_t) + slots * sizeof (int)
+	 + (long) count * resolution * sizeof (zword);
+
+    if (dct < h_dynamic_size)
+	size += end - dct;
+
+    if ((d = malloc (size)) == NULL)
+	return NULL;
+
+    d->addr = dct;
+    d->entries = (zword) entries;
+    d->entry_len = entry_len;
+    d->count = count;
+    d->sorted = (short) entry_count >= 0;
+    d->mask = slots - 1;
+    d->slots = (int *) (d + 1);
+    d->words = (zword *) (d->slots + slots);
+    d->copy = NULL;
+    d->size = 0;
+
+    if (dct < h_dynamic_size) {
+	d->copy = (zbyte *) (d->words + count * resolution);
+	d->size = end - dct;
+	memcpy (d->copy, zmp + dct, d->size);
+    }
+
+    memset (d->slots, 0, slots * sizeof (int));
+
+    for (i = 0; i < count; i++) {
+
+	zword *word = d->words + i * resolution;
+	long addr = entries + (long) i * entry_len;
+
+	for (j = 0; j < resolution; j++)
+	    LOW_WORD (addr + 2 * j, word[j])
+
+	/* Keep the first of any entries for the same word */
+
+	h = hash_word (word, resolution) & d->mask;
+
+	for (; d->slots[h] != 0; h = (h + 1) & d->mask) {
+	    j = d->slots[h] - 1;
+	    if (same_word (d->words + j * resolution, word, resolution))
+		break;
+	}
+
+	if (d->slots[h] == 0)
+	    d->slots[h] = i + 1;
+
+    }
+
+    return d;
+
+}/* index_dictionary */
+
+/*
+ * find_dictionary
+ *
+ * Return the index for a dictionary, building it if need be. If the
+ * check flag is set, an index of a dictionary in dynamic memory is
+ * built again if the game has changed the dictionary since.
+ *
+ */
+
+static dict_index_t *find_dictionary (zword dct, bool check)
+{
+    dict_index_t **p, *d;
+    int n;
+
+    for (p = &dict_indexes; (d = *p) != NULL; p = &d->next)
+	if (d->addr == dct)
+	    break;
+
+    if (d != NULL) {
+
+	*p = d->next;
+
+	if (check && d->copy && memcmp (zmp + dct, d->copy, d->size) != 0) {
+	    free (d);
+	    d = NULL;
+	}
+
+    }
+
+    if (d == NULL && (d = index_dictionary (dct)) == NULL)
+	return NULL;
+
+    d->next = dict_indexes;
+    dict_indexes = d;
+
+    /* Drop the least recently used index if there are too many */
+
+    for (n = 1, p = &d->next; *p != NULL; n++, p = &(*p)->next)
+	if (n == DICT_INDEXES) {
+	    free (*p);
+	    *p = NULL;
+	    break;
+	}
+
+    return d;
+
+}/* find_dictionary */
+
+/*
+ * free_dictionaries
+ *
+ * Drop the dictionary indexes.
+ *
+ */
+
+static void free_dictionaries (void)
+{
+    dict_index_t *d;
+
+    while ((d = dict_indexes) != NULL) {
+	dict_indexes = d->next;
+	free (d);
+    }
+
+}/* free_dictionaries */
+
+/*
+ * lookup_text
+ *
+ * Scan a dictionary searching for the given word. The first argument
+ * can be
+ *
+ * 0x00 - find the first word which is >= the given one
+ * 0x05 - find the word which exactly matches the given one
+ * 0x1f - find the last word which is <= the given one
+ *
+ * The return value is 0 if the search fails.
+ *
+ */
+
+static zword lookup_text (int padding, zword dct)
+{
+    dict_index_t *d;
+    const zword *word;
+    int resolution = (h_version <= V3) ? 2 : 3;
+    int entry_number;
+    int lower, upper;
+    int i;
+    unsigned h;
+
+    encode_text (padding);
+
+    if ((d = find_dictionary (dct, FALSE)) == NULL)
+	return search_dictionary (padding, dct);
+
+    /* Look for an exact match, which is the first one a linear search
+       of an unsorted dictionary would find */
+
+    if (padding == 0x05 || !d->sorted) {
+
+	h = hash_word (encoded, resolution) & d->mask;
+
+	for (; d->slots[h] != 0; h = (h + 1) & d->mask) {
+
+	    entry_number = d->slots[h] - 1;
+
+	    if (same_word (d->words + entry_number * resolution, encoded, resolution))
+		return (zword) (d->entries + entry_number * d->entry_len);
+
+	}
+
+	/* Otherwise a linear search ends up after the last entry */
+
+	if (padding != 0x1f || d->count == 0)
+	    return 0;
+
+	return (zword) (d->entries + (d->count - 1) * d->entry_len);
+
+    }
+
+    /* Binary search for the first word >= or last word <= this one */
+
+    lower = 0;
+    upper = d->count - 1;
+
+    while (lower <= upper) {
+
+	entry_number = (lower + upper) / 2;
+	word = d->words + entry_number * resolution;
+
+	for (i = 0; i < resolution; i++)
+	    if (encoded[i] != word[i])
+		break;
+
+	if (i == resolution)
+	    return (zword) (d->entries + entry_number * d->entry_len);
+
+	if (encoded[i] > word[i])
+	    lower = entry_number + 1;
+	else
+	    upper = entry_number - 1;
+
+    }
+
+    entry_number = (padding == 0x00) ? lower : upper;
+
+    if (entry_number == -1 || entry_number == d->count)
+	return 0;
+
+    return (zword) (d->entries + entry_number * d->entry_len);
+
 }/* lookup_text */
 
 /*
@@ -959,6 +1975,8 @@ void tokenise_line (zword text, zword token, zword dct, bool flag)
     if (dct == 0)
 	dct = h_dictionary;
 
+    find_dictionary (dct, TRUE);
+
     /* Remove all tokens before inserting new ones */
 
     storeb ((zword) (token + 1), 0);
@@ -1065,6 +2083,322 @@ void z_tokenise (void)
 
 }/* z_tokenise */
 
+/*
+ * The dictionary is decoded when the story is loaded, into a trie for
+ * completing words. Each node holds a character, its children are in
+ * order, and it counts the words that go through it, so that finding
+ * how many words have a given prefix, or the nth of them, means only
+ * walking down from the root.
+ *
+ */
+
+typedef struct trie_node trie_node_t;
+
+struct trie_node {
+    zword c;
+    bool end;			/* a word ends here */
+    int child;			/* first child, or 0 */
+    int sibling;		/* next child of the same parent, or 0 */
+    int count;			/* words ending here or below */
+};
+
+#define MAX_WORD 9		/* characters in a dictionary word */
+
+#define word_trie (zctx->word_trie)
+#define word_nodes (zctx->word_nodes)
+#define word_size (zctx->word_size)
+
+/*
+ * add_node
+ *
+ * Return the child of a node for the given character, making it if
+ * need be, or -1 if there is no memory for it.
+ *
+ */
+
+static int add_node (int parent, zword c)
+{
+    int *link = &word_trie[parent].child;
+    int n;
+
+    while (*link != 0 && word_trie[*link].c < c)
+	link = &word_trie[*link].sibling;
+
+    if (*link != 0 && word_trie[*link].c == c)
+	return *link;
+
+    if (word_nodes == word_size) {
+
+	trie_node_t *p;
+	int size = 2 * word_size;
+
+	if ((p = realloc (word_trie, size * sizeof (trie_node_t))) == NULL)
+	    return -1;
+
+	word_trie = p;
+	word_size = size;
+
+	link = &word_trie[parent].child;	/* it moved */
+	while (*link != 0 && word_trie[*link].c < c)
+	    link = &word_trie[*link].sibling;
+
+    }
+
+    n = word_nodes++;
+
+    word_trie[n].c = c;
+    word_trie[n].end = FALSE;
+    word_trie[n].child = 0;
+    word_trie[n].sibling = *link;
+    word_trie[n].count = 0;
+
+    *link = n;
+
+    return n;
+
+}/* add_node */
+
+/*
+ * add_word
+ *
+ * Add the word in the global "decoded" string to the trie.
+ *
+ */
+
+static bool add_word (void)
+{
+    int node = 0;
+    int i;
+
+    for (i = 0; decoded[i] != 0 && i < MAX_WORD; i++)
+	if ((node = add_node (node, decoded[i])) < 0)
+	    return FALSE;
+
+    if (word_trie[node].end)	/* dictionaries can repeat words */
+	return TRUE;
+
+    word_trie[node].end = TRUE;
+
+    for (node = 0, i = 0; ; node = add_node (node, decoded[i++])) {
+	word_trie[node].count++;
+	if (decoded[i] == 0 || i == MAX_WORD)
+	    break;
+    }
+
+    return TRUE;
+
+}/* add_word */
+
+/*
+ * free_words
+ *
+ * Drop the trie.
+ *
+ */
+
+static void free_words (void)
+{
+
+    free (word_trie);
+    word_trie = NULL;
+    word_nodes = 0;
+    word_size = 0;
+
+}/* free_words */
+
+/*
+ * init_words
+ *
+ * Decode the dictionary into the trie for completion.
+ *
+ */
+
+void init_words (void)
+{
+    zword entry_count;
+    zbyte entry_len;
+    zbyte sep_count;
+    long addr, end;
+    int resolution = (h_version <= V3) ? 2 : 3;
+    int count, i, j;
+    zword code;
+
+    LOW_BYTE (h_dictionary, sep_count)
+    addr = (long) h_dictionary + 1 + sep_count;
+    LOW_BYTE (addr, entry_len)
+    LOW_WORD (addr + 1, entry_count)
+    addr += 3;
+
+    count = ((short) entry_count < 0) ? - (short) entry_count : entry_count;
+    end = addr + (long) count * entry_len;
+
+    if (end > story_size || end > 0x10000)
+	return;
+
+    word_size = 256;
+
+    if ((word_trie = malloc (word_size * sizeof (trie_node_t))) == NULL)
+	return;
+
+    memset (word_trie, 0, sizeof (trie_node_t));
+    word_nodes = 1;
+
+    for (i = 0; i < count; i++, addr += entry_len) {
+
+	/* Skip entries that run on too long, or use abbreviations,
+	   which a dictionary word can't */
+
+	for (j = 0; j < resolution; j++) {
+	    LOW_WORD (addr + 2 * j, code)
+	    if (code & 0x8000)
+		break;
+	}
+
+	if (j == resolution || !plain_text (addr))
+	    continue;
+
+	decode_text (VOCABULARY, (zword) addr);
+
+	if (!add_word ()) {
+	    free_words ();
+	    return;
+	}
+
+    }
+
+}/* init_words */
+
+/*
+ * zchar_length
+ *
+ * Return how many Z-characters encode_text takes for a character.
+ *
+ */
+
+static int zchar_length (zword c)
+{
+    int set, index;
+
+    if (c == 32)
+	return 1;
+
+    if (c < 128) {
+
+	if (alphabet_index[c] != 0xff)
+	    return (alphabet_index[c] >> 5) ? 2 : 1;
+
+    } else
+
+	for (set = 0; set < 3; set++)
+	    for (index = 0; index < 26; index++)
+		if (c == alphabet (set, index))
+		    return (set != 0) ? 2 : 1;
+
+    return 4;
+
+}/* zchar_length */
+
+/*
+ * find_prefix
+ *
+ * Return the node for the given start of a word, ignoring case, or
+ * -1 if no word in the dictionary starts that way. As in lookup_text,
+ * only as much of it as the dictionary resolution holds counts, so
+ * "lantern" finds "lanter" in a V3 game; the number of characters
+ * used is stored in *len.
+ *
+ */
+
+static int find_prefix (const zword *prefix, int *len)
+{
+    int room = (h_version <= V3) ? 6 : 9;
+    int node = 0;
+    int i;
+
+    if (word_trie == NULL)
+	return -1;
+
+    for (i = 0; prefix[i] != 0; i++) {
+
+	zword c = unicode_tolower (prefix[i]);
+	int n = zchar_length (c);
+
+	if (room == 0)
+	    break;
+	if (n > room)			/* no whole word ends that way */
+	    return -1;
+	room -= n;
+
+	for (node = word_trie[node].child; node != 0; node = word_trie[node].sibling)
+	    if (word_trie[node].c >= c)
+		break;
+
+	if (node == 0 || word_trie[node].c != c)
+	    return -1;
+
+    }
+
+    *len = i;
+    return node;
+
+}/* find_prefix */
+
+/*
+ * completions
+ *
+ * Return how many words in the dictionary start with the given ones.
+ *
+ */
+
+int completions (const zword *prefix)
+{
+    int len;
+    int node = find_prefix (prefix, &len);
+
+    return (node < 0) ? 0 : word_trie[node].count;
+
+}/* completions */
+
+/*
+ * nth_completion
+ *
+ * Copy the nth word, in order and counting from 0, of those in the
+ * dictionary that start with the given one to the result, which needs
+ * room for MAX_WORD characters and a terminating zero. Returns FALSE
+ * if there are not that many.
+ *
+ */
+
+bool nth_completion (const zword *prefix, int n, zword *result)
+{
+    int len, i;
+    int node = find_prefix (prefix, &len);
+
+    if (node < 0 || n < 0 || n >= word_trie[node].count)
+	return FALSE;
+
+    for (i = 0; i < len; i++)
+	result[i] = unicode_tolower (prefix[i]);
+
+    while (!word_trie[node].end || n-- != 0) {
+
+	node = word_trie[node].child;
+
+	while (n >= word_trie[node].count) {
+	    n -= word_trie[node].count;
+	    node = word_trie[node].sibling;
+	}
+
+	result[len++] = word_trie[node].c;
+
+    }
+
+    result[len] = 0;
+
+    return TRUE;
+
+}/* nth_completion */
+
 /*
  * completion
  *
@@ -1083,20 +2417,25 @@ void z_tokenise (void)
  * then the string is "ll"); in case of 0, the string is an extension
  * to the last word that results in the only possible completion.
  *
+ * The result has room for size characters, counting the terminating
+ * zero. An extension that doesn't fit is cut short and reported as
+ * ambiguous.
+ *
  */
 
-int completion (const zword *buffer, zword *result)
+int completion (const zword *buffer, zword *result, int size)
 {
-    zword minaddr;
-    zword maxaddr;
-    zword *ptr;
+    zword word[MAX_WORD + 1];
     zword c;
+    int node;
     int len;
-    int i;
+
+    if (size <= 0)
+	return 2;
 
     *result = 0;
 
-    /* Copy last word to "decoded" string */
+    /* Copy last word to "word" string */
 
     len = 0;
 
@@ -1104,42 +2443,35 @@ int completion (const zword *buffer, zword *result)
 
 	if (c != ' ') {
 
-	    if (len < 9)
-		decoded[len++] = c;
+	    if (len < MAX_WORD)
+		word[len++] = c;
 
 	} else len = 0;
 
-    decoded[len] = 0;
+    word[len] = 0;
 
-    /* Search the dictionary for first and last possible extensions */
+    /* Follow the trie as far as all the possible extensions agree */
 
-    minaddr = lookup_text (0x00, h_dictionary);
-    maxaddr = lookup_text (0x1f, h_dictionary);
-
-    if (minaddr == 0 || maxaddr == 0 || minaddr > maxaddr)
+    if ((node = find_prefix (word, &len)) < 0 || word_trie[node].count == 0)
 	return 2;
 
-    /* Copy first extension to "result" string */
-
-    decode_text (VOCABULARY, minaddr);
+    while (!word_trie[node].end && --size > 0) {
 
-    ptr = result;
+	int child = word_trie[node].child;
 
-    for (i = len; (c = decoded[i]) != 0; i++)
-	*ptr++ = c;
-    *ptr = 0;
+	if (child == 0 || word_trie[child].sibling != 0)
+	    break;
 
-    /* Merge second extension with "result" string */
+	node = child;
+	*result++ = word_trie[node].c;
 
-    decode_text (VOCABULARY, maxaddr);
+    }
 
-    for (i = len, ptr = result; (c = decoded[i]) != 0; i++, ptr++)
-	if (*ptr != c) break;
-    *ptr = 0;
+    *result = 0;
 
     /* Search was ambiguous or successful */
 
-    return (minaddr == maxaddr) ? 0 : 1;
+    return (word_trie[node].end && word_trie[node].count == 1) ? 0 : 1;
 
 }/* completion */
 
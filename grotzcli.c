@@ -0,0 +1,288 @@
+/*======================================================================
+grotzcli.c
+A headless front end for the frotz core, for running scripted
+sessions in batch. Commands are read one per line from stdin or from
+a file. By default story output goes to stdout as plain UTF-8 text,
+showing only the lower window; the other backends in headless.c can
+be chosen instead. Nothing here depends on GTK.
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include "frotz.h"
+#include "headless.h"
+
+#define CLI_DEFAULT_ROWS 25
+#define CLI_DEFAULT_COLS 80
+
+
+/*======================================================================
+cli_time
+Returns a monotonic time in seconds, for reporting
+======================================================================*/
+static double cli_time (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/*======================================================================
+usage
+======================================================================*/
+static void usage (void)
+  {
+  printf ("Usage: " APPNAME " [options] story_file [command_file]\n");
+  printf ("Commands are read from command_file, or stdin if none is"
+    " given.\n");
+  printf ("  --autosave DIR save a checkpoint in DIR every so often\n");
+  printf ("  --autosave-turns N\n"
+    "                 checkpoint every N turns (default %d)\n",
+    AUTOSAVE_TURNS);
+  printf ("  --backend NAME output backend: stdio (default), grid, null"
+    " or record\n");
+  printf ("  --map-story    map the story file rather than reading it;"
+    " it must not\n                 be rewritten while it runs\n");
+  printf ("  --max-speed    never wait for timed input\n");
+  printf ("  --resume       start from the latest checkpoint, if any\n");
+  printf ("  --rows N       give the grid backend N rows (default %d)\n",
+    CLI_DEFAULT_ROWS);
+  printf ("  --seed N       seed the random number generator with N\n");
+  printf ("  --stats        report undo, cache and superinstruction use at"
+    " the end\n");
+  printf ("  --timeline-interval N\n"
+    "                 copy all of memory every N turns (default %d), or"
+    " with 0\n                 keep no timeline\n", TIMELINE_INTERVAL);
+  printf ("  --timeline-memory N\n"
+    "                 keep at most N bytes of timeline (default %ld)\n",
+    (long) TIMELINE_MEMORY);
+  printf ("  --undo-journal DIR\n"
+    "                 keep undo states that don't fit in memory in DIR\n");
+  printf ("  --undo-memory N\n"
+    "                 keep at most N bytes of undo states (default %ld)\n",
+    (long) UNDO_ARENA_SIZE);
+  printf ("  --width N      report a screen N columns wide (default %d)\n",
+    CLI_DEFAULT_COLS);
+  printf ("  --version      show version\n");
+  }
+
+
+/*======================================================================
+report_recording
+After a run with the recording backend, say how much output there
+was, and how long it takes to render it in the grid backend on its
+own. The rendered screen isn't wanted, so stdout is shut meanwhile
+======================================================================*/
+static void report_recording (Headless *headless, double run_time)
+  {
+  int count, out;
+  double start;
+
+  headless_get_events (headless, &count);
+  fflush (stdout);
+  out = dup (fileno (stdout));
+  freopen ("/dev/null", "w", stdout);
+
+  start = cli_time ();
+  headless_replay (headless, &headless_grid_backend);
+  fflush (stdout);
+
+  dup2 (out, fileno (stdout));
+  close (out);
+  fprintf (stderr, APPNAME ": %d output calls, %.3fs interpreting,"
+    " %.3fs rendering\n", count, run_time, cli_time () - start);
+  }
+
+
+/*======================================================================
+main
+======================================================================*/
+int main (int argc, char **argv)
+  {
+  static struct option long_options[] =
+    {
+    { "autosave", required_argument, NULL, 'a' },
+    { "autosave-turns", required_argument, NULL, 't' },
+    { "backend", required_argument, NULL, 'b' },
+    { "map-story", no_argument, NULL, 'M' },
+    { "max-speed", no_argument, NULL, 'm' },
+    { "resume", no_argument, NULL, 'R' },
+    { "rows", required_argument, NULL, 'r' },
+    { "seed", required_argument, NULL, 's' },
+    { "stats", no_argument, NULL, 'S' },
+    { "timeline-interval", required_argument, NULL, 'i' },
+    { "timeline-memory", required_argument, NULL, 'T' },
+    { "undo-journal", required_argument, NULL, 'j' },
+    { "undo-memory", required_argument, NULL, 'u' },
+    { "width", required_argument, NULL, 'w' },
+    { "version", no_argument, NULL, 'v' },
+    { "help", no_argument, NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+    };
+  const ZBackend *backend = &headless_stdio_backend;
+  int max_speed = FALSE;
+  int map_story = FALSE;
+  int random_seed = -1;
+  int rows = CLI_DEFAULT_ROWS;
+  int cols = CLI_DEFAULT_COLS;
+  long undo_bytes = UNDO_ARENA_SIZE;
+  int timeline_interval = TIMELINE_INTERVAL;
+  long timeline_bytes = TIMELINE_MEMORY;
+  const char *undo_dir = NULL;
+  const char *autosave_dir = NULL;
+  int autosave_turns = AUTOSAVE_TURNS;
+  char checkpoint[MAX_FILE_NAME + 1];
+  int resume = FALSE;
+  int stats = FALSE;
+  int in, c;
+  double start;
+
+  while ((c = getopt_long (argc, argv, "a:b:i:j:MmRr:s:ST:t:u:w:vh", long_options, NULL))
+      != -1)
+    {
+    switch (c)
+      {
+      case 'a':
+        autosave_dir = optarg;
+        break;
+      case 'b':
+        backend = headless_find_backend (optarg);
+        if (!backend)
+          {
+          fprintf (stderr, APPNAME ": no backend called %s\n", optarg);
+          exit (1);
+          }
+        break;
+      case 'i':
+        timeline_interval = atoi (optarg);
+        break;
+      case 'j':
+        undo_dir = optarg;
+        break;
+      case 'M':
+        map_story = TRUE;
+        break;
+      case 'm':
+        max_speed = TRUE;
+        break;
+      case 'R':
+        resume = TRUE;
+        break;
+      case 'r':
+        rows = atoi (optarg);
+        if (rows < 2 || rows > 254) rows = CLI_DEFAULT_ROWS;
+        break;
+      case 's':
+        random_seed = atoi (optarg) & 0x7fff;
+        break;
+      case 'S':
+        stats = TRUE;
+        break;
+      case 'T':
+        timeline_bytes = atol (optarg);
+        break;
+      case 't':
+        autosave_turns = atoi (optarg);
+        break;
+      case 'u':
+        undo_bytes = atol (optarg);
+        break;
+      case 'w':
+        cols = atoi (optarg);
+        if (cols < 20 || cols > 255) cols = CLI_DEFAULT_COLS;
+        break;
+      case 'v':
+        printf (APPNAME " version %s\n", VERSION);
+        printf ("(c)2011 Kevin Boone\n");
+        exit (0);
+      case 'h':
+        usage ();
+        exit (0);
+      default:
+        usage ();
+        exit (1);
+      }
+    }
+
+  if (optind >= argc || argc - optind > 2)
+    {
+    usage ();
+    exit (1);
+    }
+
+  if (argc - optind == 2)
+    {
+    in = open (argv[optind + 1], O_RDONLY);
+    if (in < 0)
+      {
+      fprintf (stderr, APPNAME ": can't open %s\n", argv[optind + 1]);
+      exit (1);
+      }
+    }
+  else
+    in = fileno (stdin);
+
+  Headless *headless = headless_new (in);
+  ZContext *context = zcontext_new ();
+  if (!headless || !context)
+    {
+    fprintf (stderr, APPNAME ": out of memory\n");
+    exit (1);
+    }
+  headless_set_max_speed (headless, max_speed);
+  headless_set_random_seed (headless, random_seed);
+  headless_set_screen_size (headless, rows, cols);
+  headless_attach (headless, context, backend);
+  zcontext_bind (context);
+  story_name = argv[optind];
+  option_map_story = map_story;
+  option_undo_bytes = undo_bytes;
+  option_undo_journal = undo_dir;
+  option_timeline_interval = timeline_interval;
+  option_timeline_bytes = timeline_bytes;
+  option_autosave = autosave_dir;
+  option_autosave_turns = autosave_turns;
+  if (resume && autosave_dir
+      && autosave_find (autosave_dir, story_name, checkpoint))
+    {
+    fprintf (stderr, APPNAME ": resuming from %s\n", checkpoint);
+    option_resume = checkpoint;
+    }
+
+  start = cli_time ();
+  headless_run (headless);
+  if (backend == &headless_record_backend)
+    report_recording (headless, cli_time () - start);
+  if (stats)
+    {
+    long used, peak, spills, reloads, hits, misses, count;
+    const char *name;
+    int i;
+    undo_memory (&used, &peak);
+    fprintf (stderr, APPNAME ": undo states took at most %ld of %ld bytes\n",
+      peak, undo_bytes);
+    undo_journal (&used, &peak, &spills, &reloads);
+    if (undo_dir)
+      fprintf (stderr, APPNAME ": undo journal reached %ld bytes, %ld states"
+        " written, %ld read back\n", peak, spills, reloads);
+    text_cache (&used, &hits, &misses);
+    fprintf (stderr, APPNAME ": %ld strings printed from the text cache,"
+      " %ld decoded\n", hits, misses);
+    routine_headers (&hits, &misses);
+    fprintf (stderr, APPNAME ": %ld calls found the routine header cached,"
+      " %ld decoded it\n", hits, misses);
+    for (i = 1; (name = superinstruction (i, &count)) != NULL; i++)
+      fprintf (stderr, APPNAME ": superinstruction %s run %ld times\n",
+        name, count);
+    }
+
+  zcontext_free (context);
+  headless_free (headless);
+  if (in != fileno (stdin)) close (in);
+  return 0;
+  }
@@ -0,0 +1,1225 @@
+/*======================================================================
+headless.c
+The os_* backends that need no display. See headless.h.
+
+Each backend keeps its state in a Headless object, which is the
+os_data of the Z-machine context it serves. Input is the same for
+all of them: one line of the command file per line of input or key
+press, with timed input honoured by polling the file.
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/select.h>
+#endif
+#define ZBACKEND_IMPLEMENTATION
+#include "frotz.h"
+#include "headless.h"
+
+#define HEADLESS_DEFAULT_ROWS 25
+#define HEADLESS_DEFAULT_COLS 80
+#define HEADLESS_INPUT_SIZE 1024
+#define HEADLESS_READ_SIZE 4096
+#define HEADLESS_LOG_CHUNK 4096
+
+extern int frotz_main (void);
+extern void frotz_finish (void);
+
+enum
+  {
+  HE_CHAR,
+  HE_ERASE_AREA,
+  HE_SCROLL_AREA,
+  HE_SET_CURSOR,
+  HE_SET_COLOUR,
+  HE_SET_FONT,
+  HE_SET_TEXT_STYLE,
+  HE_WINDOW_HEIGHT,
+  HE_DRAW_PICTURE,
+  HE_BEEP,
+  HE_START_SAMPLE,
+  HE_STOP_SAMPLE
+  };
+
+struct _Headless
+  {
+  const ZBackend *backend;
+  int max_speed;
+  int random_seed;
+  int rows;
+  int cols;
+  int echo;
+  jmp_buf finished;
+
+  // Input is read through our own buffer rather than stdio, so that
+  //  we can tell whether a line is waiting before polling the file
+  int input;
+  char read_buf[HEADLESS_READ_SIZE];
+  int read_pos;
+  int read_len;
+
+  // Recording backend
+  HeadlessEvent *events;
+  int event_count;
+  int event_size;
+
+  // Grid backend
+  zword *grid;
+  int cursor_row;
+  int cursor_col;
+  };
+
+// The Headless object that owns the context bound to this thread
+#define global_headless ((Headless *) zctx->os_data)
+
+
+/*======================================================================
+headless_new
+Create the state for a headless backend reading commands from the
+given file descriptor
+======================================================================*/
+Headless *headless_new (int input_fd)
+  {
+  Headless *self = calloc (1, sizeof (Headless));
+  if (!self) return NULL;
+  self->input = input_fd;
+  self->random_seed = -1;
+  self->backend = &headless_stdio_backend;
+  self->echo = !isatty (input_fd);
+  headless_set_screen_size (self, HEADLESS_DEFAULT_ROWS,
+    HEADLESS_DEFAULT_COLS);
+  return self;
+  }
+
+
+/*======================================================================
+headless_free
+======================================================================*/
+void headless_free (Headless *self)
+  {
+  if (!self) return;
+  free (self->events);
+  free (self->grid);
+  free (self);
+  }
+
+
+/*======================================================================
+headless_set_max_speed
+In max-speed mode timed input never waits: the timer expires at once
+unless a command is already waiting
+======================================================================*/
+void headless_set_max_speed (Headless *self, int f)
+  {
+  self->max_speed = f;
+  }
+
+
+/*======================================================================
+headless_set_random_seed
+A seed of -1 means seed from the clock
+======================================================================*/
+void headless_set_random_seed (Headless *self, int seed)
+  {
+  self->random_seed = seed;
+  }
+
+
+/*======================================================================
+headless_set_screen_size
+The grid backend has a screen of exactly this size; the others just
+report it to the game
+======================================================================*/
+void headless_set_screen_size (Headless *self, int rows, int cols)
+  {
+  int i;
+  zword *grid = malloc (rows * cols * sizeof (zword));
+  if (!grid) return;
+  for (i = 0; i < rows * cols; i++) grid[i] = ' ';
+  free (self->grid);
+  self->grid = grid;
+  self->rows = rows;
+  self->cols = cols;
+  self->cursor_row = 1;
+  self->cursor_col = 1;
+  }
+
+
+/*======================================================================
+headless_attach
+Make this object, driving the given backend, the os_* interface of a
+Z-machine context
+======================================================================*/
+void headless_attach (Headless *self, ZContext *context,
+    const ZBackend *backend)
+  {
+  self->backend = backend;
+  context->os = backend;
+  context->os_data = self;
+  }
+
+
+/*======================================================================
+headless_run
+Run the story in the context bound to this thread, which must have
+been attached to this object. Returns when the game ends or when the
+commands run out, in which case the game is torn down as it would
+have been had it ended
+======================================================================*/
+void headless_run (Headless *self)
+  {
+  if (setjmp (self->finished) == 0)
+    frotz_main ();
+  else
+    frotz_finish ();
+  fflush (stdout);
+  }
+
+
+/*======================================================================
+headless_finish
+End the session at the end of the input; this is the normal way for
+a scripted run to finish
+======================================================================*/
+static void headless_finish (void)
+  {
+  longjmp (global_headless->finished, 1);
+  }
+
+
+/*======================================================================
+headless_find_backend
+Look a backend up by name. Returns NULL if there is none
+======================================================================*/
+const ZBackend *headless_find_backend (const char *name)
+  {
+  static const ZBackend *backends[] =
+    {
+    &headless_stdio_backend,
+    &headless_null_backend,
+    &headless_record_backend,
+    &headless_grid_backend,
+    NULL
+    };
+  int i;
+  for (i = 0; backends[i]; i++)
+    if (strcmp (backends[i]->name, name) == 0) return backends[i];
+  return NULL;
+  }
+
+
+/*======================================================================
+headless_put_utf8
+Write a UTF-16 character to stdout as UTF-8
+======================================================================*/
+static void headless_put_utf8 (zword c)
+  {
+  if (c < 0x80)
+    putchar (c);
+  else if (c < 0x800)
+    {
+    putchar (0xC0 | (c >> 6));
+    putchar (0x80 | (c & 0x3F));
+    }
+  else
+    {
+    putchar (0xE0 | (c >> 12));
+    putchar (0x80 | ((c >> 6) & 0x3F));
+    putchar (0x80 | (c & 0x3F));
+    }
+  }
+
+
+/*======================================================================
+headless_getc
+Returns the next byte of input, or EOF
+======================================================================*/
+static int headless_getc (Headless *self)
+  {
+  if (self->read_pos >= self->read_len)
+    {
+    self->read_len = read (self->input, self->read_buf, HEADLESS_READ_SIZE);
+    self->read_pos = 0;
+    if (self->read_len <= 0)
+      {
+      self->read_len = 0;
+      return EOF;
+      }
+    }
+  return (unsigned char) self->read_buf[self->read_pos++];
+  }
+
+
+/*======================================================================
+headless_input_ready
+Wait up to the specified number of tenths of a second for input.
+Returns TRUE if there is something to read. Where we can't poll,
+input is always taken to be pending
+======================================================================*/
+static int headless_input_ready (Headless *self, int timeout)
+  {
+  if (self->read_pos < self->read_len)
+    return TRUE;
+
+#ifndef WIN32
+  fd_set fds;
+  struct timeval tv;
+  FD_ZERO (&fds);
+  FD_SET (self->input, &fds);
+  tv.tv_sec = self->max_speed ? 0 : timeout / 10;
+  tv.tv_usec = self->max_speed ? 0 : (timeout % 10) * 100000;
+  return select (self->input + 1, &fds, NULL, NULL, &tv) != 0;
+#else
+  return TRUE;
+#endif
+  }
+
+
+/*======================================================================
+headless_read_input_line
+Read one line of input as UTF-16, without its line ending, into buf,
+which has room for max characters plus a terminating zero. Ends the
+session at the end of the input
+======================================================================*/
+static void headless_read_input_line (Headless *self, zword *buf, int max)
+  {
+  char line[HEADLESS_INPUT_SIZE];
+  int i = 0, n = 0, c;
+  unsigned char *p;
+
+  fflush (stdout);
+  if ((c = headless_getc (self)) == EOF) headless_finish ();
+  while (c != EOF && c != '\n')
+    {
+    if (c != '\r' && n < HEADLESS_INPUT_SIZE - 1) line[n++] = c;
+    c = headless_getc (self);
+    }
+  line[n] = 0;
+
+  p = (unsigned char *) line;
+  while (*p && i < max)
+    {
+    zword z = *p++;
+    if (z >= 0xE0 && p[0] && p[1])
+      {
+      z = ((z & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+      p += 2;
+      }
+    else if (z >= 0xC0 && p[0])
+      {
+      z = ((z & 0x1F) << 6) | (p[0] & 0x3F);
+      p++;
+      }
+    buf[i++] = z;
+    }
+  buf[i] = 0;
+  }
+
+
+/*======================================================================
+headless_echo
+Copy input to the output, so that transcripts read naturally, unless
+the input is a terminal that has shown it already
+======================================================================*/
+static void headless_echo (const zword *s)
+  {
+  Headless *self = global_headless;
+  if (!self->echo) return;
+  while (*s) self->backend->display_char (*s++);
+  }
+
+
+/*======================================================================
+Input, shared by all the backends
+======================================================================*/
+
+/*======================================================================
+headless_hot_key
+Scripts can't press Alt, so a line holding just a backslash and one
+of the letters of the hot keys stands for that key: \u to undo, \t to
+go back to an earlier turn, and so on. Returns the hot key, or 0 for
+any other line
+======================================================================*/
+static zword headless_hot_key (const zword *line)
+  {
+  // In the order of the ZC_HKEY_ codes
+  static const char keys[] = "rpsunxdht";
+  const char *k;
+
+  if (line[0] != '\\' || line[1] == 0 || line[1] > 0x7f || line[2] != 0)
+    return 0;
+  if ((k = strchr (keys, line[1])) == NULL)
+    return 0;
+  return ZC_HKEY_MIN + (k - keys);
+  }
+
+
+/*======================================================================
+headless_read_line
+Append a line of input to whatever the core has already put in the
+buffer. The core starts a new line itself when we return
+======================================================================*/
+static zword headless_read_line (int max, zword *buf, int timeout,
+    int width, int continued)
+  {
+  Headless *self = global_headless;
+  int len = 0;
+  while (buf[len]) len++;
+
+  if (timeout > 0 && !headless_input_ready (self, timeout))
+    return ZC_TIME_OUT;
+
+  headless_read_input_line (self, buf + len, max - len);
+  zword key = headless_hot_key (buf + len);
+  if (key)
+    {
+    buf[len] = 0;
+    return key;
+    }
+  headless_echo (buf + len);
+  return ZC_RETURN;
+  }
+
+
+/*======================================================================
+headless_read_key
+Each key press takes a whole line of input, so that scripts stay
+line oriented. An empty line is a press of return
+======================================================================*/
+static zword headless_read_key (int timeout, int show_cursor)
+  {
+  Headless *self = global_headless;
+  zword line[HEADLESS_INPUT_SIZE];
+
+  if (timeout > 0 && !headless_input_ready (self, timeout))
+    return ZC_TIME_OUT;
+
+  headless_read_input_line (self, line, HEADLESS_INPUT_SIZE - 1);
+  return line[0] ? line[0] : ZC_RETURN;
+  }
+
+
+/*======================================================================
+headless_get_file_name
+File prompts are answered with the default name. Taking the name
+from the script would swallow the command after a save or restore
+whenever the script didn't expect the prompt
+======================================================================*/
+static void headless_get_file_name (char *file_name,
+    const char *default_name)
+  {
+  strncpy (file_name, default_name, MAX_FILE_NAME - 1);
+  file_name[MAX_FILE_NAME - 1] = 0;
+  }
+
+
+/*======================================================================
+headless_read_file_name
+Without a display there's nowhere to prompt, so the name is taken
+silently
+======================================================================*/
+static int headless_read_file_name (char *file_name,
+    const char *default_name, int flag)
+  {
+  headless_get_file_name (file_name, default_name);
+  return TRUE;
+  }
+
+
+/*======================================================================
+headless_read_mouse
+======================================================================*/
+static zword headless_read_mouse (void)
+  {
+  return 0;
+  }
+
+
+/*======================================================================
+Screen set-up and other things common to the backends
+======================================================================*/
+
+/*======================================================================
+headless_init_screen
+Characters are one unit square, and the screen has the size set by
+headless_set_screen_size. Only the grid backend has a bottom, so
+the others report the largest possible height
+======================================================================*/
+static void headless_init_screen (void)
+  {
+  Headless *self = global_headless;
+
+  if (h_version == V3)
+    {
+    h_config |= CONFIG_SPLITSCREEN;
+    h_flags &= ~OLD_SOUND_FLAG;
+    }
+
+  if (h_version >= V4)
+    {
+    h_config |= CONFIG_BOLDFACE;
+    h_config |= CONFIG_EMPHASIS;
+    h_config |= CONFIG_FIXED;
+    h_config |= CONFIG_TIMEDINPUT;
+    }
+
+  h_interpreter_number = h_version == 6 ? INTERP_MSDOS : INTERP_AMIGA;
+  h_interpreter_version = 'F';
+
+  h_screen_rows = self->backend == &headless_grid_backend ? self->rows : 255;
+  h_screen_cols = self->cols;
+  h_screen_width = h_screen_cols;
+  h_screen_height = h_screen_rows;
+  h_font_width = 1;
+  h_font_height = 1;
+
+  h_default_foreground = 1;
+  h_default_background = 1;
+  }
+
+
+/*======================================================================
+headless_font_data
+======================================================================*/
+static int headless_font_data (int font, int *height, int *width)
+  {
+  if (font == TEXT_FONT || font == FIXED_WIDTH_FONT)
+    {
+    *height = 1;
+    *width = 1;
+    return 1;
+    }
+  return 0;
+  }
+
+
+/*======================================================================
+headless_char_width
+Every character is one unit wide
+======================================================================*/
+static int headless_char_width (zword c)
+  {
+  return 1;
+  }
+
+
+/*======================================================================
+headless_string_width
+======================================================================*/
+static int headless_string_width (const zword *s)
+  {
+  int width = 0;
+  zword c;
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT || c == ZC_NEW_STYLE)
+      s++;
+    else
+      width++;
+    }
+  return width;
+  }
+
+
+/*======================================================================
+headless_check_unicode
+======================================================================*/
+static int headless_check_unicode (int font, zword c)
+  {
+  if (font == GRAPHICS_FONT) return 0;
+  return 3;
+  }
+
+
+/*======================================================================
+headless_picture_data
+======================================================================*/
+static int headless_picture_data (int num, int *height, int *width)
+  {
+  *height = 0;
+  *width = 0;
+  return 0;
+  }
+
+
+/*======================================================================
+headless_random_seed
+======================================================================*/
+static int headless_random_seed (void)
+  {
+  int r = global_headless->random_seed;
+  if (r == -1)
+    /* Use the epoch as seed value */
+    return (time(0) & 0x7fff);
+  else return r;
+  }
+
+
+/*======================================================================
+headless_path_open
+======================================================================*/
+static FILE *headless_path_open (const char *name, const char *mode,
+    long *size)
+  {
+  return fopen (name, mode);
+  }
+
+
+/*======================================================================
+headless_fatal
+======================================================================*/
+static void headless_fatal (const char *s)
+  {
+  fflush (stdout);
+  fprintf (stderr, APPNAME ": ZMachine error: %s\n", s);
+  exit (1);
+  }
+
+
+/*======================================================================
+headless_wrap_window
+The grid backend lets the core wrap text and position the cursor;
+the others don't wrap, so that each paragraph comes out on one
+line and the core ends lines with a newline character
+======================================================================*/
+static int headless_wrap_window (int win)
+  {
+  return global_headless->backend == &headless_grid_backend;
+  }
+
+
+/*======================================================================
+Functions that have nothing to do without a display or sound
+======================================================================*/
+static void headless_nothing (void) {}
+static void headless_nothing_int (int a) {}
+static void headless_nothing_int_int (int a, int b) {}
+static void headless_nothing_int3 (int a, int b, int c) {}
+static void headless_nothing_int5 (int a, int b, int c, int d, int e) {}
+static void headless_nothing_zword (zword a) {}
+static void headless_nothing_string (const zword *s) {}
+static void headless_nothing_menu (int a, int b, const zword *c) {}
+static void headless_nothing_sample (int n, int volume, int repeats,
+    zword eos) {}
+static int headless_zero (void) { return 0; }
+static int headless_zero_int (int a) { return 0; }
+static int headless_zero_zword (zword a) { return 0; }
+static zword headless_zero_colour (int a) { return 0; }
+
+
+/*======================================================================
+The stdio backend: text of the lower window on stdout
+======================================================================*/
+
+/*======================================================================
+stdio_display_char
+======================================================================*/
+static void stdio_display_char (zword c)
+  {
+  if (cwin != 0) return;
+  if (c == ZC_INDENT)
+    fputs ("   ", stdout);
+  else if (c == ZC_GAP)
+    fputs ("  ", stdout);
+  else
+    headless_put_utf8 (c);
+  }
+
+
+/*======================================================================
+stdio_display_string
+======================================================================*/
+static void stdio_display_string (const zword *s)
+  {
+  zword c;
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT || c == ZC_NEW_STYLE)
+      s++;
+    else
+      stdio_display_char (c);
+    }
+  }
+
+
+/*======================================================================
+stdio_read_file_name
+Show the prompt with the name it was answered with. The core doesn't
+end the line after it, so we do
+======================================================================*/
+static int stdio_read_file_name (char *file_name, const char *default_name,
+    int flag)
+  {
+  headless_get_file_name (file_name, default_name);
+  printf ("Please enter a file name [%s]: %s\n", default_name, file_name);
+  return TRUE;
+  }
+
+
+/*======================================================================
+headless_reset_screen
+======================================================================*/
+static void headless_reset_screen (void)
+  {
+  fflush (stdout);
+  }
+
+
+/*======================================================================
+The recording backend: output calls are appended to an in-memory
+log, which can be replayed through another backend later
+======================================================================*/
+
+/*======================================================================
+record_event
+======================================================================*/
+static void record_event (int op, int a, int b, int c, int d, int e)
+  {
+  Headless *self = global_headless;
+  HeadlessEvent *ev;
+
+  if (self->event_count == self->event_size)
+    {
+    int size = self->event_size + HEADLESS_LOG_CHUNK;
+    HeadlessEvent *events = realloc (self->events,
+      size * sizeof (HeadlessEvent));
+    if (!events) headless_fatal ("Out of memory recording output");
+    self->events = events;
+    self->event_size = size;
+    }
+
+  ev = self->events + self->event_count++;
+  ev->op = op;
+  ev->args[0] = a;
+  ev->args[1] = b;
+  ev->args[2] = c;
+  ev->args[3] = d;
+  ev->args[4] = e;
+  }
+
+
+static void record_display_char (zword c)
+  {
+  record_event (HE_CHAR, c, 0, 0, 0, 0);
+  }
+
+static void record_display_string (const zword *s)
+  {
+  zword c;
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT)
+      record_event (HE_SET_FONT, *s++, 0, 0, 0, 0);
+    else if (c == ZC_NEW_STYLE)
+      record_event (HE_SET_TEXT_STYLE, *s++, 0, 0, 0, 0);
+    else
+      record_event (HE_CHAR, c, 0, 0, 0, 0);
+    }
+  }
+
+static void record_erase_area (int top, int left, int bottom, int right,
+    int win)
+  {
+  record_event (HE_ERASE_AREA, top, left, bottom, right, win);
+  }
+
+static void record_scroll_area (int top, int left, int bottom, int right,
+    int units)
+  {
+  record_event (HE_SCROLL_AREA, top, left, bottom, right, units);
+  }
+
+static void record_set_cursor (int row, int col)
+  {
+  record_event (HE_SET_CURSOR, row, col, 0, 0, 0);
+  }
+
+static void record_set_colour (int fg, int bg)
+  {
+  record_event (HE_SET_COLOUR, fg, bg, 0, 0, 0);
+  }
+
+static void record_set_font (int font)
+  {
+  record_event (HE_SET_FONT, font, 0, 0, 0, 0);
+  }
+
+static void record_set_text_style (int style)
+  {
+  record_event (HE_SET_TEXT_STYLE, style, 0, 0, 0, 0);
+  }
+
+static void record_window_height (int win, int height)
+  {
+  record_event (HE_WINDOW_HEIGHT, win, height, 0, 0, 0);
+  }
+
+static void record_draw_picture (int num, int row, int col)
+  {
+  record_event (HE_DRAW_PICTURE, num, row, col, 0, 0);
+  }
+
+static void record_beep (int volume)
+  {
+  record_event (HE_BEEP, volume, 0, 0, 0, 0);
+  }
+
+static void record_start_sample (int n, int volume, int repeats, zword eos)
+  {
+  record_event (HE_START_SAMPLE, n, volume, repeats, eos, 0);
+  }
+
+static void record_stop_sample (int n)
+  {
+  record_event (HE_STOP_SAMPLE, n, 0, 0, 0, 0);
+  }
+
+
+/*======================================================================
+headless_get_events
+Returns the log kept by the recording backend
+======================================================================*/
+const HeadlessEvent *headless_get_events (Headless *self, int *count)
+  {
+  *count = self->event_count;
+  return self->events;
+  }
+
+
+/*======================================================================
+headless_replay
+Send the recorded output calls to another backend, for timing the
+rendering on its own. The backend works on the context bound to the
+calling thread, which must be one it can serve
+======================================================================*/
+void headless_replay (Headless *self, const ZBackend *backend)
+  {
+  const HeadlessEvent *ev = self->events;
+  const HeadlessEvent *end = ev + self->event_count;
+  const ZBackend *saved = self->backend;
+
+  self->backend = backend;
+  for (; ev < end; ev++)
+    {
+    const int *a = ev->args;
+    switch (ev->op)
+      {
+      case HE_CHAR:
+        backend->display_char (a[0]);
+        break;
+      case HE_ERASE_AREA:
+        backend->erase_area (a[0], a[1], a[2], a[3], a[4]);
+        break;
+      case HE_SCROLL_AREA:
+        backend->scroll_area (a[0], a[1], a[2], a[3], a[4]);
+        break;
+      case HE_SET_CURSOR:
+        backend->set_cursor (a[0], a[1]);
+        break;
+      case HE_SET_COLOUR:
+        backend->set_colour (a[0], a[1]);
+        break;
+      case HE_SET_FONT:
+        backend->set_font (a[0]);
+        break;
+      case HE_SET_TEXT_STYLE:
+        backend->set_text_style (a[0]);
+        break;
+      case HE_WINDOW_HEIGHT:
+        backend->window_height (a[0], a[1]);
+        break;
+      case HE_DRAW_PICTURE:
+        backend->draw_picture (a[0], a[1], a[2]);
+        break;
+      case HE_BEEP:
+        backend->beep (a[0]);
+        break;
+      case HE_START_SAMPLE:
+        backend->start_sample (a[0], a[1], a[2], a[3]);
+        break;
+      case HE_STOP_SAMPLE:
+        backend->stop_sample (a[0]);
+        break;
+      }
+    }
+  self->backend = saved;
+  }
+
+
+/*======================================================================
+The grid backend: the core positions the cursor and wraps text, and
+we render into a rows x cols array of characters, as a terminal
+would. The whole screen is written to stdout whenever the game waits
+for input, and when it ends
+======================================================================*/
+
+#define GRID_CELL(self,row,col) \
+  ((self)->grid[((row) - 1) * (self)->cols + (col) - 1])
+
+
+/*======================================================================
+grid_display_char
+======================================================================*/
+static void grid_display_char (zword c)
+  {
+  Headless *self = global_headless;
+
+  if (c == ZC_INDENT)
+    {
+    grid_display_char (' '); grid_display_char (' '); grid_display_char (' ');
+    return;
+    }
+  if (c == ZC_GAP)
+    {
+    grid_display_char (' '); grid_display_char (' ');
+    return;
+    }
+
+  if (self->cursor_row >= 1 && self->cursor_row <= self->rows
+      && self->cursor_col >= 1 && self->cursor_col <= self->cols)
+    GRID_CELL (self, self->cursor_row, self->cursor_col) = c;
+  self->cursor_col++;
+  }
+
+
+/*======================================================================
+grid_display_string
+======================================================================*/
+static void grid_display_string (const zword *s)
+  {
+  zword c;
+  while ((c = *s++) != 0)
+    {
+    if (c == ZC_NEW_FONT || c == ZC_NEW_STYLE)
+      s++;
+    else
+      grid_display_char (c);
+    }
+  }
+
+
+/*======================================================================
+grid_set_cursor
+======================================================================*/
+static void grid_set_cursor (int row, int col)
+  {
+  Headless *self = global_headless;
+  self->cursor_row = row;
+  self->cursor_col = col;
+  }
+
+
+/*======================================================================
+grid_clip
+Limit an area given by the core to the screen. Returns FALSE if
+nothing of it is left
+======================================================================*/
+static int grid_clip (Headless *self, int *top, int *left, int *bottom,
+    int *right)
+  {
+  if (*top < 1) *top = 1;
+  if (*left < 1) *left = 1;
+  if (*bottom > self->rows) *bottom = self->rows;
+  if (*right > self->cols) *right = self->cols;
+  return *top <= *bottom && *left <= *right;
+  }
+
+
+/*======================================================================
+grid_erase_area
+======================================================================*/
+static void grid_erase_area (int top, int left, int bottom, int right,
+    int win)
+  {
+  Headless *self = global_headless;
+  int row, col;
+  if (!grid_clip (self, &top, &left, &bottom, &right)) return;
+  for (row = top; row <= bottom; row++)
+    for (col = left; col <= right; col++)
+      GRID_CELL (self, row, col) = ' ';
+  }
+
+
+/*======================================================================
+grid_scroll_area
+Scroll the area up by the given number of rows, or down if it is
+negative
+======================================================================*/
+static void grid_scroll_area (int top, int left, int bottom, int right,
+    int units)
+  {
+  Headless *self = global_headless;
+  int row, width;
+  if (!grid_clip (self, &top, &left, &bottom, &right)) return;
+  width = (right - left + 1) * sizeof (zword);
+
+  if (units > 0)
+    {
+    for (row = top; row + units <= bottom; row++)
+      memcpy (&GRID_CELL (self, row, left),
+        &GRID_CELL (self, row + units, left), width);
+    grid_erase_area (bottom - units + 1 > top ? bottom - units + 1 : top,
+      left, bottom, right, 0);
+    }
+  else if (units < 0)
+    {
+    for (row = bottom; row + units >= top; row--)
+      memcpy (&GRID_CELL (self, row, left),
+        &GRID_CELL (self, row + units, left), width);
+    grid_erase_area (top, left,
+      top - units - 1 < bottom ? top - units - 1 : bottom, right, 0);
+    }
+  }
+
+
+/*======================================================================
+grid_dump
+Write the screen to stdout, without trailing blanks or blank lines
+======================================================================*/
+static void grid_dump (Headless *self)
+  {
+  int row, col, last_row = 0;
+
+  for (row = 1; row <= self->rows; row++)
+    for (col = 1; col <= self->cols; col++)
+      if (GRID_CELL (self, row, col) != ' ') last_row = row;
+
+  for (row = 1; row <= last_row; row++)
+    {
+    int end = self->cols;
+    while (end > 0 && GRID_CELL (self, row, end) == ' ') end--;
+    for (col = 1; col <= end; col++)
+      headless_put_utf8 (GRID_CELL (self, row, col));
+    putchar ('\n');
+    }
+  putchar ('\n');
+  }
+
+
+/*======================================================================
+grid_read_line
+Show the screen, then read as usual. The input is drawn at the
+cursor, as the core expects of the backend
+======================================================================*/
+static zword grid_read_line (int max, zword *buf, int timeout, int width,
+    int continued)
+  {
+  Headless *self = global_headless;
+  int echo = self->echo;
+  zword key;
+
+  grid_dump (self);
+  self->echo = TRUE;
+  key = headless_read_line (max, buf, timeout, width, continued);
+  self->echo = echo;
+  return key;
+  }
+
+
+/*======================================================================
+grid_read_key
+======================================================================*/
+static zword grid_read_key (int timeout, int show_cursor)
+  {
+  grid_dump (global_headless);
+  return headless_read_key (timeout, show_cursor);
+  }
+
+
+/*======================================================================
+grid_reset_screen
+======================================================================*/
+static void grid_reset_screen (void)
+  {
+  grid_dump (global_headless);
+  fflush (stdout);
+  }
+
+
+/*======================================================================
+The backend tables
+======================================================================*/
+
+const ZBackend headless_stdio_backend =
+  {
+  "stdio",
+  headless_nothing_int,		/* beep */
+  headless_zero_int,		/* buffer_screen */
+  headless_char_width,
+  headless_check_unicode,
+  stdio_display_char,
+  stdio_display_string,
+  headless_nothing_int3,	/* draw_picture */
+  headless_nothing_int5,	/* erase_area */
+  headless_fatal,
+  headless_nothing_int,		/* finish_with_sample */
+  headless_font_data,
+  headless_zero_zword,		/* from_true_colour */
+  headless_init_screen,
+  headless_nothing_menu,
+  headless_nothing,		/* more_prompt */
+  headless_path_open,
+  headless_zero,		/* peek_colour */
+  headless_picture_data,
+  headless_nothing_int,		/* prepare_sample */
+  headless_random_seed,
+  stdio_read_file_name,
+  headless_read_key,
+  headless_read_line,
+  headless_read_mouse,
+  headless_reset_screen,
+  headless_nothing_int,		/* restart_game */
+  headless_nothing_int5,	/* scroll_area */
+  headless_nothing_zword,	/* scrollback_char */
+  headless_nothing_int,		/* scrollback_erase */
+  headless_nothing_int_int,	/* set_colour */
+  headless_nothing_int_int,	/* set_cursor */
+  headless_nothing_int,		/* set_font */
+  headless_nothing_int,		/* set_text_style */
+  headless_nothing_sample,	/* start_sample */
+  headless_nothing_int,		/* stop_sample */
+  headless_string_width,
+  NULL,				/* tick */
+  headless_zero_colour,		/* to_true_colour */
+  headless_wrap_window,
+  headless_nothing_int_int	/* window_height */
+  };
+
+const ZBackend headless_null_backend =
+  {
+  "null",
+  headless_nothing_int,		/* beep */
+  headless_zero_int,		/* buffer_screen */
+  headless_char_width,
+  headless_check_unicode,
+  headless_nothing_zword,	/* display_char */
+  headless_nothing_string,	/* display_string */
+  headless_nothing_int3,	/* draw_picture */
+  headless_nothing_int5,	/* erase_area */
+  headless_fatal,
+  headless_nothing_int,		/* finish_with_sample */
+  headless_font_data,
+  headless_zero_zword,		/* from_true_colour */
+  headless_init_screen,
+  headless_nothing_menu,
+  headless_nothing,		/* more_prompt */
+  headless_path_open,
+  headless_zero,		/* peek_colour */
+  headless_picture_data,
+  headless_nothing_int,		/* prepare_sample */
+  headless_random_seed,
+  headless_read_file_name,
+  headless_read_key,
+  headless_read_line,
+  headless_read_mouse,
+  headless_reset_screen,
+  headless_nothing_int,		/* restart_game */
+  headless_nothing_int5,	/* scroll_area */
+  headless_nothing_zword,	/* scrollback_char */
+  headless_nothing_int,		/* scrollback_erase */
+  headless_nothing_int_int,	/* set_colour */
+  headless_nothing_int_int,	/* set_cursor */
+  headless_nothing_int,		/* set_font */
+  headless_nothing_int,		/* set_text_style */
+  headless_nothing_sample,	/* start_sample */
+  headless_nothing_int,		/* stop_sample */
+  headless_string_width,
+  NULL,				/* tick */
+  headless_zero_colour,		/* to_true_colour */
+  headless_wrap_window,
+  headless_nothing_int_int	/* window_height */
+  };
+
+const ZBackend headless_record_backend =
+  {
+  "record",
+  record_beep,
+  headless_zero_int,		/* buffer_screen */
+  headless_char_width,
+  headless_check_unicode,
+  record_display_char,
+  record_display_string,
+  record_draw_picture,
+  record_erase_area,
+  headless_fatal,
+  headless_nothing_int,		/* finish_with_sample */
+  headless_font_data,
+  headless_zero_zword,		/* from_true_colour */
+  headless_init_screen,
+  headless_nothing_menu,
+  headless_nothing,		/* more_prompt */
+  headless_path_open,
+  headless_zero,		/* peek_colour */
+  headless_picture_data,
+  headless_nothing_int,		/* prepare_sample */
+  headless_random_seed,
+  headless_read_file_name,
+  headless_read_key,
+  headless_read_line,
+  headless_read_mouse,
+  headless_reset_screen,
+  headless_nothing_int,		/* restart_game */
+  record_scroll_area,
+  headless_nothing_zword,	/* scrollback_char */
+  headless_nothing_int,		/* scrollback_erase */
+  record_set_colour,
+  record_set_cursor,
+  record_set_font,
+  record_set_text_style,
+  record_start_sample,
+  record_stop_sample,
+  headless_string_width,
+  NULL,				/* tick */
+  headless_zero_colour,		/* to_true_colour */
+  headless_wrap_window,
+  record_window_height
+  };
+
+const ZBackend headless_grid_backend =
+  {
+  "grid",
+  headless_nothing_int,		/* beep */
+  headless_zero_int,		/* buffer_screen */
+  headless_char_width,
+  headless_check_unicode,
+  grid_display_char,
+  grid_display_string,
+  headless_nothing_int3,	/* draw_picture */
+  grid_erase_area,
+  headless_fatal,
+  headless_nothing_int,		/* finish_with_sample */
+  headless_font_data,
+  headless_zero_zword,		/* from_true_colour */
+  headless_init_screen,
+  headless_nothing_menu,
+  headless_nothing,		/* more_prompt */
+  headless_path_open,
+  headless_zero,		/* peek_colour */
+  headless_picture_data,
+  headless_nothing_int,		/* prepare_sample */
+  headless_random_seed,
+  headless_read_file_name,
+  grid_read_key,
+  grid_read_line,
+  headless_read_mouse,
+  grid_reset_screen,
+  headless_nothing_int,		/* restart_game */
+  grid_scroll_area,
+  headless_nothing_zword,	/* scrollback_char */
+  headless_nothing_int,		/* scrollback_erase */
+  headless_nothing_int_int,	/* set_colour */
+  grid_set_cursor,
+  headless_nothing_int,		/* set_font */
+  headless_nothing_int,		/* set_text_style */
+  headless_nothing_sample,	/* start_sample */
+  headless_nothing_int,		/* stop_sample */
+  headless_string_width,
+  NULL,				/* tick */
+  headless_zero_colour,		/* to_true_colour */
+  headless_wrap_window,
+  headless_nothing_int_int	/* window_height */
+  };
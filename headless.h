@@ -0,0 +1,41 @@
+#pragma once
+
+/*======================================================================
+headless.h
+Backends for the frotz core that need no display: plain text on
+stdout, a null backend that discards all output, a recording backend
+that keeps a log of the output calls in memory, and a backend that
+renders into a character grid. All of them take commands one per
+line from a file descriptor. The frotz.h types must be visible
+before this file is included.
+======================================================================*/
+
+typedef struct _Headless Headless;
+
+// One output call captured by the recording backend
+typedef struct _HeadlessEvent
+  {
+  int op;
+  int args[5];
+  } HeadlessEvent;
+
+extern const ZBackend headless_stdio_backend;
+extern const ZBackend headless_null_backend;
+extern const ZBackend headless_record_backend;
+extern const ZBackend headless_grid_backend;
+
+const ZBackend *headless_find_backend (const char *name);
+
+Headless *headless_new (int input_fd);
+void headless_free (Headless *self);
+
+void headless_set_max_speed (Headless *self, int f);
+void headless_set_random_seed (Headless *self, int seed);
+void headless_set_screen_size (Headless *self, int rows, int cols);
+
+void headless_attach (Headless *self, ZContext *context,
+    const ZBackend *backend);
+void headless_run (Headless *self);
+
+const HeadlessEvent *headless_get_events (Headless *self, int *count);
+void headless_replay (Headless *self, const ZBackend *backend);
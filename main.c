@@ -44,6 +44,8 @@ void handle_child_finished (int arg)
 
 int main (int argc, char **argv)
 {
+  // The interpreter runs on its own thread
+  if (!g_thread_supported ()) g_thread_init (NULL);
   gtk_init (&argc, &argv);
 
   GError *error = NULL;
@@ -0,0 +1,150 @@
+/*======================================================================
+memdiffbench.c
+Times the kernels that undo and the timeline use to record each turn,
+mem_diff and mem_undiff, as the interpreter builds them -- a word, or
+16 bytes with SSE2, at a time -- against the byte loops they replaced.
+The area is the dynamic memory of a story file, test.z5 by default,
+with every block marked dirty. Both versions must produce the same
+differences. "make bench" builds and runs it.
+======================================================================*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "frotz.h"
+
+#define BENCH_REPS 100000
+
+// frotz_memdiff.c, as the interpreter has it
+long mem_diff (zbyte *, zbyte *, zword, zbyte *, const zbyte *);
+void mem_undiff (zbyte *, long, zbyte *);
+
+// frotz_memdiff.c built with BYTE_MEM_DIFF, and its functions renamed
+long byte_mem_diff (zbyte *, zbyte *, zword, zbyte *, const zbyte *);
+void byte_mem_undiff (zbyte *, long, zbyte *);
+
+typedef long (*DiffFunc) (zbyte *, zbyte *, zword, zbyte *, const zbyte *);
+typedef void (*UndiffFunc) (zbyte *, long, zbyte *);
+
+
+/*======================================================================
+bench_time
+Returns a monotonic time in seconds
+======================================================================*/
+static double bench_time (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/*======================================================================
+bench_run
+Returns the time for one difference of cur from prev, and one undiff
+to put prev back, in nanoseconds. Each pass leaves prev as it found
+it, so every pass does the same work. The difference is left in diff,
+and its length in *diff_len
+======================================================================*/
+static double bench_run (DiffFunc diff_func, UndiffFunc undiff_func,
+    zbyte *cur, zbyte *prev, zword size, zbyte *diff, const zbyte *dirty,
+    long *diff_len)
+  {
+  double start = bench_time ();
+  long len = 0;
+  int i;
+  for (i = 0; i < BENCH_REPS; i++)
+    {
+    len = diff_func (cur, prev, size, diff, dirty);
+    undiff_func (diff, len, prev);
+    }
+  *diff_len = len;
+  return (bench_time () - start) * 1e9 / BENCH_REPS;
+  }
+
+
+/*======================================================================
+main
+======================================================================*/
+int main (int argc, char **argv)
+  {
+  static const int changes[] = { 0, 12, 100, -1 };
+  static zbyte dirty[DIRTY_MAP_SIZE];
+  const char *story = argc > 1 ? argv[1] : "test.z5";
+  zbyte header[64];
+  zbyte *cur, *prev, *diff, *byte_diff;
+  zword size;
+  int i, c;
+  FILE *f;
+
+  f = fopen (story, "rb");
+  if (!f || fread (header, 1, sizeof (header), f) != sizeof (header))
+    {
+    fprintf (stderr, "memdiffbench: can't read %s\n", story);
+    exit (1);
+    }
+  size = (header[H_DYNAMIC_SIZE] << 8) | header[H_DYNAMIC_SIZE + 1];
+  if (size < sizeof (header))
+    {
+    fprintf (stderr, "memdiffbench: %s isn't a story file\n", story);
+    exit (1);
+    }
+
+  // A difference is at most two bytes for each one compared, and
+  //  runs of unchanged bytes fit in three
+  cur = malloc (size);
+  prev = malloc (size);
+  diff = malloc (2 * size + 3);
+  byte_diff = malloc (2 * size + 3);
+  if (!cur || !prev || !diff || !byte_diff)
+    {
+    fprintf (stderr, "memdiffbench: out of memory\n");
+    exit (1);
+    }
+  memcpy (cur, header, sizeof (header));
+  if (fread (cur + sizeof (header), 1, size - sizeof (header), f)
+      != size - sizeof (header))
+    {
+    fprintf (stderr, "memdiffbench: %s is too short\n", story);
+    exit (1);
+    }
+  fclose (f);
+  memset (dirty, 0xff, sizeof (dirty));
+
+  printf ("%s: %u bytes of dynamic memory, every block dirty\n",
+    story, (unsigned) size);
+  printf ("changes      bytes   words   speedup\n");
+
+  srand (1);
+  for (c = 0; changes[c] >= 0; c++)
+    {
+    long len, byte_len;
+    double t, byte_t;
+
+    memcpy (prev, cur, size);
+    for (i = 0; i < changes[c]; i++)
+      prev[rand () % size] ^= 1 + rand () % 255;
+
+    byte_t = bench_run (byte_mem_diff, byte_mem_undiff, cur, prev, size,
+      byte_diff, dirty, &byte_len);
+    t = bench_run (mem_diff, mem_undiff, cur, prev, size, diff, dirty,
+      &len);
+
+    if (len != byte_len || memcmp (diff, byte_diff, len) != 0)
+      {
+      fprintf (stderr, "memdiffbench: the differences don't match with"
+        " %d changes\n", changes[c]);
+      exit (1);
+      }
+
+    printf ("%7d %7.0fns %6.0fns %8.1fx\n", changes[c], byte_t, t,
+      byte_t / t);
+    }
+
+  free (cur);
+  free (prev);
+  free (diff);
+  free (byte_diff);
+  return 0;
+  }
+